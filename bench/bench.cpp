@@ -0,0 +1,325 @@
+// X4 assembler benchmark
+//
+// Build next to the assembler sources:
+//   g++ -std=c++17 -O2 -pthread -I../src bench.cpp ../src/assembler.cpp ../src/Types.cpp -o x4bench
+//
+// Every corpus is timed phase by phase, the best of the iterations is reported:
+//   load   map the source and touch every page
+//   lex    delimiter scan of the whole source
+//   size   statement parsing, instruction sizing and label collection
+//   emit   the complete single pass assembly, labels, encoding and fixups
+//   write  one timing per output format
+//
+// The images of the default corpora are checked against bench/golden, a run whose bytes differ fails.
+// After a change that is meant to change the bytes, rewrite them with: x4bench --record
+
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <sstream>
+#include <chrono>
+#include <filesystem>
+#include <vector>
+
+#include "types.h"
+#include "source.h"
+#include "assembler.h"
+#include "instructions.h"
+#include "writers.h"
+
+#include "generator.h"
+
+#define BENCH_ITERATIONS  10
+
+// Golden images of the default corpora, next to this file
+#define BENCH_GOLDEN_DIRECTORY  "golden"
+
+struct Corpus {
+    std::string name;
+    std::string filename;
+};
+
+struct PhaseTiming {
+    const char* name;
+    double seconds;
+    size_t bytes;           // Bytes processed, the source or the output
+};
+
+
+double Seconds(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// Keep the best time of a phase
+void Record(std::vector<PhaseTiming>& timings, unsigned int index, const char* name, double seconds, size_t bytes) {
+    if (timings.size() <= index) {
+        PhaseTiming timing = {name, seconds, bytes};
+        timings.push_back(timing);
+        return;
+    }
+    if (seconds < timings[index].seconds)
+        timings[index].seconds = seconds;
+}
+
+
+// Sizing pass, the line by line work the assembler does before encoding
+uint32_t SizeSource(const ScanResult& scan, SymbolTable& labels) {
+    uint32_t programSize = 0;
+    Statement statement;
+
+    for (uint32_t ln=0; ln < scan.lines.size(); ln++) {
+        uint32_t firstMark = scan.lineMarks[ln];
+        ParseStatement(scan.lines[ln], scan.marks.data() + firstMark, scan.lineMarks[ln + 1] - firstMark, statement);
+
+        if (!statement.label.empty())
+            labels.Insert(statement.label, programSize);
+        if (statement.tokenCount == 0)
+            continue;
+
+        const Instruction* instruction = FindInstruction( statement.token[0] );
+        if (instruction != nullptr)
+            programSize += InstructionSize(*instruction, statement);
+    }
+    return programSize;
+}
+
+
+// Time every phase of one corpus
+int BenchCorpus(const Corpus& corpus, unsigned int iterations, const std::string& scratch, std::vector<PhaseTiming>& timings, Image& image, size_t& lineCount) {
+    const char* formatNames[] = {"write.bin", "write.carray", "write.ihex", "write.srec"};
+    const int formats[] = {OUTPUT_BINARY, OUTPUT_CARRAY, OUTPUT_IHEX, OUTPUT_SREC};
+
+    x4::Assembler assembler;
+    ScanResult scan;
+    Arena arena;
+
+    for (unsigned int i=0; i < iterations; i++) {
+
+        // Load
+        auto start = std::chrono::steady_clock::now();
+        SourceFile source;
+        if (source.Open(corpus.filename) != 0) {
+            std::cerr << "Could not open " << corpus.filename << std::endl;
+            return -1;
+        }
+        std::string_view text = source.Text();
+        volatile uint8_t touch = 0;
+        for (size_t p=0; p < text.size(); p += 4096)
+            touch += text[p];
+        Record(timings, 0, "load", Seconds(start), text.size());
+
+        // Lex
+        start = std::chrono::steady_clock::now();
+        ScanSource(text, scan);
+        Record(timings, 1, "lex", Seconds(start), text.size());
+        lineCount = scan.lines.size();
+
+        // Size
+        start = std::chrono::steady_clock::now();
+        {
+            SymbolTable labels(&arena);
+            SizeSource(scan, labels);
+            labels.clear();
+        }
+        arena.Reset();
+        Record(timings, 2, "size", Seconds(start), text.size());
+
+        // Emit
+        x4::AssemblyResult result;
+        start = std::chrono::steady_clock::now();
+        int theCakeBaked = assembler.Assemble(scan, result);
+        Record(timings, 3, "emit", Seconds(start), text.size());
+
+        if (theCakeBaked != 0) {
+            for (unsigned int d=0; d < result.diagnostics.size(); d++)
+                std::cerr << corpus.name << "(" << result.diagnostics[d].line + 1 << "): " << result.diagnostics[d].message << std::endl;
+            return -1;
+        }
+
+        // Write
+        for (unsigned int f=0; f < 4; f++) {
+            std::string filename = scratch + "/" + corpus.name + "." + (formatNames[f] + 6);
+            start = std::chrono::steady_clock::now();
+            if (WriteImage(formats[f], filename, result.image) != 0) {
+                std::cerr << "Could not write " << filename << std::endl;
+                return -1;
+            }
+            double seconds = Seconds(start);
+            std::error_code error;
+            Record(timings, 4 + f, formatNames[f], seconds, std::filesystem::file_size(filename, error));
+        }
+
+        image.swap(result.image);
+    }
+    return 0;
+}
+
+
+// Compare the image with the golden one, or replace it when recording
+int CheckGolden(const Corpus& corpus, const Image& image, const std::string& golden, bool record) {
+    std::string filename = golden + "/" + corpus.name + ".bin";
+
+    if (record) {
+        std::filesystem::create_directories(golden);
+        std::cout << "  golden: recorded " << filename << std::endl;
+        return WriteBinary(filename, image);
+    }
+
+    SourceFile expected;
+    if (expected.Open(filename) != 0) {
+        std::cout << "  golden: missing " << filename << std::endl;
+        return -1;
+    }
+    std::string_view bytes = expected.Text();
+    std::vector<uint8_t> scratch;
+    const uint8_t* flat = image.Flat(scratch);
+    if (bytes.size() != image.End() || (image.End() > 0 && memcmp(bytes.data(), flat, image.End()) != 0)) {
+        std::cout << "  golden: MISMATCH against " << filename << std::endl;
+        return -1;
+    }
+    std::cout << "  golden: match" << std::endl;
+    return 0;
+}
+
+
+void PrintTimings(const Corpus& corpus, const std::vector<PhaseTiming>& timings, size_t lineCount) {
+    std::cout << corpus.name << " (" << lineCount << " lines, " << timings[0].bytes << " bytes)" << std::endl;
+    std::cout << "  " << std::left << std::setw(14) << "phase" << std::right
+              << std::setw(12) << "ms" << std::setw(16) << "lines/s" << std::setw(12) << "MB/s" << std::endl;
+
+    double total = 0;
+    for (unsigned int i=0; i < timings.size(); i++) {
+        const PhaseTiming& timing = timings[i];
+        double seconds = (timing.seconds > 0) ? timing.seconds : 1e-9;
+        total += timing.seconds;
+        std::cout << "  " << std::left << std::setw(14) << timing.name << std::right << std::fixed
+                  << std::setw(12) << std::setprecision(3) << timing.seconds * 1000.0
+                  << std::setw(16) << std::setprecision(0) << lineCount / seconds
+                  << std::setw(12) << std::setprecision(1) << timing.bytes / seconds / 1e6 << std::endl;
+    }
+    std::cout << "  " << std::left << std::setw(14) << "total" << std::right
+              << std::setw(12) << std::setprecision(3) << total * 1000.0 << std::endl;
+}
+
+
+void PrintUsage(const char* program) {
+    std::cerr << "Usage: " << program << " [options] [input.asm]...\n";
+    std::cerr << "Without inputs a generated corpus of each --lines size is benchmarked.\n\n";
+    std::cerr << "  --generate=<file>   write a generated source and exit\n";
+    std::cerr << "  --lines=N[,N...]    generated line counts (default 10000,100000)\n";
+    std::cerr << "  --seed=N            generator seed\n";
+    std::cerr << "  --labels=F          fraction of lines defining a label\n";
+    std::cerr << "  --forward=F         fraction of label references pointing forward\n";
+    std::cerr << "  --db-length=N       average DB string length\n";
+    std::cerr << "  --mix=class:W,...   instruction weights, classes nop alu stack int cmp mov branch db\n";
+    std::cerr << "  --iterations=N      runs per corpus, the best is reported (default " << BENCH_ITERATIONS << ")\n";
+    std::cerr << "  --golden=<dir>      compare every image with <dir>/<corpus>.bin, the default corpora\n";
+    std::cerr << "                      are always compared with the golden images next to the benchmark\n";
+    std::cerr << "  --record            write the images to the golden directory instead\n";
+}
+
+
+int main(int argc, char* argv[]) {
+    GeneratorSettings settings = DefaultGeneratorSettings();
+    std::vector<uint32_t> lineCounts = {10000, 100000};
+    std::vector<Corpus> corpora;
+    std::string generateFilename;
+    std::string golden;
+    bool record = false;
+    bool generatorChanged = false;          // The corpora are not the ones of the checked in images
+    unsigned int iterations = BENCH_ITERATIONS;
+
+    for (int i=1; i < argc; i++) {
+        std::string argument = argv[i];
+        size_t equals = argument.find('=');
+        std::string option = argument.substr(0, equals);
+        std::string value = (equals == std::string::npos) ? "" : argument.substr(equals + 1);
+
+        if (option == "--generate") {generateFilename = value; continue;}
+        if (option == "--seed")     {settings.seed = String.ToLongUint(value); generatorChanged = true; continue;}
+        if (option == "--labels")   {settings.labelDensity = String.ToDouble(value); generatorChanged = true; continue;}
+        if (option == "--forward")  {settings.forwardRatio = String.ToDouble(value); generatorChanged = true; continue;}
+        if (option == "--db-length") {settings.stringLength = String.ToUint(value); generatorChanged = true; continue;}
+        if (option == "--iterations") {iterations = String.ToUint(value); continue;}
+        if (option == "--golden")   {golden = value; continue;}
+        if (option == "--record")   {record = true; continue;}
+
+        if (option == "--lines") {
+            generatorChanged = true;
+            lineCounts.clear();
+            std::vector<std::string> counts = String.Explode(value, ',');
+            for (unsigned int c=0; c < counts.size(); c++)
+                lineCounts.push_back(String.ToUint(counts[c]));
+            continue;
+        }
+
+        if (option == "--mix") {
+            generatorChanged = true;
+            for (unsigned int m=0; m < GENERATE_CLASSES; m++)
+                settings.mix[m] = 0;
+            if (ParseGeneratorMix(value, settings) != 0) {
+                PrintUsage(argv[0]);
+                return 1;
+            }
+            continue;
+        }
+
+        if (argument.compare(0, 2, "--") == 0) {
+            PrintUsage(argv[0]);
+            return 1;
+        }
+
+        Corpus corpus;
+        corpus.filename = argument;
+        corpus.name = std::filesystem::path(argument).stem().string();
+        corpora.push_back(corpus);
+    }
+
+    if (iterations == 0)
+        iterations = 1;
+
+    // Only write a source
+    if (!generateFilename.empty()) {
+        settings.lines = lineCounts[0];
+        std::ofstream output(generateFilename, std::ios::binary);
+        output << GenerateSource(settings);
+        return output ? 0 : 1;
+    }
+
+    std::string scratch = (std::filesystem::temp_directory_path() / "x4bench").string();
+    std::filesystem::create_directories(scratch);
+
+    // Generated corpora, the default ones have golden images
+    if (corpora.size() == 0) {
+        if (golden.empty() && !generatorChanged)
+            golden = (std::filesystem::path(__FILE__).parent_path() / BENCH_GOLDEN_DIRECTORY).string();
+        for (unsigned int i=0; i < lineCounts.size(); i++) {
+            settings.lines = lineCounts[i];
+            Corpus corpus;
+            corpus.name = "synthetic-" + std::to_string(settings.lines) + "-" + std::to_string(settings.seed);
+            corpus.filename = scratch + "/" + corpus.name + ".asm";
+            std::ofstream output(corpus.filename, std::ios::binary);
+            output << GenerateSource(settings);
+            corpora.push_back(corpus);
+        }
+    }
+
+    int failed = 0;
+    for (unsigned int i=0; i < corpora.size(); i++) {
+        std::vector<PhaseTiming> timings;
+        Image image;
+        size_t lineCount = 0;
+
+        if (BenchCorpus(corpora[i], iterations, scratch, timings, image, lineCount) != 0) {
+            failed++;
+            continue;
+        }
+        PrintTimings(corpora[i], timings, lineCount);
+
+        if (!golden.empty() && CheckGolden(corpora[i], image, golden, record) != 0)
+            failed++;
+        std::cout << std::endl;
+    }
+
+    return (failed > 0) ? 1 : 0;
+}
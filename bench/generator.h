@@ -0,0 +1,209 @@
+#ifndef _SOURCE_GENERATOR__
+#define _SOURCE_GENERATOR__
+
+#include <cstdint>
+#include <string>
+
+// Instruction classes the generator picks from
+#define GENERATE_NOP     0   // NOP RET CLI STI
+#define GENERATE_ALU     1   // ADD SUB MUL DIV INC DEC
+#define GENERATE_STACK   2   // PUSH POP
+#define GENERATE_INT     3   // INT
+#define GENERATE_CMP     4   // CMP register or immediate
+#define GENERATE_MOV     5   // MOV register, immediate or label address
+#define GENERATE_BRANCH  6   // JMP JE JNE JG JL CALL
+#define GENERATE_DB      7   // DB string
+#define GENERATE_CLASSES 8
+
+// Shape of a generated source
+struct GeneratorSettings {
+    uint64_t seed;
+    uint32_t lines;                         // Instruction and label lines after the header
+    double labelDensity;                    // Fraction of lines that define a label
+    double forwardRatio;                    // Fraction of label references to a label defined further down
+    uint32_t stringLength;                  // Average DB string length
+    uint32_t variables;                     // Variables defined before the text section
+    uint32_t mix[GENERATE_CLASSES];         // Relative weight of each instruction class
+};
+
+/// Return the default settings, a mix close to hand written code.
+inline GeneratorSettings DefaultGeneratorSettings() {
+    GeneratorSettings settings;
+    settings.seed = 1;
+    settings.lines = 10000;
+    settings.labelDensity = 0.08;
+    settings.forwardRatio = 0.5;
+    settings.stringLength = 12;
+    settings.variables = 8;
+
+    const uint32_t mix[GENERATE_CLASSES] = {10, 12, 10, 4, 12, 24, 20, 8};
+    for (unsigned int i=0; i < GENERATE_CLASSES; i++)
+        settings.mix[i] = mix[i];
+    return settings;
+}
+
+/// Parse a mix like "mov:30,branch:10" into the settings, returns -1 on an unknown class.
+inline int ParseGeneratorMix(const std::string& text, GeneratorSettings& settings) {
+    const char* names[GENERATE_CLASSES] = {"nop", "alu", "stack", "int", "cmp", "mov", "branch", "db"};
+
+    size_t start = 0;
+    while (start < text.size()) {
+        size_t end = text.find(',', start);
+        if (end == std::string::npos)
+            end = text.size();
+        std::string item = text.substr(start, end - start);
+        start = end + 1;
+
+        size_t colon = item.find(':');
+        if (colon == std::string::npos)
+            return -1;
+        std::string name = item.substr(0, colon);
+
+        int index = -1;
+        for (unsigned int i=0; i < GENERATE_CLASSES; i++)
+            if (name == names[i])
+                index = i;
+        if (index < 0)
+            return -1;
+        settings.mix[index] = std::stoul(item.substr(colon + 1));
+    }
+    return 0;
+}
+
+
+// Small deterministic random source so a seed gives the same corpus everywhere
+struct GeneratorRandom {
+    uint64_t state;
+
+    uint64_t Next() {
+        // splitmix64
+        uint64_t z = (state += 0x9E3779B97F4A7C15ull);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+        return z ^ (z >> 31);
+    }
+
+    uint32_t Below(uint32_t count) {return (uint32_t)(Next() % count);}
+
+    double Unit() {return (Next() >> 11) * (1.0 / 9007199254740992.0);}
+};
+
+
+/// Generate an X4 source. The same settings always produce the same text.
+inline std::string GenerateSource(const GeneratorSettings& settings) {
+    static const char* noOperand[]  = {"NOP", "RET", "CLI", "STI"};
+    static const char* alu[]        = {"ADD", "SUB", "MUL", "DIV", "INC", "DEC"};
+    static const char* registers[]  = {"AL", "AH", "BL", "BH", "CL", "CH", "DL", "DH"};
+    static const char* registers16[] = {"AX", "BX", "CX", "DX"};
+    static const char* branches[]   = {"JMP", "JE", "JNE", "JG", "JL", "CALL"};
+    static const char hexDigits[]   = "0123456789ABCDEF";
+
+    GeneratorRandom random;
+    random.state = settings.seed;
+
+    uint32_t labelCount = (uint32_t)(settings.lines * settings.labelDensity);
+    if (labelCount == 0)
+        labelCount = 1;
+
+    // An empty mix falls back to the default one
+    uint32_t mix[GENERATE_CLASSES];
+    uint32_t mixTotal = 0;
+    for (unsigned int i=0; i < GENERATE_CLASSES; i++)
+        mixTotal += settings.mix[i];
+    for (unsigned int i=0; i < GENERATE_CLASSES; i++)
+        mix[i] = (mixTotal > 0) ? settings.mix[i] : DefaultGeneratorSettings().mix[i];
+    mixTotal = 0;
+    for (unsigned int i=0; i < GENERATE_CLASSES; i++)
+        mixTotal += mix[i];
+
+    std::string source;
+    source.reserve((size_t)settings.lines * 16 + 256);
+
+    // Header with the variables
+    source += "section .data\n";
+    for (uint32_t i=0; i < settings.variables; i++) {
+        source += "    var" + std::to_string(i) + " = 0x";
+        source += hexDigits[random.Below(16)];
+        source += hexDigits[random.Below(16)];
+        source += '\n';
+    }
+    source += "\nsection .text\n";
+
+    std::string hexByte = "0x00";
+    uint32_t labelsDefined = 0;
+
+    for (uint32_t line=0; line < settings.lines; line++) {
+
+        // Labels are spread evenly over the lines
+        uint32_t due = (uint32_t)((uint64_t)labelCount * (line + 1) / settings.lines);
+        if (labelsDefined < due) {
+            source += "LABEL" + std::to_string(labelsDefined) + ":\n";
+            labelsDefined++;
+            continue;
+        }
+
+        hexByte[2] = hexDigits[random.Below(16)];
+        hexByte[3] = hexDigits[random.Below(16)];
+
+        // Pick a class by weight
+        uint32_t pick = random.Below(mixTotal);
+        unsigned int kind = 0;
+        while (pick >= mix[kind]) {
+            pick -= mix[kind];
+            kind++;
+        }
+
+        // Label reference, forward ones point at a label defined further down
+        std::string target;
+        if (kind == GENERATE_BRANCH || kind == GENERATE_MOV) {
+            bool forward = (labelsDefined == 0) || (labelsDefined < labelCount && random.Unit() < settings.forwardRatio);
+            uint32_t index = forward ? labelsDefined + random.Below(labelCount - labelsDefined)
+                                     : random.Below(labelsDefined);
+            target = "LABEL" + std::to_string(index);
+        }
+
+        source += "    ";
+        switch (kind) {
+            case GENERATE_NOP:    source += noOperand[random.Below(4)]; break;
+            case GENERATE_ALU:    source += alu[random.Below(6)]; break;
+            case GENERATE_STACK:  source += (random.Below(2) ? "PUSH " : "POP "); source += registers[random.Below(8)]; break;
+            case GENERATE_INT:    source += "INT " + hexByte; break;
+
+            case GENERATE_CMP:
+                source += "CMP ";
+                source += registers[random.Below(8)];
+                source += ", ";
+                source += random.Below(2) ? registers[random.Below(8)] : hexByte.c_str();
+                break;
+
+            case GENERATE_MOV:
+                source += "MOV ";
+                switch (random.Below(3)) {
+                    case 0: source += registers[random.Below(8)]; source += ", "; source += hexByte; break;
+                    case 1: source += registers[random.Below(8)]; source += ", "; source += registers[random.Below(8)]; break;
+                    case 2: source += registers16[random.Below(4)]; source += ", $" + target; break;
+                }
+                break;
+
+            case GENERATE_BRANCH: source += branches[random.Below(6)]; source += " " + target; break;
+
+            case GENERATE_DB: {
+                uint32_t length = 1 + random.Below(settings.stringLength > 0 ? settings.stringLength * 2 : 1);
+                source += "DB '";
+                for (uint32_t i=0; i < length; i++)
+                    source += (char)('a' + random.Below(26));
+                source += random.Below(2) ? "', 0" : "'";
+                break;
+            }
+        }
+        source += '\n';
+    }
+
+    // Labels that were referenced but not reached yet
+    for (; labelsDefined < labelCount; labelsDefined++)
+        source += "LABEL" + std::to_string(labelsDefined) + ":\n";
+
+    return source;
+}
+
+#endif
@@ -1,6 +1,7 @@
 #include <sstream>
 #include <string>
 #include <cctype>
+#include <charconv>
 
 #include <algorithm>
 #include <iostream>
@@ -28,36 +29,60 @@ double StringType::ToDouble(const std::string& value) {
     return output;
 }
 
-int StringType::ToInt(const std::string& value) {
-    int output;
-    std::stringstream(value) >> output;
+// Integer conversion shared by the ToInt family
+// Leading whitespace and a plus sign are skipped like the stream extraction did, bad input gives zero
+template <typename T>
+static T ParseInteger(const std::string& value) {
+    const char* first = value.data();
+    const char* last = first + value.length();
+    while (first < last && std::isspace((unsigned char)*first)) 
+        first++;
+    if (first < last && *first == '+') 
+        first++;
+    
+    T output = 0;
+    if (std::from_chars(first, last, output).ec != std::errc()) 
+        return 0;
     return output;
 }
 
+int StringType::ToInt(const std::string& value) {
+    return ParseInteger<int>(value);
+}
+
 long int StringType::ToLongInt(const std::string& value) {
-    long int output;
-    std::stringstream(value) >> output;
-    return output;
+    return ParseInteger<long int>(value);
 }
 
 unsigned int StringType::ToUint(const std::string& value) {
-    unsigned int output;
-    std::stringstream(value) >> output;
-    return output;
+    return ParseInteger<unsigned int>(value);
 }
 
 unsigned long int StringType::ToLongUint(const std::string& value) {
-    unsigned long int output;
-    std::stringstream(value) >> output;
-    return output;
+    return ParseInteger<unsigned long int>(value);
 }
 
 std::vector<std::string> StringType::Explode(const std::string& value, const char character) {
-	std::vector<std::string> result;
-    std::istringstream iss(value);
+    std::vector<std::string> result;
+    
+    for (std::string_view token : Explode(std::string_view(value), character)) 
+        result.push_back(std::string(token));
+    
+    return result;
+}
+
+std::vector<std::string_view> StringType::Explode(std::string_view value, const char character) {
+    std::vector<std::string_view> result;
     
-    for (std::string token; std::getline(iss, token, character); ) 
-        result.push_back(std::move(token));
+    // A trailing delimiter adds no empty token
+    size_t start = 0;
+    while (start < value.length()) {
+        size_t end = value.find(character, start);
+        if (end == std::string_view::npos) 
+            end = value.length();
+        result.push_back(value.substr(start, end - start));
+        start = end + 1;
+    }
     
     return result;
 }
@@ -118,22 +143,24 @@ std::string DoubleType::ToString(double value) {
     return sstream.str();
 }
 
+// Integer formatting shared by the ToString family
+template <typename T>
+static std::string FormatInteger(T value) {
+    char buffer[24];
+    char* end = std::to_chars(buffer, buffer + sizeof(buffer), value).ptr;
+    return std::string(buffer, end);
+}
+
 std::string IntType::ToString(int value) {
-    std::stringstream sstream;
-    sstream << value;
-    return sstream.str();
+    return FormatInteger(value);
 }
 
 std::string IntLongType::ToString(long int value) {
-    std::stringstream sstream;
-    sstream << value;
-    return sstream.str();
+    return FormatInteger(value);
 }
 
 std::string UIntType::ToString(unsigned int value) {
-    std::stringstream sstream;
-    sstream << value;
-    return sstream.str();
+    return FormatInteger(value);
 }
 
 
@@ -161,6 +188,20 @@ std::string StringRemoveTrailingWhitespace(const std::string& str) {
     return str.substr(0, end);
 }
 
+std::string_view StringRemoveLeadingWhitespace(std::string_view str) {
+    size_t start = 0;
+    while (start < str.length() && std::isspace((unsigned char)str[start])) 
+        ++start;
+    return str.substr(start);
+}
+
+std::string_view StringRemoveTrailingWhitespace(std::string_view str) {
+    size_t end = str.length();
+    while (end > 0 && std::isspace((unsigned char)str[end - 1])) 
+        --end;
+    return str.substr(0, end);
+}
+
 std::string StringRemoveAllWhitespace(const std::string& str) {
     std::string result;
     result.reserve(str.length()); // Reserve space for efficiency
@@ -179,5 +220,3 @@ std::string toHexString(uint8_t value) {
     ss << "0x" << std::hex << std::uppercase << std::setw(2) << std::setfill('0') << (int)value;
     return ss.str();
 }
-
-
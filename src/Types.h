@@ -1,7 +1,9 @@
 #ifndef _TYPE_CLASSES__
 #define _TYPE_CLASSES__
 
+#include <cstdint>
 #include <string>
+#include <string_view>
 #include <vector>
 #include <ctype.h>
 
@@ -9,8 +11,97 @@ std::string StringRemoveLeadingWhitespace(const std::string& str);
 std::string StringRemoveAllWhitespace(const std::string& str);
 std::string StringRemoveTrailingWhitespace(const std::string& str);
 
+std::string_view StringRemoveLeadingWhitespace(std::string_view str);
+std::string_view StringRemoveTrailingWhitespace(std::string_view str);
+
 std::string toHexString(uint8_t value);
 
+// Literal parse results
+#define LITERAL_OK            0
+#define LITERAL_EMPTY         1
+#define LITERAL_INVALID       2
+#define LITERAL_OUT_OF_RANGE  3
+
+/// Parse a hex (0x), binary (0b), character ('A') or decimal literal into a value of the given bit width.
+/// Negative decimals are stored as two's complement. Returns one of the LITERAL_ results.
+constexpr int ParseLiteral(std::string_view text, unsigned int bits, uint32_t& value) {
+    value = 0;
+    if (text.empty()) 
+        return LITERAL_EMPTY;
+    
+    uint64_t limit = (bits >= 32) ? 0xFFFFFFFFull : ((1ull << bits) - 1);
+    
+    // Character literal
+    if (text[0] == 0x27) {
+        if (text.length() != 3 || text[2] != 0x27) 
+            return LITERAL_INVALID;
+        value = (uint8_t)text[1];
+        return (value <= limit) ? LITERAL_OK : LITERAL_OUT_OF_RANGE;
+    }
+    
+    bool negative = false;
+    if (text[0] == '-') {
+        negative = true;
+        text.remove_prefix(1);
+    }
+    
+    uint32_t base = 10;
+    if (text.length() > 2 && text[0] == '0' && (text[1] == 'x' || text[1] == 'X')) {
+        base = 16;
+        text.remove_prefix(2);
+    } else if (text.length() > 2 && text[0] == '0' && (text[1] == 'b' || text[1] == 'B')) {
+        base = 2;
+        text.remove_prefix(2);
+    }
+    
+    // Digits are read the way std::from_chars reads them, it is not constexpr
+    uint64_t number = 0;
+    bool overflow = false;
+    size_t length = 0;
+    for (; length < text.length(); length++) {
+        char ch = text[length];
+        uint32_t digit = base;
+        if (ch >= '0' && ch <= '9') digit = ch - '0';
+        else if (ch >= 'a' && ch <= 'z') digit = ch - 'a' + 10;
+        else if (ch >= 'A' && ch <= 'Z') digit = ch - 'A' + 10;
+        if (digit >= base) 
+            break;
+        if (number > (UINT64_MAX - digit) / base) 
+            overflow = true;
+        number = number * base + digit;
+    }
+    if (overflow) 
+        return LITERAL_OUT_OF_RANGE;
+    if (length == 0 || length != text.length()) 
+        return LITERAL_INVALID;
+    
+    if (negative) {
+        // Allow down to the most negative two's complement value of the width
+        if (base != 10) 
+            return LITERAL_INVALID;
+        if (number > (limit >> 1) + 1) 
+            return LITERAL_OUT_OF_RANGE;
+        value = (uint32_t)((0 - number) & limit);
+        return LITERAL_OK;
+    }
+    
+    if (number > limit) 
+        return LITERAL_OUT_OF_RANGE;
+    value = (uint32_t)number;
+    return LITERAL_OK;
+}
+
+/// Return a message describing a literal parse result.
+constexpr const char* LiteralErrorString(int result) {
+    switch (result) {
+        case LITERAL_OK:           return "Ok";
+        case LITERAL_EMPTY:        return "Missing value";
+        case LITERAL_INVALID:      return "Invalid literal";
+        case LITERAL_OUT_OF_RANGE: return "Literal out of range";
+    }
+    return "Unknown literal error";
+}
+
 
 class StringType {
     
@@ -37,6 +128,9 @@ public:
     /// Explode the string by the given delimiter into an array of strings.
     std::vector<std::string> Explode(const std::string& value, const char character);
     
+    /// Explode the text by the given delimiter into views of the original text.
+    std::vector<std::string_view> Explode(std::string_view value, const char character);
+    
     /// Return the filename from a file name.
     std::string GetNameFromFilename(const std::string& filename);
     
@@ -0,0 +1,136 @@
+#ifndef _ARENA_ALLOCATOR__
+#define _ARENA_ALLOCATOR__
+
+#include <atomic>
+#include <cstdint>
+#include <cstddef>
+#include <cstdlib>
+#include <new>
+#include <vector>
+
+// Size of a regular arena block, larger requests get a block of their own
+#define ARENA_BLOCK_SIZE  (64 * 1024)
+
+
+// Heap allocation counter
+// Define COUNT_HEAP_ALLOCATIONS in exactly one translation unit, before including this file,
+// to replace the global operator new with a counting one
+
+inline std::atomic<uint64_t> heapAllocationCount(0);
+
+#ifdef COUNT_HEAP_ALLOCATIONS
+
+// Kept out of line so the compiler does not match the malloc and free inside them against new and delete
+#ifdef __GNUC__
+ #define ARENA_NOINLINE __attribute__((noinline))
+#else
+ #define ARENA_NOINLINE
+#endif
+
+ARENA_NOINLINE void* operator new(size_t size) {
+    heapAllocationCount.fetch_add(1, std::memory_order_relaxed);
+    void* pointer = malloc(size == 0 ? 1 : size);
+    if (pointer == nullptr)
+        throw std::bad_alloc();
+    return pointer;
+}
+
+ARENA_NOINLINE void operator delete(void* pointer) noexcept {free(pointer);}
+ARENA_NOINLINE void operator delete(void* pointer, size_t) noexcept {free(pointer);}
+#endif
+
+/// Return the number of heap allocations made so far, zero if they are not counted.
+inline uint64_t HeapAllocationCount() {
+    return heapAllocationCount.load(std::memory_order_relaxed);
+}
+
+
+// Bump allocator
+// Memory is only given back when the arena is reset, the blocks are kept for the next assembly
+class Arena {
+
+public:
+
+    Arena() : current(0), used(0) {}
+
+    ~Arena() {
+        for (unsigned int i=0; i < blocks.size(); i++)
+            free(blocks[i].data);
+    }
+
+    Arena(const Arena&) = delete;
+    Arena& operator=(const Arena&) = delete;
+
+    /// Allocate memory that stays valid until the arena is reset.
+    void* Allocate(size_t size, size_t alignment = alignof(std::max_align_t)) {
+        while (current < blocks.size()) {
+            size_t start = (used + alignment - 1) & ~(alignment - 1);
+            if (start + size <= blocks[current].size) {
+                used = start + size;
+                return blocks[current].data + start;
+            }
+            current++;
+            used = 0;
+        }
+
+        Block block;
+        block.size = (size > ARENA_BLOCK_SIZE) ? size : ARENA_BLOCK_SIZE;
+        block.data = static_cast<uint8_t*>(malloc(block.size));
+        if (block.data == nullptr)
+            throw std::bad_alloc();
+        blocks.push_back(block);
+
+        // malloc already aligns for any fundamental type
+        current = blocks.size() - 1;
+        used = size;
+        return block.data;
+    }
+
+    /// Release everything allocated from the arena, keeping the blocks.
+    void Reset() {
+        current = 0;
+        used = 0;
+    }
+
+private:
+
+    struct Block {
+        uint8_t* data;
+        size_t size;
+    };
+
+    std::vector<Block> blocks;
+    size_t current;
+    size_t used;
+
+};
+
+
+// Standard allocator drawing from an arena, deallocation is a no-op
+template <typename T>
+struct ArenaAllocator {
+
+    typedef T value_type;
+
+    Arena* arena;
+
+    ArenaAllocator(Arena* owner) noexcept : arena(owner) {}
+
+    template <typename U>
+    ArenaAllocator(const ArenaAllocator<U>& other) noexcept : arena(other.arena) {}
+
+    T* allocate(size_t count) {
+        return static_cast<T*>(arena->Allocate(count * sizeof(T), alignof(T)));
+    }
+
+    void deallocate(T*, size_t) noexcept {}
+
+    template <typename U>
+    bool operator==(const ArenaAllocator<U>& other) const noexcept {return arena == other.arena;}
+
+    template <typename U>
+    bool operator!=(const ArenaAllocator<U>& other) const noexcept {return arena != other.arena;}
+
+};
+
+#endif
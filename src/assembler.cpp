@@ -0,0 +1,1257 @@
+#include <algorithm>
+#include <iostream>
+
+#include "types.h"
+#include "assembler.h"
+#include "instructions.h"
+#include "threadpool.h"
+#include "stats.h"
+#include "object.h"
+
+//#define DEBUG_OUTPUT_LABEL_OFFSETS
+//#define DEBUG_OUTPUT_VARIABLE_OFFSET
+
+// Line or label that is not there
+#define RETAINED_NONE  0xFFFFFFFF
+
+namespace x4 {
+
+Assembler::Assembler() :
+    variableIndex(&arena),
+    labelIndex(&arena),
+    fixupList(ArenaAllocator<Fixup>(&arena)),
+    exportIndex(&arena),
+    importIndex(&arena),
+    objectOutput(nullptr),
+    errorCount(0),
+    warningCount(0),
+    threadCount(1),
+    chunksUsed(0),
+    retaining(false),
+    longBranches(false),
+    stats(nullptr) {}
+
+
+int Assembler::Assemble(std::string_view source, AssemblyResult& result) {
+    {
+        ScopedTimer timer(stats, "lex");
+        ScanSource(source, scan);
+    }
+    return Assemble(scan, result);
+}
+
+int Assembler::Assemble(const ScanResult& source, AssemblyResult& result) {
+    int theCakeBaked = BakeTheCake(source);
+    
+    // Objects keep their branches long, the linker places their sections
+    if (theCakeBaked == 0 && errorCount == 0 && objectOutput == nullptr && !longBranches) {
+        GatherFixups();
+        Relax(image);
+    }
+    
+    if (stats != nullptr) 
+        CountStats(source.lines.size(), image.Size());
+    
+    result.image.swap(image);
+    result.diagnostics.swap(diagnostics);
+    result.errorCount = errorCount;
+    result.warningCount = warningCount;
+    
+    // Check if the cake baked
+    if (errorCount > 0 || warningCount > 0 || theCakeBaked != 0) 
+        return -1;
+    return 0;
+}
+
+int Assembler::AssembleObject(std::string_view source, AssemblyResult& result, ObjectFile& object) {
+    {
+        ScopedTimer timer(stats, "lex");
+        ScanSource(source, scan);
+    }
+    return AssembleObject(scan, result, object);
+}
+
+int Assembler::AssembleObject(const ScanResult& source, AssemblyResult& result, ObjectFile& object) {
+    object.clear();
+    objectOutput = &object;
+    int theCakeBaked = Assemble(source, result);
+    objectOutput = nullptr;
+    return theCakeBaked;
+}
+
+int Assembler::AssembleStream(SourceStream& source, std::fstream& output, AssemblyResult& result) {
+    int theCakeBaked = StreamTheCake(source, output);
+    
+    if (stats != nullptr) 
+        CountStats(0, 0);       // Lines and bytes are counted chunk by chunk
+    
+    result.image.clear();
+    result.diagnostics.swap(diagnostics);
+    result.errorCount = errorCount;
+    result.warningCount = warningCount;
+    
+    if (errorCount > 0 || warningCount > 0 || theCakeBaked != 0) 
+        return -1;
+    return 0;
+}
+
+
+void Assembler::ThrowError(int errorLine, std::string errorMessage) {
+    errorCount++;
+    Diagnostic diagnostic;
+    diagnostic.line = errorLine;
+    diagnostic.type = DIAGNOSTIC_ERROR;
+    diagnostic.message = std::move(errorMessage);
+    diagnostics.push_back(std::move(diagnostic));
+}
+
+void Assembler::ThrowWarning(int errorLine, std::string errorMessage) {
+    warningCount++;
+    Diagnostic diagnostic;
+    diagnostic.line = errorLine;
+    diagnostic.type = DIAGNOSTIC_WARNING;
+    diagnostic.message = std::move(errorMessage);
+    diagnostics.push_back(std::move(diagnostic));
+}
+
+
+void Assembler::AddFixup(uint32_t offset, std::string_view name, unsigned int ln, uint32_t kind) {
+    Fixup fixup;
+    fixup.offset = offset;
+    fixup.symbol = labelIndex.Reference(name);
+    fixup.line = ln;
+    fixup.kind = kind;
+    fixupList.push_back(fixup);
+}
+
+// Drop all symbols, fixups and diagnostics and reset the arena they live in
+void Assembler::Reset() {
+    variableIndex.clear();
+    labelIndex.clear();
+    exportIndex.clear();
+    importIndex.clear();
+    std::vector<Fixup, ArenaAllocator<Fixup>>(ArenaAllocator<Fixup>(&arena)).swap(fixupList);
+    arena.Reset();
+    
+    diagnostics.clear();
+    errorCount = 0;
+    warningCount = 0;
+}
+
+
+// Slice of the source lines assembled by one thread
+// The chunk context collects the fixups and diagnostics of the slice
+struct Assembler::Chunk {
+    
+    struct ChunkLabel {
+        std::string_view name;
+        uint32_t offset;                // Relative to the start of the chunk
+        uint32_t line;
+    };
+    
+    Assembler context;
+    uint32_t firstLine;
+    uint32_t lastLine;
+    uint32_t size;
+    uint32_t address;
+    std::vector<ChunkLabel> labels;
+    std::vector<Diagnostic> unknownLabels;
+    bool hasOrigin;                     // Addresses after an ORG do not follow from the chunk size
+    uint64_t probes;                    // Lookups in the merged label table
+};
+
+
+// What AssembleRetained keeps for Reassemble, the program is one run of bytes from address zero
+// The bytes are those of the long layout, every edit relaxes the branches of the whole image again.
+struct Assembler::Retained {
+    
+    struct RetainedFixup {
+        uint32_t line;
+        uint32_t offset;                // Relative to the address of its line
+        uint32_t label;
+        uint32_t kind;
+    };
+    
+    Arena arena;
+    SymbolTable labels;                 // Byte offsets and defined flags are kept current
+    std::vector<uint32_t> labelLine;    // Line defining each label, RETAINED_NONE if it is not defined
+    std::vector<uint32_t> lineLabel;    // Label defined on each line, RETAINED_NONE if there is none
+    std::vector<uint32_t> address;      // Address of every line and of the end
+    std::vector<RetainedFixup> fixups;  // In line order
+    std::vector<uint8_t> bytes;
+    uint32_t textLine;                  // First line after the text section, edits before it change variables
+    bool valid;
+    
+    Retained() : labels(&arena), textLine(0), valid(false) {}
+};
+
+Assembler::~Assembler() {}
+
+void Assembler::SetStats(Stats* owner) {
+    stats = owner;
+}
+
+void Assembler::SetLongBranches(bool keepLong) {
+    longBranches = keepLong;
+}
+
+// Add the size of the last assembly to the counters
+void Assembler::CountStats(uint64_t lineCount, uint64_t imageSize) {
+    uint64_t symbols = labelIndex.size() + variableIndex.size();
+    uint64_t probes = labelIndex.Probes() + variableIndex.Probes();
+    uint64_t fixups = fixupList.size();
+    
+    // Chunk contexts count their own references and lookups
+    for (unsigned int c=0; c < chunksUsed; c++) {
+        probes += chunks[c]->context.labelIndex.Probes() + chunks[c]->probes;
+        fixups += chunks[c]->context.fixupList.size();
+    }
+    
+    stats->Count(STAT_LINES, lineCount);
+    stats->Count(STAT_SYMBOLS, symbols);
+    stats->Count(STAT_PROBES, probes);
+    stats->Count(STAT_FIXUPS, fixups);
+    stats->Count(STAT_OUTPUT_BYTES, imageSize);
+}
+
+void Assembler::SetThreadCount(unsigned int count) {
+    threadCount = count;
+    if (threadCount <= 1) {
+        pool.reset();
+        return;
+    }
+    if (pool == nullptr || pool->size() != threadCount) 
+        pool.reset(new ThreadPool(threadCount));
+}
+
+
+int Assembler::BakeTheCake(const ScanResult& source) {
+    
+    Reset();
+    chunksUsed = 0;
+    
+    // Assemble the program in a single pass
+    // Label operands are recorded as fixups and patched once every label is known
+    image.clear();
+    
+    uint32_t programSize = 0;
+    uint8_t textFound = 0;
+    
+    // Variables may only appear before the text section, so everything up to
+    // it is assembled serially before the rest is handed to the thread pool
+    uint32_t lastLine = source.lines.size();
+    if (pool != nullptr && objectOutput == nullptr && !retaining) {
+        Statement statement;
+        for (uint32_t ln=0; ln < source.lines.size(); ln++) {
+            uint32_t firstMark = source.lineMarks[ln];
+            ParseStatement(source.lines[ln], source.marks.data() + firstMark, source.lineMarks[ln + 1] - firstMark, statement);
+            if (statement.tokenCount > 1 && statement.token[0] == "section" && statement.token[1] == ".text") {
+                lastLine = ln + 1;
+                break;
+            }
+        }
+    }
+    
+    // Labels are collected while emitting, the serial pass times as emission
+    {
+        ScopedTimer timer(stats, "emit");
+        if (AssembleLines(source, 0, lastLine, 0, programSize, textFound) != 0) 
+            return -1;
+    }
+    
+    if (lastLine < source.lines.size()) {
+        if (AssembleParallel(source, lastLine, programSize) != 0) 
+            return -1;
+    }
+    
+    // Check no entry point
+    if (textFound == 0) {
+        ThrowError(source.lines.size(), "'Section .text' not found"); return -1;
+    }
+    
+    // Patch the label addresses into the program
+    ScopedTimer fixupTimer(stats, "fixups");
+    for (unsigned int i=0; i < fixupList.size(); i++) {
+        const Label& label = labelIndex[ fixupList[i].symbol ];
+        if (!label.defined) {
+            // Imported labels are patched by the linker
+            if (objectOutput != nullptr && importIndex.Find(label.name) != SYMBOL_NOT_FOUND) 
+                continue;
+            ThrowError(fixupList[i].line, errorUnknownLabel + std::string(label.name));
+            continue;
+        }
+        
+        union Pointer jumpAddress;
+        jumpAddress.address = label.byteOffset;
+        uint8_t* field = image.Data(fixupList[i].offset, 4);
+        for (uint8_t a=0; a < 4; a++) 
+            field[a] = jumpAddress.byte_t[a];
+    }
+    
+    // Fixups made by the parallel chunks, in line order after the serial ones
+    for (unsigned int c=0; c < chunksUsed; c++) 
+        for (unsigned int i=0; i < chunks[c]->unknownLabels.size(); i++) 
+            ThrowError(chunks[c]->unknownLabels[i].line, chunks[c]->unknownLabels[i].message);
+    
+#ifdef DEBUG_OUTPUT_LABEL_OFFSETS
+    // TEST - Display the labels and their offsets
+    std::cout << std::endl << std::endl;
+    for (unsigned int  i=0; i < labelIndex.size(); i++) 
+        std::cout << labelIndex[i].name << Int.ToString( labelIndex[i].byteOffset ) << std::endl;
+#endif
+    
+#ifdef DEBUG_OUTPUT_VARIABLE_OFFSET
+    // TEST - Display the variable name and offsets
+    for (unsigned int  i=0; i < variableIndex.size(); i++) 
+        std::cout << std::endl << variableIndex[i].name << Int.ToString( variableIndex[i].byteOffset );
+#endif
+    
+    //ThrowWarning(10, errorUnknownLabel + "BEGIN");
+    
+    if (objectOutput != nullptr && errorCount == 0) 
+        BuildObject(*objectOutput);
+    
+    return 0;
+}
+
+
+// Turn the assembled image into an object
+// The segment at address zero is the relocatable section, segments placed by ORG elsewhere stay absolute.
+// Every field holding the address of a relocatable label gets a relocation, imported labels get one each.
+void Assembler::BuildObject(ObjectFile& object) {
+    
+    object.clear();
+    
+    std::vector<uint32_t> sectionOf(image.SegmentCount(), SECTION_ABSOLUTE);
+    uint32_t relocatable = SECTION_ABSOLUTE;
+    uint32_t relocatableEnd = 0;
+    for (uint32_t i=0; i < image.SegmentCount(); i++) {
+        const ImageSegment& segment = image.Segment(i);
+        if (segment.size == 0) 
+            continue;
+        
+        ObjectSection section;
+        section.base = segment.base;
+        section.flags = (segment.base == 0) ? SECTION_RELOCATABLE : 0;
+        section.bytes = segment.bytes;
+        if (segment.base == 0) {
+            relocatable = object.sections.size();
+            relocatableEnd = segment.size;
+        }
+        sectionOf[i] = object.sections.size();
+        object.sections.push_back(std::move(section));
+    }
+    
+    // Section holding an address, the segments are few
+    auto sectionAt = [&](uint32_t address, uint32_t& offset) {
+        for (uint32_t i=0; i < image.SegmentCount(); i++) {
+            const ImageSegment& segment = image.Segment(i);
+            if (address >= segment.base && address - segment.base < segment.size) {
+                offset = address - segment.base;
+                return sectionOf[i];
+            }
+        }
+        return SECTION_ABSOLUTE;
+    };
+    
+    for (uint32_t i=0; i < exportIndex.size(); i++) {
+        uint32_t index = labelIndex.Find(exportIndex[i].name);
+        if (index == SYMBOL_NOT_FOUND || !labelIndex[index].defined) {
+            ThrowError(exportIndex[i].byteOffset, "Undefined global " + std::string(exportIndex[i].name));
+            continue;
+        }
+        
+        ObjectSymbol symbol;
+        symbol.name = std::string(exportIndex[i].name);
+        symbol.value = labelIndex[index].byteOffset;
+        symbol.section = (relocatable != SECTION_ABSOLUTE && symbol.value <= relocatableEnd) ? relocatable : SECTION_ABSOLUTE;
+        object.exports.push_back(std::move(symbol));
+    }
+    
+    for (uint32_t i=0; i < importIndex.size(); i++) 
+        object.imports.push_back(std::string(importIndex[i].name));
+    
+    for (unsigned int i=0; i < fixupList.size(); i++) {
+        const Label& label = labelIndex[ fixupList[i].symbol ];
+        
+        ObjectRelocation relocation;
+        relocation.section = sectionAt(fixupList[i].offset, relocation.offset);
+        if (label.defined) {
+            // Absolute labels are final already
+            if (relocatable == SECTION_ABSOLUTE || label.byteOffset > relocatableEnd) 
+                continue;
+            relocation.kind = RELOCATION_SECTION;
+            relocation.target = relocatable;
+        } else {
+            relocation.kind = RELOCATION_IMPORT;
+            relocation.target = importIndex.Find(label.name);
+        }
+        object.relocations.push_back(relocation);
+    }
+}
+
+
+int Assembler::AssembleRetained(const ScanResult& source, AssemblyResult& result) {
+    if (retained == nullptr) 
+        retained.reset(new Retained());
+    retained->valid = false;
+    
+    retaining = true;
+    int theCakeBaked = BakeTheCake(source);
+    retaining = false;
+    
+    if (theCakeBaked == 0 && errorCount == 0 && warningCount == 0) {
+        ScopedTimer timer(stats, "retain");
+        Retain(source);
+    }
+    if (theCakeBaked == 0 && errorCount == 0 && !longBranches) {
+        GatherFixups();
+        Relax(image);
+    }
+    
+    if (stats != nullptr) 
+        CountStats(source.lines.size(), image.Size());
+    
+    result.image.swap(image);
+    result.diagnostics.swap(diagnostics);
+    result.errorCount = errorCount;
+    result.warningCount = warningCount;
+    
+    if (errorCount > 0 || warningCount > 0 || theCakeBaked != 0) 
+        return -1;
+    return 0;
+}
+
+
+// Record the address and label of every line and the fixups of the assembly that just finished
+// The lines are walked exactly as AssembleLines walks them
+void Assembler::Retain(const ScanResult& source) {
+    Retained& state = *retained;
+    
+    state.labels.clear();
+    state.arena.Reset();
+    state.labelLine.clear();
+    state.fixups.clear();
+    state.textLine = 0;
+    
+    // Code placed with ORG is not kept
+    if (image.SegmentCount() > 1 || (image.SegmentCount() == 1 && image.Segment(0).base != 0)) 
+        return;
+    if (image.SegmentCount() == 1) 
+        state.bytes = image.Segment(0).bytes;
+    else 
+        state.bytes.clear();
+    
+    uint32_t lineCount = source.lines.size();
+    state.address.resize(lineCount + 1);
+    state.lineLabel.assign(lineCount, RETAINED_NONE);
+    
+    Statement statement;
+    uint32_t address = 0;
+    bool textFound = false;
+    for (uint32_t ln=0; ln < lineCount; ln++) {
+        state.address[ln] = address;
+        
+        uint32_t firstMark = source.lineMarks[ln];
+        ParseStatement(source.lines[ln], source.marks.data() + firstMark, source.lineMarks[ln + 1] - firstMark, statement);
+        
+        if (statement.tokenCount == 0 && statement.label.empty()) 
+            continue;
+        
+        if (statement.tokenCount > 0 && statement.token[0] == "section") {
+            if (!textFound && statement.tokenCount > 1 && statement.token[1] == ".text") {
+                textFound = true;
+                state.textLine = ln + 1;
+            }
+            continue;
+        }
+        
+        if (!textFound && statement.hasEquals) 
+            continue;
+        
+        if (statement.tokenCount > 0 && statement.token[0] == "ORG") 
+            return;
+        
+        if (!statement.label.empty()) {
+            uint32_t label = state.labels.Insert(statement.label, address);
+            state.labelLine.resize(state.labels.size(), RETAINED_NONE);
+            state.labelLine[label] = ln;
+            state.lineLabel[ln] = label;
+        }
+        
+        if (statement.tokenCount == 0) 
+            continue;
+        
+        const Instruction* instruction = FindInstruction( statement.token[0] );
+        if (instruction != nullptr) 
+            address += InstructionSize(*instruction, statement);
+    }
+    state.address[lineCount] = address;
+    
+    if (address != state.bytes.size()) 
+        return;
+    
+    state.fixups.reserve(fixupList.size());
+    for (unsigned int i=0; i < fixupList.size(); i++) {
+        Retained::RetainedFixup fixup;
+        fixup.line = fixupList[i].line;
+        fixup.offset = fixupList[i].offset - state.address[fixup.line];
+        fixup.label = state.labels.Reference(labelIndex[ fixupList[i].symbol ].name);
+        fixup.kind = fixupList[i].kind;
+        state.fixups.push_back(fixup);
+    }
+    state.labelLine.resize(state.labels.size(), RETAINED_NONE);
+    
+    state.valid = true;
+}
+
+
+int Assembler::Reassemble(uint32_t first, uint32_t removed, const ScanResult& lines, AssemblyResult& result) {
+    if (retained == nullptr || !retained->valid) 
+        return REASSEMBLE_FULL;
+    
+    Retained& state = *retained;
+    uint32_t lineCount = state.lineLabel.size();
+    if (first < state.textLine || first > lineCount || removed > lineCount - first) 
+        return REASSEMBLE_FULL;
+    
+    Reset();
+    chunksUsed = 0;
+    
+    // Encode the new lines on their own, anything but plain code needs the whole source
+    uint32_t inserted = lines.lines.size();
+    uint32_t base = state.address[first];
+    std::vector<uint32_t> lineAddress(inserted + 1);
+    std::vector<uint8_t> bytes;
+    std::vector<std::pair<uint32_t, std::string_view>> newLabels;
+    uint32_t size = 0;
+    {
+        ScopedTimer timer(stats, "emit");
+        Statement statement;
+        for (uint32_t index=0; index < inserted; index++) {
+            lineAddress[index] = size;
+            
+            uint32_t firstMark = lines.lineMarks[index];
+            ParseStatement(lines.lines[index], lines.marks.data() + firstMark, lines.lineMarks[index + 1] - firstMark, statement);
+            
+            if (statement.tokenCount == 0 && statement.label.empty()) 
+                continue;
+            if (statement.tokenCount > 0 && statement.token[0] == "section") 
+                continue;
+            if (statement.tokenCount > 0 && statement.token[0] == "ORG") 
+                return REASSEMBLE_FULL;
+            
+            if (!statement.label.empty()) 
+                newLabels.push_back(std::make_pair(first + index, statement.label));
+            
+            if (statement.tokenCount == 0) 
+                continue;
+            
+            const Instruction* instruction = FindInstruction( statement.token[0] );
+            if (instruction == nullptr) 
+                continue;
+            
+            uint32_t instructionSize = InstructionSize(*instruction, statement);
+            bytes.resize(size + instructionSize);
+            if (instruction->encode(*this, *instruction, statement, first + index, base + size, &bytes[size]) != 0) 
+                return REASSEMBLE_FULL;
+            size += instructionSize;
+        }
+        lineAddress[inserted] = size;
+    }
+    if (errorCount > 0 || warningCount > 0) 
+        return REASSEMBLE_FULL;
+    
+    uint32_t oldSize = state.address[first + removed] - base;
+    if ((uint64_t)state.bytes.size() - oldSize + size > MAX_PROGRAM_SIZE) 
+        return REASSEMBLE_FULL;
+    
+    // From here on the retained state is changed, a failure drops it
+    ScopedTimer timer(stats, "fixups");
+    uint32_t delta = size - oldSize;                // Wraps for a shrinking edit
+    uint32_t lineDelta = inserted - removed;
+    
+    // Labels of the removed lines go, the ones after them move down, the new ones come in
+    for (uint32_t ln=first; ln < first + removed; ln++) {
+        uint32_t label = state.lineLabel[ln];
+        if (label != RETAINED_NONE) {
+            state.labels[label].defined = false;
+            state.labelLine[label] = RETAINED_NONE;
+        }
+    }
+    if (lineDelta != 0) {
+        for (uint32_t i=0; i < state.labelLine.size(); i++) 
+            if (state.labelLine[i] != RETAINED_NONE && state.labelLine[i] >= first + removed) 
+                state.labelLine[i] += lineDelta;
+    }
+    
+    state.lineLabel.erase(state.lineLabel.begin() + first, state.lineLabel.begin() + first + removed);
+    state.lineLabel.insert(state.lineLabel.begin() + first, inserted, RETAINED_NONE);
+    
+    state.address.erase(state.address.begin() + first, state.address.begin() + first + removed);
+    state.address.insert(state.address.begin() + first, inserted, 0);
+    for (uint32_t i=0; i < inserted; i++) 
+        state.address[first + i] = base + lineAddress[i];
+    if (delta != 0) {
+        for (uint32_t i=first + inserted; i < state.address.size(); i++) 
+            state.address[i] += delta;
+    }
+    
+    for (unsigned int i=0; i < newLabels.size(); i++) {
+        uint32_t label = state.labels.Reference(newLabels[i].second);
+        state.labelLine.resize(state.labels.size(), RETAINED_NONE);
+        if (state.labels[label].defined) {
+            state.valid = false;
+            return REASSEMBLE_FULL;
+        }
+        state.labels[label].defined = true;
+        state.labelLine[label] = newLabels[i].first;
+        state.lineLabel[newLabels[i].first] = label;
+    }
+    // Labels after the edit only move if its size changed
+    uint32_t moved = (delta != 0) ? RETAINED_NONE : first + inserted;
+    for (uint32_t i=0; i < state.labelLine.size(); i++) 
+        if (state.labelLine[i] != RETAINED_NONE && state.labelLine[i] >= first && state.labelLine[i] < moved) 
+            state.labels[i].byteOffset = state.address[state.labelLine[i]];
+    
+    // Fixups of the new lines replace those of the removed ones
+    std::vector<Retained::RetainedFixup>::iterator begin = state.fixups.begin();
+    while (begin != state.fixups.end() && begin->line < first) 
+        begin++;
+    std::vector<Retained::RetainedFixup>::iterator end = begin;
+    while (end != state.fixups.end() && end->line < first + removed) 
+        end++;
+    uint32_t firstFixup = begin - state.fixups.begin();
+    state.fixups.erase(begin, end);
+    
+    std::vector<Retained::RetainedFixup> newFixups(fixupList.size());
+    for (unsigned int i=0; i < fixupList.size(); i++) {
+        newFixups[i].line = fixupList[i].line;
+        newFixups[i].offset = fixupList[i].offset - (base + lineAddress[fixupList[i].line - first]);
+        newFixups[i].label = state.labels.Reference(labelIndex[ fixupList[i].symbol ].name);
+        newFixups[i].kind = fixupList[i].kind;
+    }
+    state.labelLine.resize(state.labels.size(), RETAINED_NONE);
+    state.fixups.insert(state.fixups.begin() + firstFixup, newFixups.begin(), newFixups.end());
+    if (lineDelta != 0) {
+        for (uint32_t i=firstFixup + newFixups.size(); i < state.fixups.size(); i++) 
+            state.fixups[i].line += lineDelta;
+    }
+    
+    state.bytes.erase(state.bytes.begin() + base, state.bytes.begin() + base + oldSize);
+    state.bytes.insert(state.bytes.begin() + base, bytes.begin(), bytes.end());
+    
+    // Patch the new fields and every field whose label moved
+    for (uint32_t i=0; i < state.fixups.size(); i++) {
+        const Retained::RetainedFixup& fixup = state.fixups[i];
+        const Label& label = state.labels[fixup.label];
+        if (!label.defined) {
+            state.valid = false;
+            return REASSEMBLE_FULL;
+        }
+        
+        bool isNew = (i >= firstFixup && i < firstFixup + newFixups.size());
+        uint32_t labelLine = state.labelLine[fixup.label];
+        if (!isNew && (labelLine < first || labelLine >= moved)) 
+            continue;
+        
+        union Pointer jumpAddress;
+        jumpAddress.address = label.byteOffset;
+        uint8_t* field = &state.bytes[state.address[fixup.line] + fixup.offset];
+        for (uint8_t a=0; a < 4; a++) 
+            field[a] = jumpAddress.byte_t[a];
+    }
+    
+    result.image.clear();
+    if (!state.bytes.empty()) 
+        memcpy(result.image.Append(state.bytes.size()), state.bytes.data(), state.bytes.size());
+    if (!longBranches) {
+        relaxFixups.resize(state.fixups.size());
+        for (uint32_t i=0; i < state.fixups.size(); i++) {
+            relaxFixups[i].offset = state.address[state.fixups[i].line] + state.fixups[i].offset;
+            relaxFixups[i].kind = state.fixups[i].kind;
+        }
+        Relax(result.image);
+    }
+    result.diagnostics.clear();
+    result.errorCount = 0;
+    result.warningCount = 0;
+    return 0;
+}
+
+
+// Collect the fixups of the assembly that just finished for Relax, those of the parallel chunks follow the serial ones
+void Assembler::GatherFixups() {
+    relaxFixups.assign(fixupList.begin(), fixupList.end());
+    for (unsigned int c=0; c < chunksUsed; c++) 
+        relaxFixups.insert(relaxFixups.end(), chunks[c]->context.fixupList.begin(), chunks[c]->context.fixupList.end());
+}
+
+// Give every branch of a patched long image the shortest form that reaches its label
+// The fields in relaxFixups hold the label addresses of the long layout. Address fields get the
+// addresses the labels move to, and the labels of the assembly are moved with them.
+void Assembler::Relax(Image& target) {
+    ScopedTimer timer(stats, "relax");
+    
+    relaxBranches.clear();
+    for (unsigned int i=0; i < relaxFixups.size(); i++) {
+        if (relaxFixups[i].kind != FIXUP_BRANCH) 
+            continue;
+        const uint8_t* field = target.Data(relaxFixups[i].offset, 4);
+        if (field == nullptr) 
+            continue;
+        Branch branch = {};
+        branch.address = relaxFixups[i].offset - 1;
+        branch.target = field[0] | (field[1] << 8) | (field[2] << 16) | ((uint32_t)field[3] << 24);
+        branch.form = BRANCH_SHORT;
+        relaxBranches.push_back(branch);
+    }
+    if (relaxBranches.empty()) 
+        return;
+    
+    // Fixups are in line order, which is address order unless ORG went back
+    if (!std::is_sorted(relaxBranches.begin(), relaxBranches.end(), [](const Branch& a, const Branch& b) {return a.address < b.address;})) 
+        std::sort(relaxBranches.begin(), relaxBranches.end(), [](const Branch& a, const Branch& b) {return a.address < b.address;});
+    
+    relaxBases.clear();
+    for (uint32_t i=0; i < target.SegmentCount(); i++) 
+        relaxBases.push_back(target.Segment(i).base);
+    
+    BranchList list = {relaxBranches.data(), (uint32_t)relaxBranches.size(), relaxBases.data(), (uint32_t)relaxBases.size()};
+    RelaxBranches(list);
+    
+    for (unsigned int i=0; i < relaxFixups.size(); i++) {
+        if (relaxFixups[i].kind != FIXUP_ADDRESS) 
+            continue;
+        uint8_t* field = target.Data(relaxFixups[i].offset, 4);
+        if (field == nullptr) 
+            continue;
+        union Pointer address;
+        memcpy(address.byte_t, field, 4);
+        address.address = RelaxedAddress(list, address.address);
+        memcpy(field, address.byte_t, 4);
+    }
+    
+    // Code only moves down within its segment, so every segment is relaxed in place
+    uint32_t next = 0;
+    for (uint32_t i=0; i < target.SegmentCount(); i++) {
+        const ImageSegment& segment = target.Segment(i);
+        if (segment.size == 0) 
+            continue;
+        uint8_t* bytes = target.Data(segment.base, segment.size);
+        target.Truncate(i, RelaxSegment(list, next, bytes, segment.base, segment.size, bytes));
+    }
+    
+    for (uint32_t i=0; i < labelIndex.size(); i++) 
+        if (labelIndex[i].defined) 
+            labelIndex[i].byteOffset = RelaxedAddress(list, labelIndex[i].byteOffset);
+}
+
+
+// Column of a label operand, found again in the line because the label table holds its upper cased copy
+static uint32_t OperandColumn(std::string_view line, size_t from, std::string_view name) {
+    for (size_t column=from; column + name.length() <= line.length(); column++) {
+        if (SymbolEquals(line.substr(column, name.length()), name)) 
+            return column;
+    }
+    return 0;
+}
+
+
+// The steps of AssembleLines for a single line, the address is zero
+void Assembler::AssembleLine(std::string_view line, bool textFound, LineAssembly& result) {
+    Reset();
+    
+    result.kind = LINE_EMPTY;
+    result.label.clear();
+    result.labelColumn = 0;
+    result.name.clear();
+    result.value = 0;
+    result.bytes.clear();
+    result.references.clear();
+    result.diagnostics.clear();
+    
+    ScanSource(line, scan);
+    if (scan.lines.empty()) 
+        return;
+    
+    Statement statement;
+    ParseStatement(scan.lines[0], scan.marks.data(), scan.lineMarks[1], statement);
+    
+    if (statement.tokenCount == 0 && statement.label.empty()) 
+        return;
+    
+    if (statement.tokenCount > 0 && statement.token[0] == "section") {
+        result.kind = LINE_SECTION;
+        if (statement.tokenCount > 1) 
+            result.name = std::string(statement.token[1]);
+        return;
+    }
+    
+    if (!textFound && statement.hasEquals) {
+        result.kind = LINE_VARIABLE;
+        result.name = std::string(statement.token[0]);
+        if (OperandCount(statement) < 1) 
+            ThrowError(0, "Missing value");
+        else 
+            ParseOperandLiteral(*this, GetOperand(statement, 0), 32, 0, result.value);
+        result.diagnostics.swap(diagnostics);
+        return;
+    }
+    
+    result.kind = LINE_CODE;
+    if (!statement.label.empty()) {
+        result.label = std::string(statement.label);
+        result.labelColumn = statement.label.data() - line.data();
+    }
+    
+    if (statement.tokenCount > 0 && statement.token[0] == "ORG") {
+        result.kind = LINE_ORG;
+        if (OperandCount(statement) < 1) 
+            ThrowError(0, "Missing address");
+        else {
+            result.name = std::string(GetOperand(statement, 0));
+            ParseOperandLiteral(*this, result.name, 32, 0, result.value);
+        }
+        result.diagnostics.swap(diagnostics);
+        return;
+    }
+    
+    if (statement.tokenCount == 0 || statement.token[0] == "GLOBAL" || statement.token[0] == "EXTERN") 
+        return;
+    
+    const Instruction* instruction = FindInstruction( statement.token[0] );
+    if (instruction == nullptr) 
+        return;
+    
+    // A line that fails to encode keeps its size, the lines after it stay where they are
+    result.bytes.resize(InstructionSize(*instruction, statement));
+    instruction->encode(*this, *instruction, statement, 0, 0, result.bytes.data());
+    
+    size_t operands = statement.token[0].data() + statement.token[0].length() - line.data();
+    for (unsigned int i=0; i < fixupList.size(); i++) {
+        LineReference reference;
+        reference.offset = fixupList[i].offset;
+        reference.kind = fixupList[i].kind;
+        reference.label = std::string(labelIndex[ fixupList[i].symbol ].name);
+        reference.column = OperandColumn(line, operands, reference.label);
+        result.references.push_back(reference);
+    }
+    result.diagnostics.swap(diagnostics);
+}
+
+
+// Assemble chunk by chunk, only the chunk being assembled and its bytes are in memory
+// The label addresses are patched into the output file once the whole source has been read
+int Assembler::StreamTheCake(SourceStream& source, std::fstream& output) {
+    
+    Reset();
+    chunksUsed = 0;
+    
+    image.clear();
+    
+    uint32_t programSize = 0;
+    uint8_t textFound = 0;
+    uint32_t lineBase = 0;
+    
+    std::string_view text;
+    while (true) {
+        {
+            ScopedTimer timer(stats, "load");
+            if (!source.Next(text)) 
+                break;
+        }
+        {
+            ScopedTimer timer(stats, "lex");
+            ScanSource(text, scan);
+        }
+        
+        uint64_t placed = image.Size();
+        {
+            ScopedTimer timer(stats, "emit");
+            if (AssembleLines(scan, 0, scan.lines.size(), lineBase, programSize, textFound) != 0) 
+                return -1;
+        }
+        
+        // Write the bytes of this chunk where they belong and drop them
+        {
+            ScopedTimer timer(stats, "write");
+            for (uint32_t i=0; i < image.SegmentCount(); i++) {
+                const ImageSegment& segment = image.Segment(i);
+                if (segment.bytes.empty()) 
+                    continue;
+                output.seekp(segment.base + segment.size - segment.bytes.size());
+                output.write(reinterpret_cast<const char*>(segment.bytes.data()), segment.bytes.size());
+            }
+            image.Release();
+        }
+        lineBase += scan.lines.size();
+        
+        if (stats != nullptr) {
+            stats->Count(STAT_LINES, scan.lines.size());
+            stats->Count(STAT_OUTPUT_BYTES, image.Size() - placed);
+        }
+    }
+    
+    // Check no entry point
+    if (textFound == 0) {
+        ThrowError(lineBase, "'Section .text' not found"); return -1;
+    }
+    
+    // Patch the label addresses a window at a time, fixups are in file order unless ORG moved backwards
+    ScopedTimer fixupTimer(stats, "fixups");
+    output.flush();
+    uint32_t end = image.End();
+    std::vector<uint8_t> buffer(end < SOURCE_STREAM_CHUNK ? end : SOURCE_STREAM_CHUNK);
+    uint32_t window = 0;
+    uint32_t windowSize = 0;
+    for (unsigned int i=0; i < fixupList.size(); i++) {
+        const Fixup& fixup = fixupList[i];
+        const Label& label = labelIndex[ fixup.symbol ];
+        if (!label.defined) {
+            ThrowError(fixup.line, errorUnknownLabel + std::string(label.name));
+            continue;
+        }
+        
+        // Write back the current window and read the one holding this fixup
+        if (windowSize == 0 || fixup.offset < window || fixup.offset + 4 > window + windowSize) {
+            if (windowSize > 0) {
+                output.seekp(window);
+                output.write(reinterpret_cast<const char*>(buffer.data()), windowSize);
+            }
+            window = fixup.offset;
+            windowSize = end - window;
+            if (windowSize > buffer.size()) 
+                windowSize = buffer.size();
+            output.seekg(window);
+            output.read(reinterpret_cast<char*>(buffer.data()), windowSize);
+        }
+        
+        union Pointer jumpAddress;
+        jumpAddress.address = label.byteOffset;
+        for (uint8_t a=0; a < 4; a++) 
+            buffer[fixup.offset - window + a] = jumpAddress.byte_t[a];
+    }
+    if (windowSize > 0) {
+        output.seekp(window);
+        output.write(reinterpret_cast<const char*>(buffer.data()), windowSize);
+    }
+    output.flush();
+    
+    if (!output) {
+        ThrowError(lineBase, "Could not write the output"); return -1;
+    }
+    
+    return 0;
+}
+
+
+// Assemble a range of lines, the bytes are appended to the image from programSize on
+// Line numbers in diagnostics and fixups are offset by lineBase
+int Assembler::AssembleLines(const ScanResult& source, uint32_t firstLine, uint32_t lastLine, uint32_t lineBase, uint32_t& programSize, uint8_t& textFound) {
+    
+    Statement statement;
+    
+    for (unsigned int  index=firstLine; index < lastLine; index++) {
+        
+        unsigned int ln = index + lineBase;
+        
+        uint32_t firstMark = source.lineMarks[index];
+        ParseStatement(source.lines[index], source.marks.data() + firstMark, source.lineMarks[index + 1] - firstMark, statement);
+        
+        if (statement.tokenCount == 0 && statement.label.empty()) 
+            continue;
+        
+        if (statement.tokenCount > 0 && statement.token[0] == "section") {
+            if (statement.tokenCount > 1 && statement.token[1] == ".text") 
+                textFound = 1;
+            continue;
+        }
+        
+        // Add variable to the index
+        if (textFound == 0 && statement.hasEquals) {
+            if (OperandCount(statement) < 1) {ThrowError(ln, "Missing value"); return -1;}
+            std::string_view name = statement.token[0];
+            
+            uint32_t number;
+            if (ParseOperandLiteral(*this, GetOperand(statement, 0), 32, ln, number) != 0) 
+                return -1;
+            
+            if (variableIndex.Insert(name, number) == SYMBOL_NOT_FOUND) {
+                ThrowError(ln, "Duplicate variable " + std::string(name)); return -1;
+            }
+            continue;
+        }
+        
+        // Place the following code at an address, a label on the line names the new address
+        if (statement.tokenCount > 0 && statement.token[0] == "ORG") {
+            if (OperandCount(statement) < 1) {ThrowError(ln, "Missing address"); return -1;}
+            
+            uint32_t address;
+            if (ParseOperandLiteral(*this, GetOperand(statement, 0), 32, ln, address) != 0) 
+                return -1;
+            
+            if (image.Origin(address) != 0) {
+                ThrowError(ln, "Origin overlaps placed code or is out of range " + std::string(GetOperand(statement, 0))); return -1;
+            }
+            programSize = address;
+        }
+        
+        // Add a new case independent label
+        if (!statement.label.empty()) {
+            if (labelIndex.Insert(statement.label, programSize) == SYMBOL_NOT_FOUND) {
+                ThrowError(ln, "Duplicate label " + std::string(statement.label)); return -1;
+            }
+        }
+        
+        if (statement.tokenCount == 0) 
+            continue;
+        
+        // Symbols shared with other modules, only objects have any
+        if (statement.token[0] == "GLOBAL" || statement.token[0] == "EXTERN") {
+            if (objectOutput == nullptr) 
+                continue;
+            if (statement.tokenCount < 2) {ThrowError(ln, "Missing symbol"); return -1;}
+            if (statement.tooManyTokens) {
+                ThrowError(ln, "Too many symbols, at most " + std::to_string(MAX_STATEMENT_TOKENS - 1) + " on one line"); return -1;
+            }
+            
+            SymbolTable& table = (statement.token[0] == "GLOBAL") ? exportIndex : importIndex;
+            for (uint32_t i=1; i < statement.tokenCount; i++) 
+                table.Insert(statement.token[i], ln);
+            continue;
+        }
+        
+        const Instruction* instruction = FindInstruction( statement.token[0] );
+        if (instruction == nullptr) 
+            continue;
+        
+        uint32_t size = InstructionSize(*instruction, statement);
+        uint8_t* output = image.Append(size);
+        if (output == nullptr) {
+            ThrowError(ln, "Program runs into code placed at a higher address or past the maximum size"); return -1;
+        }
+        
+        if (instruction->encode(*this, *instruction, statement, ln, programSize, output) != 0) 
+            return -1;
+        
+        programSize += size;
+    }
+    
+    return 0;
+}
+
+
+// Assemble the lines after the text section on the thread pool
+// 1. Every chunk is sized on its own, an instruction's size depends only on its line
+// 2. A prefix sum over the chunk sizes gives each chunk its address and the labels are merged in line order
+// 3. Every chunk emits into its own range of the image and patches its own fixups
+int Assembler::AssembleParallel(const ScanResult& source, uint32_t firstLine, uint32_t& programSize) {
+    
+    uint32_t lineCount = source.lines.size() - firstLine;
+    uint32_t chunkCount = lineCount / PARALLEL_CHUNK_LINES;
+    if (chunkCount > threadCount * 4) 
+        chunkCount = threadCount * 4;
+    
+    // Too small to be worth splitting
+    if (chunkCount < 2) {
+        ScopedTimer timer(stats, "emit");
+        uint8_t textFound = 1;
+        return AssembleLines(source, firstLine, source.lines.size(), 0, programSize, textFound);
+    }
+    
+    while (chunks.size() < chunkCount) 
+        chunks.emplace_back(new Chunk());
+    chunks.resize(chunkCount);
+    
+    for (uint32_t c=0; c < chunkCount; c++) {
+        chunks[c]->firstLine = firstLine + (uint64_t)lineCount * c / chunkCount;
+        chunks[c]->lastLine  = firstLine + (uint64_t)lineCount * (c + 1) / chunkCount;
+    }
+    
+    std::vector<std::future<void>> done(chunkCount);
+    
+    for (uint32_t c=0; c < chunkCount; c++) 
+        done[c] = pool->Submit([this, &source, c]() {
+            ScopedTimer timer(stats, "labels");
+            SizeChunk(source, *chunks[c]);
+        });
+    for (uint32_t c=0; c < chunkCount; c++) 
+        done[c].wait();
+    
+    // Code placed with ORG, or code that does not fit, is assembled serially so its
+    // addresses and errors come out exactly as in a single pass
+    uint64_t totalSize = 0;
+    bool serial = false;
+    for (uint32_t c=0; c < chunkCount; c++) {
+        totalSize += chunks[c]->size;
+        serial = serial || chunks[c]->hasOrigin;
+    }
+    if (serial || totalSize > image.Room()) {
+        ScopedTimer timer(stats, "emit");
+        uint8_t textFound = 1;
+        return AssembleLines(source, firstLine, source.lines.size(), 0, programSize, textFound);
+    }
+    chunksUsed = chunkCount;
+    
+    // Prefix sum and label merge, the first duplicate stops emission at its line
+    uint32_t stopLine = source.lines.size();
+    std::string duplicate;
+    {
+        ScopedTimer timer(stats, "labels");
+        for (uint32_t c=0; c < chunkCount; c++) {
+            Chunk& chunk = *chunks[c];
+            chunk.address = programSize;
+            programSize += chunk.size;
+            
+            for (unsigned int i=0; i < chunk.labels.size() && duplicate.empty(); i++) {
+                if (labelIndex.Insert(chunk.labels[i].name, chunk.address + chunk.labels[i].offset) == SYMBOL_NOT_FOUND) {
+                    stopLine = chunk.labels[i].line;
+                    duplicate = "Duplicate label " + std::string(chunk.labels[i].name);
+                }
+            }
+        }
+    }
+    
+    // Room for every chunk, the chunks then write into it side by side
+    image.Append(totalSize);
+    
+    for (uint32_t c=0; c < chunkCount; c++) 
+        done[c] = pool->Submit([this, &source, c, stopLine]() {
+            ScopedTimer timer(stats, "emit");
+            EmitChunk(source, *chunks[c], stopLine);
+        });
+    for (uint32_t c=0; c < chunkCount; c++) 
+        done[c].wait();
+    
+    // The first error in line order is the one the serial path would have stopped on
+    for (uint32_t c=0; c < chunkCount; c++) {
+        const Assembler& context = chunks[c]->context;
+        if (context.errorCount > 0) {
+            ThrowError(context.diagnostics[0].line, context.diagnostics[0].message); 
+            return -1;
+        }
+    }
+    if (!duplicate.empty()) {
+        ThrowError(stopLine, duplicate); 
+        return -1;
+    }
+    
+    for (uint32_t c=0; c < chunkCount; c++) 
+        done[c] = pool->Submit([this, c]() {
+            ScopedTimer timer(stats, "fixups");
+            PatchChunk(*chunks[c]);
+        });
+    for (uint32_t c=0; c < chunkCount; c++) 
+        done[c].wait();
+    
+    return 0;
+}
+
+
+// Find the size and the labels of a chunk without encoding it
+void Assembler::SizeChunk(const ScanResult& source, Chunk& chunk) {
+    chunk.size = 0;
+    chunk.labels.clear();
+    chunk.unknownLabels.clear();
+    chunk.hasOrigin = false;
+    chunk.probes = 0;
+    
+    Statement statement;
+    
+    for (uint32_t ln=chunk.firstLine; ln < chunk.lastLine; ln++) {
+        uint32_t firstMark = source.lineMarks[ln];
+        ParseStatement(source.lines[ln], source.marks.data() + firstMark, source.lineMarks[ln + 1] - firstMark, statement);
+        
+        if (statement.tokenCount > 0 && statement.token[0] == "section") 
+            continue;
+        
+        if (statement.tokenCount > 0 && statement.token[0] == "ORG") {
+            chunk.hasOrigin = true;
+            return;
+        }
+        
+        if (!statement.label.empty()) {
+            Chunk::ChunkLabel label;
+            label.name = statement.label;
+            label.offset = chunk.size;
+            label.line = ln;
+            chunk.labels.push_back(label);
+        }
+        
+        if (statement.tokenCount == 0) 
+            continue;
+        
+        const Instruction* instruction = FindInstruction( statement.token[0] );
+        if (instruction != nullptr) 
+            chunk.size += InstructionSize(*instruction, statement);
+    }
+}
+
+// Encode a chunk into its range of the image, lines from stopLine on are left out
+void Assembler::EmitChunk(const ScanResult& source, Chunk& chunk, uint32_t stopLine) {
+    chunk.context.Reset();
+    
+    uint32_t lastLine = (chunk.lastLine < stopLine) ? chunk.lastLine : stopLine;
+    if (chunk.firstLine >= lastLine) 
+        return;
+    
+    // Every byte of the chunk was appended before the chunks were handed out
+    uint8_t empty = 0;
+    uint8_t* output = (chunk.size > 0) ? image.Data(chunk.address, chunk.size) : &empty;
+    
+    // Labels are already merged, the context only sees the instructions
+    Statement statement;
+    uint32_t address = chunk.address;
+    
+    for (uint32_t ln=chunk.firstLine; ln < lastLine; ln++) {
+        uint32_t firstMark = source.lineMarks[ln];
+        ParseStatement(source.lines[ln], source.marks.data() + firstMark, source.lineMarks[ln + 1] - firstMark, statement);
+        
+        if (statement.tokenCount == 0) 
+            continue;
+        if (statement.token[0] == "section") 
+            continue;
+        
+        const Instruction* instruction = FindInstruction( statement.token[0] );
+        if (instruction == nullptr) 
+            continue;
+        
+        if (instruction->encode(chunk.context, *instruction, statement, ln, address, &output[address - chunk.address]) != 0) 
+            return;
+        
+        address += InstructionSize(*instruction, statement);
+    }
+}
+
+// Patch the label addresses referenced by a chunk, the merged label table is only read
+void Assembler::PatchChunk(Chunk& chunk) {
+    const std::vector<Fixup, ArenaAllocator<Fixup>>& fixups = chunk.context.fixupList;
+    
+    for (unsigned int i=0; i < fixups.size(); i++) {
+        std::string_view name = chunk.context.labelIndex[ fixups[i].symbol ].name;
+        uint32_t index = labelIndex.Find(name, chunk.probes);
+        if (index == SYMBOL_NOT_FOUND || !labelIndex[index].defined) {
+            Diagnostic diagnostic;
+            diagnostic.line = fixups[i].line;
+            diagnostic.type = DIAGNOSTIC_ERROR;
+            diagnostic.message = errorUnknownLabel + std::string(name);
+            chunk.unknownLabels.push_back(std::move(diagnostic));
+            continue;
+        }
+        
+        union Pointer jumpAddress;
+        jumpAddress.address = labelIndex[index].byteOffset;
+        uint8_t* field = image.Data(fixups[i].offset, 4);
+        for (uint8_t a=0; a < 4; a++) 
+            field[a] = jumpAddress.byte_t[a];
+    }
+}
+
+
+int Assemble(std::string_view source, AssemblyResult& result) {
+    Assembler assembler;
+    return assembler.Assemble(source, result);
+}
+
+}
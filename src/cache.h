@@ -0,0 +1,224 @@
+#ifndef _BUILD_CACHE__
+#define _BUILD_CACHE__
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "assembler.h"
+#include "hash.h"
+#include "image.h"
+#include "object.h"
+#include "scanner.h"
+#include "source.h"
+#include "writers.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+ #define CACHE_POSIX
+ #include <sys/stat.h>
+ #include <unistd.h>
+#endif
+
+// Layout of a cache entry, every field a little endian 32-bit word as in an object file
+//   header       magic, assembler version, key low, key high, kind, status, diagnostic count, part count
+//   diagnostics  line, type, message length, the message padded to a whole word
+//   parts        base, size, then the bytes padded to a whole word
+// An image entry has a part per segment, an object entry a single part holding the object file.
+#define CACHE_MAGIC   0x43345800        // "\0X4C"
+
+// What an entry holds
+#define CACHE_IMAGE       0
+#define CACHE_OBJECT      1
+#define CACHE_IMAGE_LONG  2             // An image with every branch long
+
+
+struct CacheEntry {
+    uint32_t kind;
+    int32_t status;                         // Result of the assembly, entries are kept for failed ones too
+    std::vector<x4::Diagnostic> diagnostics;
+    Image image;
+    std::vector<uint8_t> object;
+};
+
+
+// On-disk cache of finished assemblies, keyed by the preprocessed source
+// Anything that changes the bytes produced must be part of the key: the source lines after
+// preprocessing, the kind of output and ASSEMBLER_VERSION. The formats an image is written in are
+// not, every format is written from the cached image. Entries are written to a temporary file and
+// renamed into place, so concurrent runs sharing a directory never read half an entry.
+class BuildCache {
+
+public:
+
+    explicit BuildCache(const std::string& path) : directory(path) {
+#ifdef CACHE_POSIX
+        mkdir(directory.c_str(), 0755);
+#endif
+    }
+
+    /// Key of a source read as it is.
+    /// Text equal to lines joined by newlines is the same program, so the two keys may coincide.
+    static uint64_t Key(std::string_view text, uint32_t kind) {
+        Hash64 hash;
+        hash.Update((uint32_t)ASSEMBLER_VERSION);
+        hash.Update(kind);
+        hash.Update(text);
+        return hash.Digest();
+    }
+
+    /// Key of the preprocessed lines of one assembly.
+    static uint64_t Key(const ScanResult& source, uint32_t kind) {
+        Hash64 hash;
+        hash.Update((uint32_t)ASSEMBLER_VERSION);
+        hash.Update(kind);
+        for (uint32_t i=0; i < source.lines.size(); i++) {
+            hash.Update(source.lines[i]);
+            hash.Update("\n", 1);
+        }
+        return hash.Digest();
+    }
+
+    /// Read the entry of a key, returns -1 if there is none or it is not valid.
+    int Load(uint64_t key, CacheEntry& entry) const {
+        SourceFile file;
+        if (file.Open(Filename(key)) != 0)
+            return -1;
+
+        std::string_view text = file.Text();
+        ObjectReader reader = {reinterpret_cast<const uint8_t*>(text.data()), text.size(), 0};
+        uint32_t magic, version, keyLow, keyHigh, status, diagnosticCount, partCount;
+        if (!reader.Word(magic) || !reader.Word(version) || !reader.Word(keyLow) || !reader.Word(keyHigh) ||
+            !reader.Word(entry.kind) || !reader.Word(status) || !reader.Word(diagnosticCount) || !reader.Word(partCount))
+            return -1;
+        if (magic != CACHE_MAGIC || version != ASSEMBLER_VERSION || keyLow != (uint32_t)key || keyHigh != (uint32_t)(key >> 32))
+            return -1;
+        if (diagnosticCount > text.size() / 12 || partCount > text.size() / 8)
+            return -1;
+        entry.status = (int32_t)status;
+
+        entry.diagnostics.resize(diagnosticCount);
+        for (uint32_t i=0; i < diagnosticCount; i++) {
+            uint32_t line, type, length;
+            if (!reader.Word(line) || !reader.Word(type) || !reader.Word(length))
+                return -1;
+            const uint8_t* message = reader.Bytes((size_t(length) + 3) / 4 * 4);
+            if (message == nullptr)
+                return -1;
+            entry.diagnostics[i].line = (int)line;
+            entry.diagnostics[i].type = (int)type;
+            entry.diagnostics[i].message.assign(reinterpret_cast<const char*>(message), length);
+        }
+
+        entry.image.clear();
+        entry.object.clear();
+        for (uint32_t i=0; i < partCount; i++) {
+            uint32_t base, size;
+            if (!reader.Word(base) || !reader.Word(size))
+                return -1;
+            const uint8_t* bytes = reader.Bytes((size_t(size) + 3) / 4 * 4);
+            if (bytes == nullptr)
+                return -1;
+
+            if (entry.kind == CACHE_OBJECT) {
+                entry.object.assign(bytes, bytes + size);
+                continue;
+            }
+            uint8_t* output = nullptr;
+            if (entry.image.Origin(base) == 0)
+                output = entry.image.Append(size);
+            if (output == nullptr)
+                return -1;
+            if (size > 0)
+                memcpy(output, bytes, size);
+        }
+        return 0;
+    }
+
+    /// Write the entry of a key, returns -1 if it could not be written.
+    int Store(uint64_t key, const CacheEntry& entry) const {
+        std::vector<std::pair<uint32_t, const std::vector<uint8_t>*>> parts;
+        if (entry.kind == CACHE_OBJECT) {
+            parts.push_back(std::make_pair(0u, &entry.object));
+        } else {
+            for (uint32_t i=0; i < entry.image.SegmentCount(); i++)
+                if (entry.image.Segment(i).size > 0)
+                    parts.push_back(std::make_pair(entry.image.Segment(i).base, &entry.image.Segment(i).bytes));
+        }
+
+        size_t size = 8 * 4;
+        for (unsigned int i=0; i < entry.diagnostics.size(); i++)
+            size += 3 * 4 + (entry.diagnostics[i].message.size() + 3) / 4 * 4;
+        for (unsigned int i=0; i < parts.size(); i++)
+            size += 2 * 4 + (parts[i].second->size() + 3) / 4 * 4;
+
+        std::string temporary = Filename(key) + "." + TemporarySuffix();
+        OutputFile file;
+        if (file.Open(temporary, size) != 0)
+            return -1;
+
+        uint8_t* output = file.Data();
+        output = PutObjectWord(output, CACHE_MAGIC);
+        output = PutObjectWord(output, ASSEMBLER_VERSION);
+        output = PutObjectWord(output, (uint32_t)key);
+        output = PutObjectWord(output, (uint32_t)(key >> 32));
+        output = PutObjectWord(output, entry.kind);
+        output = PutObjectWord(output, (uint32_t)entry.status);
+        output = PutObjectWord(output, entry.diagnostics.size());
+        output = PutObjectWord(output, parts.size());
+
+        for (unsigned int i=0; i < entry.diagnostics.size(); i++) {
+            const x4::Diagnostic& diagnostic = entry.diagnostics[i];
+            output = PutObjectWord(output, (uint32_t)diagnostic.line);
+            output = PutObjectWord(output, (uint32_t)diagnostic.type);
+            output = PutObjectWord(output, diagnostic.message.size());
+            output = PutPadded(output, diagnostic.message.data(), diagnostic.message.size());
+        }
+        for (unsigned int i=0; i < parts.size(); i++) {
+            output = PutObjectWord(output, parts[i].first);
+            output = PutObjectWord(output, parts[i].second->size());
+            output = PutPadded(output, parts[i].second->data(), parts[i].second->size());
+        }
+
+        if (file.Close() != 0 || std::rename(temporary.c_str(), Filename(key).c_str()) != 0) {
+            std::remove(temporary.c_str());
+            return -1;
+        }
+        return 0;
+    }
+
+private:
+
+    std::string directory;
+
+    std::string Filename(uint64_t key) const {
+        char name[17];
+        for (int i=15; i >= 0; i--, key >>= 4)
+            name[i] = "0123456789abcdef"[key & 0xF];
+        name[16] = '\0';
+        return directory + "/" + name + ".x4c";
+    }
+
+    // Unique between the threads and processes writing the same key
+    static std::string TemporarySuffix() {
+        std::string suffix = std::to_string(std::hash<std::thread::id>()(std::this_thread::get_id()));
+#ifdef CACHE_POSIX
+        suffix += "." + std::to_string(getpid());
+#endif
+        return suffix + ".tmp";
+    }
+
+    static uint8_t* PutPadded(uint8_t* output, const void* data, size_t size) {
+        size_t padded = (size + 3) / 4 * 4;
+        if (size > 0)
+            memcpy(output, data, size);
+        memset(output + size, 0, padded - size);
+        return output + padded;
+    }
+
+};
+
+#endif
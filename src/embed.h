@@ -0,0 +1,564 @@
+#ifndef _EMBED_ASSEMBLER__
+#define _EMBED_ASSEMBLER__
+
+#include <array>
+#include <cstdint>
+#include <string_view>
+
+#include "types.h"
+#include "registers.h"
+#include "opcodes.h"
+#include "image.h"
+#include "relax.h"
+
+// Compile time assembler
+// Assembles a program given as a string literal into a std::array while the host is compiled:
+//
+//     #include "embed.h"
+//     constexpr auto program = X4_ASSEMBLE(R"(
+//         section .text
+//         start: MOV AL, 0x41
+//                JMP start
+//     )");
+//
+// The bytes are those of a flat binary from the assembler, gaps between ORG segments zero filled, and
+// the branches are relaxed as the assembler relaxes them. X4_ASSEMBLE_LONG_BRANCHES keeps them long.
+// An error fails the compile in an instantiation of x4::embed::Report, its arguments name the error
+// and the source line, counted from one. Symbols, segments, relaxed branches and the image have fixed capacities below,
+// constant evaluation holds no vectors in C++17. The compiler's constexpr step limit bounds the
+// size of a program, raise it with -fconstexpr-ops-limit or -fconstexpr-steps for large ones.
+
+// Labels, and separately variables, a program may define
+#define EMBED_MAX_SYMBOLS   1024
+
+// Segments ORG may start
+#define EMBED_MAX_SEGMENTS  64
+
+// Branches a relaxed program may have, X4_ASSEMBLE_LONG_BRANCHES has no limit
+#define EMBED_MAX_BRANCHES  4096
+
+// Largest flat image, the array is built in constant evaluation
+#define EMBED_MAX_SIZE      0x100000
+
+namespace x4 {
+namespace embed {
+
+// What went wrong, named for the message the assembler reports
+enum EmbedError : uint32_t {
+    EMBED_OK,
+    EMBED_MISSING_VALUE,
+    EMBED_INVALID_LITERAL,
+    EMBED_LITERAL_OUT_OF_RANGE,
+    EMBED_DUPLICATE_VARIABLE,
+    EMBED_MISSING_ADDRESS,
+    EMBED_ORIGIN_OVERLAPS_PLACED_CODE_OR_IS_OUT_OF_RANGE,
+    EMBED_DUPLICATE_LABEL,
+    EMBED_PROGRAM_RUNS_INTO_CODE_PLACED_AT_A_HIGHER_ADDRESS,
+    EMBED_MISSING_PARAMETER,
+    EMBED_UNKNOWN_REGISTER,
+    EMBED_MISSING_STRING,
+    EMBED_UNKNOWN_LABEL,
+    EMBED_SECTION_TEXT_NOT_FOUND,
+    EMBED_TOO_MANY_SYMBOLS,
+    EMBED_TOO_MANY_SEGMENTS,
+    EMBED_PROGRAM_TOO_LARGE,
+    EMBED_TOO_MANY_BRANCHES,
+};
+
+struct EmbedResult {
+    EmbedError error;
+    uint32_t line;                      // Of the error, counted from one
+    uint32_t size;                      // Of the flat image
+};
+
+// Extent of a segment, the bytes are written straight into the flat image
+struct EmbedSegment {
+    uint32_t base = 0;
+    uint32_t size = 0;
+};
+
+struct EmbedSymbol {
+    std::string_view name;
+    uint32_t address = 0;
+};
+
+// What the first pass learns of a program: its symbols, the extent of its segments and its branches
+struct EmbedLayout {
+    EmbedSymbol labels[EMBED_MAX_SYMBOLS] = {};
+    uint32_t labelCount = 0;
+    EmbedSymbol variables[EMBED_MAX_SYMBOLS] = {};
+    uint32_t variableCount = 0;
+    EmbedSegment segments[EMBED_MAX_SEGMENTS] = {};
+    uint32_t segmentCount = 0;
+    uint32_t current = IMAGE_NO_SEGMENT;
+    uint32_t end = 0;
+
+    // Branches in the long layout and the labels they name, none if they are kept long
+    Branch branches[EMBED_MAX_BRANCHES] = {};
+    std::string_view branchLabels[EMBED_MAX_BRANCHES] = {};
+    uint32_t branchCount = 0;
+    bool longBranches = false;
+    uint32_t bases[EMBED_MAX_SEGMENTS] = {};
+    BranchList list = {};           // Set once the branches are relaxed
+};
+
+constexpr EmbedResult Fail(EmbedError error, uint32_t line) {
+    return {error, line, 0};
+}
+
+constexpr EmbedError LiteralError(int result) {
+    switch (result) {
+        case LITERAL_EMPTY:        return EMBED_MISSING_VALUE;
+        case LITERAL_INVALID:      return EMBED_INVALID_LITERAL;
+        case LITERAL_OUT_OF_RANGE: return EMBED_LITERAL_OUT_OF_RANGE;
+    }
+    return EMBED_OK;
+}
+
+// Symbol names are case independent, as in the symbol table
+constexpr bool NameEquals(std::string_view a, std::string_view b) {
+    if (a.length() != b.length())
+        return false;
+    for (size_t i=0; i < a.length(); i++) {
+        char x = (a[i] >= 'a' && a[i] <= 'z') ? a[i] - 'a' + 'A' : a[i];
+        char y = (b[i] >= 'a' && b[i] <= 'z') ? b[i] - 'a' + 'A' : b[i];
+        if (x != y)
+            return false;
+    }
+    return true;
+}
+
+constexpr const EmbedSymbol* FindSymbol(const EmbedSymbol* symbols, uint32_t count, std::string_view name) {
+    for (uint32_t i=0; i < count; i++)
+        if (NameEquals(symbols[i].name, name))
+            return &symbols[i];
+    return nullptr;
+}
+
+// Add a symbol, -1 if it is defined already
+constexpr int InsertSymbol(EmbedSymbol* symbols, uint32_t& count, std::string_view name, uint32_t address) {
+    if (FindSymbol(symbols, count, name) != nullptr)
+        return -1;
+    symbols[count++] = {name, address};
+    return 0;
+}
+
+
+// Image::Origin over the fixed segments of a layout
+constexpr int Origin(EmbedLayout& layout, uint32_t address) {
+    if (address >= MAX_PROGRAM_SIZE)
+        return -1;
+    if (layout.current != IMAGE_NO_SEGMENT && address == layout.segments[layout.current].base + layout.segments[layout.current].size)
+        return 0;
+
+    // Leave no empty segment behind
+    if (layout.current != IMAGE_NO_SEGMENT && layout.segments[layout.current].size == 0) {
+        for (uint32_t i=layout.current; i + 1 < layout.segmentCount; i++)
+            layout.segments[i] = layout.segments[i + 1];
+        layout.segmentCount--;
+    }
+    layout.current = IMAGE_NO_SEGMENT;
+
+    uint32_t index = 0;
+    while (index < layout.segmentCount && layout.segments[index].base <= address)
+        index++;
+    if (index > 0) {
+        const EmbedSegment& below = layout.segments[index - 1];
+        if (address < below.base + below.size)
+            return -1;
+        if (address == below.base + below.size) {
+            layout.current = index - 1;
+            return 0;
+        }
+    }
+
+    for (uint32_t i=layout.segmentCount; i > index; i--)
+        layout.segments[i] = layout.segments[i - 1];
+    layout.segments[index].base = address;
+    layout.segments[index].size = 0;
+    layout.segmentCount++;
+    layout.current = index;
+    return 0;
+}
+
+// Image::Append without the bytes, -1 if they would run into the next segment or past MAX_PROGRAM_SIZE
+constexpr int Append(EmbedLayout& layout, uint32_t size) {
+    if (layout.current == IMAGE_NO_SEGMENT)
+        Origin(layout, 0);
+    EmbedSegment& segment = layout.segments[layout.current];
+    uint32_t limit = (layout.current + 1 < layout.segmentCount) ? layout.segments[layout.current + 1].base : MAX_PROGRAM_SIZE;
+    if (size > limit - (segment.base + segment.size))
+        return -1;
+    segment.size += size;
+    if (size > 0 && segment.base + segment.size > layout.end)
+        layout.end = segment.base + segment.size;
+    return 0;
+}
+
+
+// Write a label address field, the fields of an image sized by the first pass only
+constexpr void PutAddress(uint8_t* output, uint32_t capacity, uint32_t offset, uint32_t address) {
+    for (uint32_t i=0; i < 4; i++)
+        if (output != nullptr && offset + i < capacity)
+            output[offset + i] = (uint8_t)(address >> (i * 8));
+}
+
+// The encoders of instructions.h, writing nothing when the output is null. Label fields are
+// resolved against the labels of the layout when it is given, and left zero when it is not. The
+// address is that of the relaxed layout, a branch is encoded in the form it was given.
+constexpr EmbedError Encode(const Opcode& instruction, const Statement& statement, uint32_t address, uint8_t form, const EmbedLayout* layout, uint8_t* output, uint32_t capacity) {
+    uint8_t bytes[8] = {};
+    uint32_t size = InstructionSize(instruction, statement);
+    std::string_view label;
+    uint32_t labelOffset = 0;
+    bool hasLabel = false;
+
+    switch (instruction.operands) {
+        case OPERAND_NONE:
+            bytes[0] = instruction.opcode;
+            break;
+
+        case OPERAND_REG8: {
+            if (statement.tokenCount < 2)
+                return EMBED_MISSING_PARAMETER;
+            bytes[0] = instruction.opcode;
+            uint8_t regTypeA = get_register_code(statement.token[1]);
+            if (regTypeA == 0xff)
+                return EMBED_UNKNOWN_REGISTER;
+            bytes[1] = regTypeA;
+            break;
+        }
+
+        case OPERAND_IMM8: {
+            if (OperandCount(statement) < 1)
+                return EMBED_MISSING_PARAMETER;
+            bytes[0] = instruction.opcode;
+            uint32_t value = 0;
+            int result = ParseLiteral(GetOperand(statement, 0), 8, value);
+            if (result != LITERAL_OK)
+                return LiteralError(result);
+            bytes[1] = value;
+            break;
+        }
+
+        case OPERAND_COMPARE: {
+            if (OperandCount(statement) < 2)
+                return EMBED_MISSING_PARAMETER;
+            bytes[0] = CMP_OPCODE;
+            uint8_t regTypeA = get_register_code(GetOperand(statement, 0));
+            if (regTypeA == 0xff)
+                return EMBED_UNKNOWN_REGISTER;
+            bytes[1] = regTypeA;
+
+            std::string_view paramB = GetOperand(statement, 1);
+            uint8_t regTypeB = get_register_code(paramB);
+            if (regTypeB == 0xff) {
+                uint32_t value = 0;
+                int result = ParseLiteral(paramB, 8, value);
+                if (result != LITERAL_OK)
+                    return LiteralError(result);
+                bytes[2] = value;
+            } else {
+                bytes[2] = regTypeB;
+                bytes[0] = CMPR_OPCODE;
+            }
+            break;
+        }
+
+        case OPERAND_MOVE: {
+            if (OperandCount(statement) < 2)
+                return EMBED_MISSING_PARAMETER;
+            std::string_view paramA = GetOperand(statement, 0);
+            std::string_view paramB = GetOperand(statement, 1);
+
+            // Memory moves are not encoded yet and stay zero
+            if (OperandContains(statement, '[') && OperandContains(statement, ']'))
+                break;
+
+            uint8_t regTypeA = get_register_code(paramA);
+            if (regTypeA != 0xff) {
+                bytes[0] = MOVB_OPCODE;
+                bytes[1] = regTypeA;
+                uint8_t regTypeB = get_register_code(paramB);
+                if (regTypeB == 0xff) {
+                    uint32_t value = 0;
+                    int result = ParseLiteral(paramB, 8, value);
+                    if (result != LITERAL_OK)
+                        return LiteralError(result);
+                    bytes[2] = value;
+                } else {
+                    bytes[2] = regTypeB;
+                    bytes[0] = MOVR_OPCODE;
+                }
+                break;
+            }
+
+            regTypeA = get_register_code16(paramA);
+            if (regTypeA == 0xff)
+                return EMBED_UNKNOWN_REGISTER;
+            bytes[0] = MOVA_OPCODE;
+            bytes[1] = regTypeA;
+            if (paramB.empty() || paramB[0] != '$')
+                return EMBED_UNKNOWN_LABEL;
+            paramB.remove_prefix(1); // Remove the $ symbol
+            label = paramB;
+            labelOffset = 2;
+            hasLabel = true;
+            break;
+        }
+
+        case OPERAND_LABEL:
+            if (statement.tokenCount < 2)
+                return EMBED_MISSING_PARAMETER;
+            bytes[0] = BranchOpcode(instruction.opcode, form);
+            size = BranchSize(form);
+            label = statement.token[1];
+            labelOffset = 1;
+            hasLabel = true;
+            break;
+
+        case OPERAND_STRING:
+            if (!statement.hasString)
+                return EMBED_MISSING_STRING;
+            if (output != nullptr) {
+                for (size_t i=0; i < statement.string.length(); i++)
+                    output[address + i] = (uint8_t)statement.string[i];
+                if (StringTerminated(statement))
+                    output[address + statement.string.length()] = 0x00;
+            }
+            return EMBED_OK;
+    }
+
+    if (output != nullptr)
+        for (uint32_t i=0; i < size && i < sizeof(bytes); i++)
+            output[address + i] = bytes[i];
+
+    if (hasLabel && layout != nullptr) {
+        const EmbedSymbol* target = FindSymbol(layout->labels, layout->labelCount, label);
+        if (target == nullptr)
+            return EMBED_UNKNOWN_LABEL;
+        uint32_t targetAddress = RelaxedAddress(layout->list, target->address);
+        if (instruction.operands == OPERAND_LABEL && form != BRANCH_LONG) {
+            uint32_t displacement = targetAddress - (address + size);
+            for (uint32_t i=1; i < size; i++)
+                if (output != nullptr && address + i < capacity)
+                    output[address + i] = (uint8_t)(displacement >> ((i - 1) * 8));
+        } else {
+            PutAddress(output, capacity, address + labelOffset, targetAddress);
+        }
+    }
+    return EMBED_OK;
+}
+
+
+// Walk the lines of a program the way Assembler::AssembleLines walks them
+// The first pass, without a layout, checks every line and lays out the labels and segments.
+// The second pass encodes into the output with every label known.
+constexpr EmbedResult Walk(std::string_view text, EmbedLayout& layout, bool firstPass, uint8_t* output, uint32_t capacity) {
+    Statement statement = {};
+    uint32_t programSize = 0;
+    bool textFound = false;
+    uint32_t ln = 0;
+
+    size_t lineStart = 0;
+    while (lineStart < text.length()) {
+        size_t lineEnd = text.find('\n', lineStart);
+        if (lineEnd == std::string_view::npos)
+            lineEnd = text.length();
+        std::string_view line = text.substr(lineStart, lineEnd - lineStart);
+        if (!line.empty() && line.back() == '\r')
+            line.remove_suffix(1);
+        lineStart = lineEnd + 1;
+        ln++;
+
+        // The delimiters ScanSource would mark, fed to the parser one at a time
+        ClearStatement(statement);
+        size_t start = 0;
+        bool inString = false;
+        for (size_t i=0; i < line.length(); i++)
+            if (delimiterTable[(uint8_t)line[i]])
+                ParseDelimiter(line, i, start, inString, statement);
+        ParseDelimiter(line, line.length(), start, inString, statement);
+
+        if (statement.tokenCount == 0 && statement.label.empty())
+            continue;
+
+        if (statement.tokenCount > 0 && statement.token[0] == "section") {
+            if (statement.tokenCount > 1 && statement.token[1] == ".text")
+                textFound = true;
+            continue;
+        }
+
+        if (!textFound && statement.hasEquals) {
+            if (!firstPass)
+                continue;
+            if (OperandCount(statement) < 1)
+                return Fail(EMBED_MISSING_VALUE, ln);
+            uint32_t number = 0;
+            int result = ParseLiteral(GetOperand(statement, 0), 32, number);
+            if (result != LITERAL_OK)
+                return Fail(LiteralError(result), ln);
+            if (layout.variableCount == EMBED_MAX_SYMBOLS)
+                return Fail(EMBED_TOO_MANY_SYMBOLS, ln);
+            if (InsertSymbol(layout.variables, layout.variableCount, statement.token[0], number) != 0)
+                return Fail(EMBED_DUPLICATE_VARIABLE, ln);
+            continue;
+        }
+
+        if (statement.tokenCount > 0 && statement.token[0] == "ORG") {
+            if (OperandCount(statement) < 1)
+                return Fail(EMBED_MISSING_ADDRESS, ln);
+            uint32_t address = 0;
+            int result = ParseLiteral(GetOperand(statement, 0), 32, address);
+            if (result != LITERAL_OK)
+                return Fail(LiteralError(result), ln);
+            if (firstPass) {
+                if (layout.segmentCount == EMBED_MAX_SEGMENTS)
+                    return Fail(EMBED_TOO_MANY_SEGMENTS, ln);
+                if (Origin(layout, address) != 0)
+                    return Fail(EMBED_ORIGIN_OVERLAPS_PLACED_CODE_OR_IS_OUT_OF_RANGE, ln);
+            }
+            programSize = address;
+        }
+
+        if (!statement.label.empty() && firstPass) {
+            if (layout.labelCount == EMBED_MAX_SYMBOLS)
+                return Fail(EMBED_TOO_MANY_SYMBOLS, ln);
+            if (InsertSymbol(layout.labels, layout.labelCount, statement.label, programSize) != 0)
+                return Fail(EMBED_DUPLICATE_LABEL, ln);
+        }
+
+        if (statement.tokenCount == 0)
+            continue;
+
+        // Symbols shared with other modules mean nothing in a flat image
+        if (statement.token[0] == "GLOBAL" || statement.token[0] == "EXTERN")
+            continue;
+
+        uint32_t index = FindOpcode(statement.token[0]);
+        if (index == OPCODE_NOT_FOUND)
+            continue;
+        const Opcode& instruction = opcodeTable[index];
+
+        uint32_t size = InstructionSize(instruction, statement);
+        bool branch = (instruction.operands == OPERAND_LABEL && statement.tokenCount > 1);
+        if (firstPass) {
+            if (Append(layout, size) != 0)
+                return Fail(EMBED_PROGRAM_RUNS_INTO_CODE_PLACED_AT_A_HIGHER_ADDRESS, ln);
+            if (layout.end > EMBED_MAX_SIZE)
+                return Fail(EMBED_PROGRAM_TOO_LARGE, ln);
+            if (branch && !layout.longBranches) {
+                if (layout.branchCount == EMBED_MAX_BRANCHES)
+                    return Fail(EMBED_TOO_MANY_BRANCHES, ln);
+                layout.branches[layout.branchCount] = {programSize, 0, 0, 0, 0, BRANCH_SHORT};
+                layout.branchLabels[layout.branchCount++] = statement.token[1];
+            }
+        }
+
+        // Every line moves down by the bytes the branches before it in its segment save
+        uint32_t address = firstPass ? programSize : RelaxedAddress(layout.list, programSize);
+        uint8_t form = BRANCH_LONG;
+        if (branch && !firstPass) {
+            uint32_t below = BranchesBelow(layout.list, programSize + 1);
+            if (below > 0 && layout.list.branches[below - 1].address == programSize)
+                form = layout.list.branches[below - 1].form;
+        }
+        EmbedError error = Encode(instruction, statement, address, form, firstPass ? nullptr : &layout, output, capacity);
+        if (error != EMBED_OK)
+            return Fail(error, ln);
+
+        programSize += size;
+    }
+
+    if (firstPass && !textFound)
+        return Fail(EMBED_SECTION_TEXT_NOT_FOUND, ln);
+    return {EMBED_OK, 0, layout.end};
+}
+
+// Choose the branch forms between the passes and return the end of the relaxed image
+// A branch to an undefined label stays long, the second pass reports it.
+constexpr uint32_t Relax(EmbedLayout& layout) {
+    for (uint32_t i=0; i < layout.branchCount; i++) {
+        Branch& branch = layout.branches[i];
+        const EmbedSymbol* target = FindSymbol(layout.labels, layout.labelCount, layout.branchLabels[i]);
+        branch.target = (target != nullptr) ? target->address : branch.address;
+        if (target == nullptr)
+            branch.form = BRANCH_LONG;
+    }
+
+    // In line order, which is address order unless ORG went back
+    for (uint32_t i=1; i < layout.branchCount; i++) {
+        Branch branch = layout.branches[i];
+        uint32_t j = i;
+        for (; j > 0 && layout.branches[j - 1].address > branch.address; j--)
+            layout.branches[j] = layout.branches[j - 1];
+        layout.branches[j] = branch;
+    }
+
+    for (uint32_t i=0; i < layout.segmentCount; i++)
+        layout.bases[i] = layout.segments[i].base;
+    layout.list = {layout.branches, layout.branchCount, layout.bases, layout.segmentCount};
+    RelaxBranches(layout.list);
+
+    uint32_t end = 0;
+    for (uint32_t i=0; i < layout.segmentCount; i++) {
+        const EmbedSegment& segment = layout.segments[i];
+        if (segment.size > 0 && RelaxedAddress(layout.list, segment.base + segment.size) > end)
+            end = RelaxedAddress(layout.list, segment.base + segment.size);
+    }
+    return end;
+}
+
+// Assemble into an output of the given capacity, or only check the program and size it when the output is null
+constexpr EmbedResult Run(std::string_view text, bool longBranches, uint8_t* output, uint32_t capacity) {
+    EmbedLayout layout;
+    layout.longBranches = longBranches;
+    EmbedResult result = Walk(text, layout, true, nullptr, 0);
+    if (result.error != EMBED_OK)
+        return result;
+    result.size = Relax(layout);
+    if (output != nullptr && capacity < result.size)
+        return Fail(EMBED_PROGRAM_TOO_LARGE, 0);
+    EmbedResult encoded = Walk(text, layout, false, output, capacity);
+    if (encoded.error != EMBED_OK)
+        return encoded;
+    return result;
+}
+
+/// Check a program and return the size of its flat image, or the first error and its line.
+constexpr EmbedResult Check(std::string_view text, bool longBranches = false) {
+    return Run(text, longBranches, nullptr, 0);
+}
+
+/// Assemble a program into the N bytes of its flat image, N as Check returned it.
+template<uint32_t N, bool longBranches = false>
+constexpr std::array<uint8_t, N> Assemble(std::string_view text) {
+    std::array<uint8_t, N> program = {};
+    Run(text, longBranches, program.data(), N);
+    return program;
+}
+
+/// Fails the compile when a program does not assemble, the instantiation names the error and its line.
+template<EmbedError error, uint32_t line>
+constexpr void Report() {
+    static_assert(error == EMBED_OK, "X4 program does not assemble, see the error and line of x4::embed::Report");
+}
+
+}
+}
+
+// Assemble a string literal into a constexpr std::array<uint8_t, N> of its flat image
+#define X4_ASSEMBLE(source) X4_ASSEMBLE_BRANCHES(source, false)
+
+// The same with every branch kept long, as --long-branches does
+#define X4_ASSEMBLE_LONG_BRANCHES(source) X4_ASSEMBLE_BRANCHES(source, true)
+
+#define X4_ASSEMBLE_BRANCHES(source, longBranches) ([]() {                              \
+    constexpr std::string_view text_ = (source);                                        \
+    constexpr x4::embed::EmbedResult result_ = x4::embed::Check(text_, longBranches);   \
+    x4::embed::Report<result_.error, result_.line>();                                   \
+    constexpr auto program_ = x4::embed::Assemble<result_.size, longBranches>(text_);   \
+    return program_;                                                                    \
+}())
+
+#endif
@@ -0,0 +1,126 @@
+#ifndef _CONTENT_HASH__
+#define _CONTENT_HASH__
+
+#include <cstdint>
+#include <cstring>
+#include <string_view>
+
+// XXH64 primes
+#define HASH_PRIME1  0x9E3779B185EBCA87ull
+#define HASH_PRIME2  0xC2B2AE3D27D4EB4Full
+#define HASH_PRIME3  0x165667B19E3779F9ull
+#define HASH_PRIME4  0x85EBCA77C2B2AE63ull
+#define HASH_PRIME5  0x27D4EB2F165667C5ull
+
+
+// Streaming XXH64 of any number of pieces
+// The digest equals the XXH64 of the pieces joined, however the input is split.
+class Hash64 {
+
+public:
+
+    explicit Hash64(uint64_t seed = 0) : total(0), held(0) {
+        lane[0] = seed + HASH_PRIME1 + HASH_PRIME2;
+        lane[1] = seed + HASH_PRIME2;
+        lane[2] = seed;
+        lane[3] = seed - HASH_PRIME1;
+        this->seed = seed;
+    }
+
+    void Update(const void* data, size_t size) {
+        const uint8_t* input = static_cast<const uint8_t*>(data);
+        total += size;
+
+        // Top up a partial stripe first
+        if (held > 0) {
+            size_t fill = 32 - held;
+            if (fill > size)
+                fill = size;
+            memcpy(buffer + held, input, fill);
+            held += fill;
+            input += fill;
+            size -= fill;
+            if (held < 32)
+                return;
+            Stripe(buffer);
+            held = 0;
+        }
+
+        for (; size >= 32; size -= 32, input += 32)
+            Stripe(input);
+
+        if (size > 0) {
+            memcpy(buffer, input, size);
+            held = size;
+        }
+    }
+
+    void Update(std::string_view text) {Update(text.data(), text.size());}
+
+    void Update(uint32_t value) {Update(&value, 4);}
+
+    uint64_t Digest() const {
+        uint64_t hash;
+        if (total >= 32) {
+            hash = Rotate(lane[0], 1) + Rotate(lane[1], 7) + Rotate(lane[2], 12) + Rotate(lane[3], 18);
+            for (unsigned int i=0; i < 4; i++)
+                hash = (hash ^ Round(0, lane[i])) * HASH_PRIME1 + HASH_PRIME4;
+        } else {
+            hash = seed + HASH_PRIME5;
+        }
+        hash += total;
+
+        const uint8_t* input = buffer;
+        size_t size = held;
+        for (; size >= 8; size -= 8, input += 8)
+            hash = Rotate(hash ^ Round(0, Read64(input)), 27) * HASH_PRIME1 + HASH_PRIME4;
+        if (size >= 4) {
+            hash = Rotate(hash ^ (Read32(input) * HASH_PRIME1), 23) * HASH_PRIME2 + HASH_PRIME3;
+            input += 4;
+            size -= 4;
+        }
+        for (; size > 0; size--, input++)
+            hash = Rotate(hash ^ (*input * HASH_PRIME5), 11) * HASH_PRIME1;
+
+        hash ^= hash >> 33;
+        hash *= HASH_PRIME2;
+        hash ^= hash >> 29;
+        hash *= HASH_PRIME3;
+        hash ^= hash >> 32;
+        return hash;
+    }
+
+private:
+
+    uint64_t lane[4];
+    uint64_t seed;
+    uint64_t total;
+    uint8_t buffer[32];
+    size_t held;
+
+    static uint64_t Rotate(uint64_t value, unsigned int bits) {return (value << bits) | (value >> (64 - bits));}
+
+    static uint64_t Round(uint64_t accumulator, uint64_t input) {
+        return Rotate(accumulator + input * HASH_PRIME2, 31) * HASH_PRIME1;
+    }
+
+    static uint64_t Read64(const uint8_t* input) {
+        uint64_t value;
+        memcpy(&value, input, 8);
+        return value;
+    }
+
+    static uint64_t Read32(const uint8_t* input) {
+        uint32_t value;
+        memcpy(&value, input, 4);
+        return value;
+    }
+
+    void Stripe(const uint8_t* input) {
+        for (unsigned int i=0; i < 4; i++)
+            lane[i] = Round(lane[i], Read64(input + i * 8));
+    }
+
+};
+
+#endif
@@ -0,0 +1,225 @@
+#ifndef _PROGRAM_IMAGE__
+#define _PROGRAM_IMAGE__
+
+#include <cstdint>
+#include <cstring>
+#include <utility>
+#include <vector>
+
+// One past the highest address an image can hold
+// Keeps address plus size arithmetic inside 32 bits and a flat binary of any image loadable
+#define MAX_PROGRAM_SIZE  0x40000000u
+
+// Segments grow by whole chunks
+#define IMAGE_CHUNK_SIZE  (64 * 1024)
+
+#define IMAGE_NO_SEGMENT  0xFFFFFFFF
+
+
+// Run of bytes placed at consecutive addresses
+struct ImageSegment {
+    uint32_t base;                  // Address of the first byte
+    uint32_t size;                  // Bytes placed in the segment
+    std::vector<uint8_t> bytes;     // The last bytes.size() bytes of the segment, all of them unless released
+};
+
+
+// Program image made of segments at sparse addresses
+// Code is appended to the current segment, ORG starts or continues another one.
+// The gaps between segments are never stored.
+class Image {
+
+public:
+
+    Image() : current(IMAGE_NO_SEGMENT) {}
+
+    /// Drop every segment. The buffer of the largest is kept for the next segment placed, so an
+    /// image cleared and filled again does not allocate.
+    void clear() {
+        for (unsigned int i=0; i < segments.size(); i++)
+            if (segments[i].bytes.capacity() > spare.capacity())
+                spare.swap(segments[i].bytes);
+        segments.clear();
+        current = IMAGE_NO_SEGMENT;
+    }
+
+    void swap(Image& other) {
+        segments.swap(other.segments);
+        spare.swap(other.spare);
+        std::swap(current, other.current);
+    }
+
+    /// Drop the bytes but keep the extent of every segment, so later code is still checked against them.
+    void Release() {
+        for (unsigned int i=0; i < segments.size(); i++)
+            segments[i].bytes.clear();
+    }
+
+    /// Place the following bytes at an address. Returns -1 if the address is inside placed bytes
+    /// or not below MAX_PROGRAM_SIZE.
+    int Origin(uint32_t address) {
+        if (address >= MAX_PROGRAM_SIZE)
+            return -1;
+        if (current != IMAGE_NO_SEGMENT && address == End(segments[current]))
+            return 0;
+
+        // Leave no empty segment behind
+        if (current != IMAGE_NO_SEGMENT && segments[current].size == 0)
+            segments.erase(segments.begin() + current);
+        current = IMAGE_NO_SEGMENT;
+
+        uint32_t index = Above(address);
+        if (index > 0) {
+            const ImageSegment& below = segments[index - 1];
+            if (address < End(below))
+                return -1;
+            if (address == End(below)) {
+                current = index - 1;
+                return 0;
+            }
+        }
+
+        ImageSegment segment;
+        segment.base = address;
+        segment.size = 0;
+        segment.bytes.swap(spare);
+        segment.bytes.clear();
+        segments.insert(segments.begin() + index, std::move(segment));
+        current = index;
+        return 0;
+    }
+
+    /// Address the next appended byte is placed at.
+    uint32_t Address() const {
+        if (current == IMAGE_NO_SEGMENT)
+            return 0;
+        return End(segments[current]);
+    }
+
+    /// Bytes that can still be appended before the next segment or MAX_PROGRAM_SIZE.
+    uint32_t Room() const {
+        if (current == IMAGE_NO_SEGMENT)
+            return segments.size() > 0 ? segments[0].base : MAX_PROGRAM_SIZE;
+        return Limit(current) - End(segments[current]);
+    }
+
+    /// Append bytes to the current segment and return them to be filled in.
+    /// Returns a null pointer if they would run into the next segment or past MAX_PROGRAM_SIZE.
+    uint8_t* Append(uint32_t size) {
+        if (current == IMAGE_NO_SEGMENT)
+            Origin(0);
+        if (size > Room())
+            return nullptr;
+
+        ImageSegment& segment = segments[current];
+        size_t held = segment.bytes.size();
+        if (held + size > segment.bytes.capacity()) {
+            size_t capacity = segment.bytes.capacity() * 2;
+            if (capacity < held + size)
+                capacity = held + size;
+            segment.bytes.reserve((capacity + IMAGE_CHUNK_SIZE - 1) / IMAGE_CHUNK_SIZE * IMAGE_CHUNK_SIZE);
+        }
+        segment.bytes.resize(held + size);
+        segment.size += size;
+        return segment.bytes.data() + held;
+    }
+
+    /// Drop the bytes of a segment past its first size, for code that was moved down within it.
+    void Truncate(uint32_t index, uint32_t size) {
+        ImageSegment& segment = segments[index];
+        segment.bytes.resize(segment.bytes.size() - (segment.size - size));
+        segment.size = size;
+    }
+
+    /// Return placed bytes, or a null pointer if they are not all held in one segment.
+    uint8_t* Data(uint32_t address, uint32_t size) {
+        uint32_t index = Find(address);
+        if (index == IMAGE_NO_SEGMENT)
+            return nullptr;
+        ImageSegment& segment = segments[index];
+        uint32_t first = End(segment) - segment.bytes.size();
+        if (address < first || size > End(segment) - address)
+            return nullptr;
+        return segment.bytes.data() + (address - first);
+    }
+
+    /// One past the highest placed address, the length of the image as a flat binary.
+    uint32_t End() const {
+        for (size_t i=segments.size(); i > 0; i--)
+            if (segments[i - 1].size > 0)
+                return End(segments[i - 1]);
+        return 0;
+    }
+
+    /// Number of bytes placed, gaps not included.
+    uint64_t Size() const {
+        uint64_t size = 0;
+        for (unsigned int i=0; i < segments.size(); i++)
+            size += segments[i].size;
+        return size;
+    }
+
+    /// Segments in address order, some may be empty.
+    uint32_t SegmentCount() const {return segments.size();}
+    const ImageSegment& Segment(uint32_t index) const {return segments[index];}
+
+    /// Return the image as End() flat bytes with the gaps zero filled.
+    /// An image placed in one run from address zero is returned as is, otherwise it is copied into the scratch buffer.
+    const uint8_t* Flat(std::vector<uint8_t>& scratch) const {
+        uint32_t end = End();
+        for (unsigned int i=0; i < segments.size(); i++) {
+            if (segments[i].base == 0 && segments[i].size == end && segments[i].bytes.size() == end)
+                return segments[i].bytes.data();
+        }
+
+        scratch.assign(end, 0);
+        for (unsigned int i=0; i < segments.size(); i++) {
+            const ImageSegment& segment = segments[i];
+            if (segment.bytes.size() > 0)
+                memcpy(&scratch[End(segment) - segment.bytes.size()], segment.bytes.data(), segment.bytes.size());
+        }
+        return scratch.data();
+    }
+
+private:
+
+    std::vector<ImageSegment> segments;     // Sorted by base, never overlapping
+    std::vector<uint8_t> spare;             // Buffer of a dropped segment, empty
+    uint32_t current;
+
+    static uint32_t End(const ImageSegment& segment) {return segment.base + segment.size;}
+
+    // First segment based above an address
+    uint32_t Above(uint32_t address) const {
+        uint32_t low = 0;
+        uint32_t high = segments.size();
+        while (low < high) {
+            uint32_t middle = (low + high) / 2;
+            if (segments[middle].base <= address)
+                low = middle + 1;
+            else
+                high = middle;
+        }
+        return low;
+    }
+
+    // Segment holding an address, the current one is tried first
+    uint32_t Find(uint32_t address) const {
+        if (current != IMAGE_NO_SEGMENT && address >= segments[current].base && address < End(segments[current]))
+            return current;
+        uint32_t index = Above(address);
+        if (index == 0 || address >= End(segments[index - 1]))
+            return IMAGE_NO_SEGMENT;
+        return index - 1;
+    }
+
+    // Address the segment may grow up to
+    uint32_t Limit(uint32_t index) const {
+        if (index + 1 < segments.size())
+            return segments[index + 1].base;
+        return MAX_PROGRAM_SIZE;
+    }
+
+};
+
+#endif
@@ -0,0 +1,211 @@
+#ifndef _INSTRUCTION_TABLE__
+#define _INSTRUCTION_TABLE__
+
+#include <array>
+#include <cstring>
+#include <string_view>
+
+#include "types.h"
+#include "registers.h"
+#include "opcodes.h"
+#include "assembler.h"
+
+// Error messages
+const std::string errorUnknownLabel = "Unknown label ";
+
+union Pointer {
+    uint32_t address;
+    uint8_t  byte_t[4];
+};
+
+struct Instruction;
+
+// Write the encoded instruction into the output, returns -1 on a fatal error
+// Label operands are left zero and recorded as fixups against the instruction address
+typedef int (*EncodeFunction)(x4::Assembler& assembler, const Instruction& instruction, const Statement& statement, unsigned int ln, uint32_t address, uint8_t* output);
+
+struct Instruction : Opcode {
+    EncodeFunction encode;
+};
+
+inline int EncodeOpcode(x4::Assembler& assembler, const Instruction& instruction, const Statement& statement, unsigned int ln, uint32_t address, uint8_t* output);
+inline int EncodeRegister(x4::Assembler& assembler, const Instruction& instruction, const Statement& statement, unsigned int ln, uint32_t address, uint8_t* output);
+inline int EncodeInterrupt(x4::Assembler& assembler, const Instruction& instruction, const Statement& statement, unsigned int ln, uint32_t address, uint8_t* output);
+inline int EncodeCompare(x4::Assembler& assembler, const Instruction& instruction, const Statement& statement, unsigned int ln, uint32_t address, uint8_t* output);
+inline int EncodeMove(x4::Assembler& assembler, const Instruction& instruction, const Statement& statement, unsigned int ln, uint32_t address, uint8_t* output);
+inline int EncodeBranch(x4::Assembler& assembler, const Instruction& instruction, const Statement& statement, unsigned int ln, uint32_t address, uint8_t* output);
+inline int EncodeString(x4::Assembler& assembler, const Instruction& instruction, const Statement& statement, unsigned int ln, uint32_t address, uint8_t* output);
+
+// Encoder of every operand form, by OPERAND_
+constexpr EncodeFunction operandEncoders[] = {
+    EncodeOpcode, EncodeRegister, EncodeInterrupt, EncodeCompare, EncodeMove, EncodeBranch, EncodeString,
+};
+
+constexpr std::array<Instruction, opcodeCount> BuildInstructionTable() {
+    std::array<Instruction, opcodeCount> table = {};
+    for (uint32_t i=0; i < opcodeCount; i++) 
+        table[i] = {opcodeTable[i], operandEncoders[opcodeTable[i].operands]};
+    return table;
+}
+
+constexpr std::array<Instruction, opcodeCount> instructionTable = BuildInstructionTable();
+
+// Return the instruction for a mnemonic or a null pointer
+constexpr const Instruction* FindInstruction(std::string_view mnemonic) {
+    uint32_t index = FindOpcode(mnemonic);
+    return (index == OPCODE_NOT_FOUND) ? nullptr : &instructionTable[index];
+}
+
+// Parse a literal operand of the given bit width, a bad literal is reported as an error
+inline int ParseOperandLiteral(x4::Assembler& assembler, std::string_view text, unsigned int bits, int errorLine, uint32_t& value) {
+    int result = ParseLiteral(text, bits, value);
+    if (result == LITERAL_OK)
+        return 0;
+    assembler.ThrowError(errorLine, std::string(LiteralErrorString(result)) + " " + std::string(text));
+    return -1;
+}
+
+// Encoders
+//
+
+// Opcode only, any operand bytes are left zero
+inline int EncodeOpcode(x4::Assembler& /*assembler*/, const Instruction& instruction, const Statement& /*statement*/, unsigned int /*ln*/, uint32_t /*address*/, uint8_t* output) {
+    output[0] = instruction.opcode;
+
+    // Operand bytes are not encoded yet and stay zero
+    if (instruction.size > 1)
+        memset(output + 1, 0, instruction.size - 1);
+    return 0;
+}
+
+// PUSH / POP
+inline int EncodeRegister(x4::Assembler& assembler, const Instruction& instruction, const Statement& statement, unsigned int ln, uint32_t /*address*/, uint8_t* output) {
+    if (statement.tokenCount < 2) {assembler.ThrowError(ln, "Missing parameter"); return -1;}
+
+    output[0] = instruction.opcode;
+    uint8_t regTypeA = get_register_code(statement.token[1]);
+    if (regTypeA == 0xff) {assembler.ThrowError(ln, "Unknown register"); return -1;}
+    output[1] = regTypeA;
+    return 0;
+}
+
+// INT
+inline int EncodeInterrupt(x4::Assembler& assembler, const Instruction& instruction, const Statement& statement, unsigned int ln, uint32_t /*address*/, uint8_t* output) {
+    if (OperandCount(statement) < 1) {assembler.ThrowError(ln, "Missing parameter"); return -1;}
+
+    output[0] = instruction.opcode;
+
+    // Parameter is a byte
+    uint32_t value;
+    if (ParseOperandLiteral(assembler, GetOperand(statement, 0), 8, ln, value) != 0) return -1;
+    output[1] = value;
+    return 0;
+}
+
+// CMP / CMPR
+inline int EncodeCompare(x4::Assembler& assembler, const Instruction& /*instruction*/, const Statement& statement, unsigned int ln, uint32_t /*address*/, uint8_t* output) {
+    if (OperandCount(statement) < 2) {assembler.ThrowError(ln, "Missing parameter"); return -1;}
+
+    output[0] = CMP_OPCODE;
+    std::string_view paramA = GetOperand(statement, 0);
+    std::string_view paramB = GetOperand(statement, 1);
+
+    // Check first register
+    uint8_t regTypeA = get_register_code(paramA);
+    if (regTypeA == 0xff) {assembler.ThrowError(ln, "Unknown register"); return -1;}
+    output[1] = regTypeA;
+
+    // Check second register
+    uint8_t regTypeB = get_register_code(paramB);
+    if (regTypeB == 0xff) {
+        uint32_t value;
+        if (ParseOperandLiteral(assembler, paramB, 8, ln, value) != 0) return -1;
+        output[2] = value;
+    } else {
+        output[2] = regTypeB;     // Should be a register
+        output[0] = CMPR_OPCODE;  // Correct the opcode
+    }
+    return 0;
+}
+
+// MOVB / MOVR - Move a byte or a register
+// MOVA - Move a label address into a 16-bit register
+inline int EncodeMove(x4::Assembler& assembler, const Instruction& /*instruction*/, const Statement& statement, unsigned int ln, uint32_t address, uint8_t* output) {
+    if (OperandCount(statement) < 2) {assembler.ThrowError(ln, "Missing parameter"); return -1;}
+
+    std::string_view paramA = GetOperand(statement, 0);
+    std::string_view paramB = GetOperand(statement, 1);
+
+    // Check memory move operation
+    if (OperandContains(statement, '[') &&
+        OperandContains(statement, ']')) {
+
+        // Not encoded yet, the instruction is left zeroed
+        memset(output, 0, 6);
+
+        return 0;
+    }
+
+    // Check 8-bit register
+    uint8_t regTypeA = get_register_code(paramA);
+    if (regTypeA != 0xff) {
+        output[0] = MOVB_OPCODE;
+        output[1] = regTypeA;
+
+        // Check second register
+        uint8_t regTypeB = get_register_code(paramB);
+        if (regTypeB == 0xff) {
+            uint32_t value;
+            if (ParseOperandLiteral(assembler, paramB, 8, ln, value) != 0) return -1;
+            output[2] = value;
+        } else {
+            output[2] = regTypeB;     // Should be a register
+            output[0] = MOVR_OPCODE;  // Correct the opcode
+        }
+        return 0;
+    }
+
+    // Check full 16-bit register
+    regTypeA = get_register_code16(paramA);
+    if (regTypeA != 0xff) {
+        output[0] = MOVA_OPCODE;
+        output[1] = regTypeA;
+
+        // The address of a label is written $label
+        if (paramB.empty() || paramB[0] != '$') {assembler.ThrowError(ln, errorUnknownLabel + std::string(paramB)); return -1;}
+        paramB.remove_prefix(1); // Remove the $ symbol
+
+        // The label address is patched in once all labels are known
+        assembler.AddFixup(address + 2, paramB, ln, FIXUP_ADDRESS);
+        return 0;
+    }
+
+    assembler.ThrowError(ln, "Unknown register");
+    return -1;
+}
+
+// JMP / JE / JNE / JG / JL / CALL
+inline int EncodeBranch(x4::Assembler& assembler, const Instruction& instruction, const Statement& statement, unsigned int ln, uint32_t address, uint8_t* output) {
+    if (statement.tokenCount < 2) {assembler.ThrowError(ln, "Missing parameter"); return -1;}
+
+    output[0] = instruction.opcode;
+
+    // The label address is patched in once all labels are known
+    assembler.AddFixup(address + 1, statement.token[1], ln, FIXUP_BRANCH);
+    return 0;
+}
+
+// DB
+inline int EncodeString(x4::Assembler& assembler, const Instruction& /*instruction*/, const Statement& statement, unsigned int ln, uint32_t /*address*/, uint8_t* output) {
+    if (!statement.hasString) {assembler.ThrowError(ln, "Missing string"); return -1;}
+
+    size_t length = statement.string.length();
+    memcpy(output, statement.string.data(), length);
+
+    // Null terminator
+    if (StringTerminated(statement))
+        output[length] = 0x00;
+    return 0;
+}
+
+#endif
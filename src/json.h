@@ -0,0 +1,362 @@
+#ifndef _JSON_VALUE__
+#define _JSON_VALUE__
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+// Value kinds
+#define JSON_NULL     0
+#define JSON_BOOL     1
+#define JSON_NUMBER   2
+#define JSON_STRING   3
+#define JSON_ARRAY    4
+#define JSON_OBJECT   5
+
+// Deepest nesting the parser accepts
+#define JSON_MAX_DEPTH  256
+
+
+// JSON value, just enough for the messages of a language server
+// Object members keep their order and are found by a linear search, messages have few of them.
+class JsonValue {
+
+public:
+
+    JsonValue() : kind(JSON_NULL), boolean(false), number(0) {}
+
+    static JsonValue Bool(bool value) {JsonValue json; json.kind = JSON_BOOL; json.boolean = value; return json;}
+    static JsonValue Number(double value) {JsonValue json; json.kind = JSON_NUMBER; json.number = value; return json;}
+    static JsonValue String(std::string value) {JsonValue json; json.kind = JSON_STRING; json.text = std::move(value); return json;}
+    static JsonValue Array() {JsonValue json; json.kind = JSON_ARRAY; return json;}
+    static JsonValue Object() {JsonValue json; json.kind = JSON_OBJECT; return json;}
+
+    uint32_t Kind() const {return kind;}
+    bool IsNull() const {return kind == JSON_NULL;}
+
+    bool AsBool() const {return kind == JSON_BOOL && boolean;}
+    double AsNumber() const {return kind == JSON_NUMBER ? number : 0;}
+    int64_t AsInteger() const {return (int64_t)AsNumber();}
+    const std::string& AsString() const {return text;}
+
+    /// Number of array items or object members.
+    size_t Size() const {return kind == JSON_ARRAY ? items.size() : members.size();}
+
+    /// Array item, a null value if there is none.
+    const JsonValue& operator[](size_t index) const {
+        if (kind != JSON_ARRAY || index >= items.size())
+            return Null();
+        return items[index];
+    }
+
+    /// Object member, a null value if there is none.
+    const JsonValue& operator[](std::string_view key) const {
+        for (unsigned int i=0; i < members.size(); i++)
+            if (members[i].first == key)
+                return members[i].second;
+        return Null();
+    }
+
+    const JsonValue& operator[](const char* key) const {return (*this)[std::string_view(key)];}
+
+    bool Has(std::string_view key) const {return kind == JSON_OBJECT && !(*this)[key].IsNull();}
+
+    /// Add an object member, returns the object so members can be chained.
+    JsonValue& Set(std::string key, JsonValue value) {
+        members.emplace_back(std::move(key), std::move(value));
+        return *this;
+    }
+
+    /// Append an array item.
+    JsonValue& Push(JsonValue value) {
+        items.push_back(std::move(value));
+        return *this;
+    }
+
+    /// Parse a whole text as one value, returns -1 if it is not valid JSON.
+    static int Parse(std::string_view source, JsonValue& value) {
+        size_t position = 0;
+        if (ParseValue(source, position, 0, value) != 0)
+            return -1;
+        SkipSpace(source, position);
+        return (position == source.length()) ? 0 : -1;
+    }
+
+    /// Append the value as compact JSON.
+    void Write(std::string& output) const {
+        switch (kind) {
+            case JSON_NULL: output += "null"; break;
+            case JSON_BOOL: output += boolean ? "true" : "false"; break;
+            case JSON_NUMBER: WriteNumber(number, output); break;
+            case JSON_STRING: WriteString(text, output); break;
+            case JSON_ARRAY:
+                output += '[';
+                for (unsigned int i=0; i < items.size(); i++) {
+                    if (i > 0)
+                        output += ',';
+                    items[i].Write(output);
+                }
+                output += ']';
+                break;
+            case JSON_OBJECT:
+                output += '{';
+                for (unsigned int i=0; i < members.size(); i++) {
+                    if (i > 0)
+                        output += ',';
+                    WriteString(members[i].first, output);
+                    output += ':';
+                    members[i].second.Write(output);
+                }
+                output += '}';
+                break;
+        }
+    }
+
+    std::string Write() const {
+        std::string output;
+        Write(output);
+        return output;
+    }
+
+private:
+
+    uint32_t kind;
+    bool boolean;
+    double number;
+    std::string text;
+    std::vector<JsonValue> items;
+    std::vector<std::pair<std::string, JsonValue>> members;
+
+    static const JsonValue& Null() {
+        static const JsonValue null;
+        return null;
+    }
+
+    static void SkipSpace(std::string_view source, size_t& position) {
+        while (position < source.length() && (source[position] == ' ' || source[position] == '\t' || source[position] == '\n' || source[position] == '\r'))
+            position++;
+    }
+
+    static bool Literal(std::string_view source, size_t& position, std::string_view word) {
+        if (source.substr(position, word.length()) != word)
+            return false;
+        position += word.length();
+        return true;
+    }
+
+    static int ParseValue(std::string_view source, size_t& position, unsigned int depth, JsonValue& value) {
+        if (depth > JSON_MAX_DEPTH)
+            return -1;
+        SkipSpace(source, position);
+        if (position >= source.length())
+            return -1;
+
+        value = JsonValue();
+        char first = source[position];
+        if (first == '{') {
+            value.kind = JSON_OBJECT;
+            position++;
+            SkipSpace(source, position);
+            if (position < source.length() && source[position] == '}') {
+                position++;
+                return 0;
+            }
+            while (true) {
+                std::string key;
+                SkipSpace(source, position);
+                if (ParseString(source, position, key) != 0)
+                    return -1;
+                SkipSpace(source, position);
+                if (position >= source.length() || source[position] != ':')
+                    return -1;
+                position++;
+                value.members.emplace_back(std::move(key), JsonValue());
+                if (ParseValue(source, position, depth + 1, value.members.back().second) != 0)
+                    return -1;
+                SkipSpace(source, position);
+                if (position >= source.length())
+                    return -1;
+                if (source[position++] == '}')
+                    return 0;
+                if (source[position - 1] != ',')
+                    return -1;
+            }
+        }
+        if (first == '[') {
+            value.kind = JSON_ARRAY;
+            position++;
+            SkipSpace(source, position);
+            if (position < source.length() && source[position] == ']') {
+                position++;
+                return 0;
+            }
+            while (true) {
+                value.items.emplace_back();
+                if (ParseValue(source, position, depth + 1, value.items.back()) != 0)
+                    return -1;
+                SkipSpace(source, position);
+                if (position >= source.length())
+                    return -1;
+                if (source[position++] == ']')
+                    return 0;
+                if (source[position - 1] != ',')
+                    return -1;
+            }
+        }
+        if (first == '"') {
+            value.kind = JSON_STRING;
+            return ParseString(source, position, value.text);
+        }
+        if (Literal(source, position, "true")) {
+            value = Bool(true);
+            return 0;
+        }
+        if (Literal(source, position, "false")) {
+            value = Bool(false);
+            return 0;
+        }
+        if (Literal(source, position, "null"))
+            return 0;
+
+        // strtod needs a terminated copy, numbers are short
+        size_t end = position;
+        while (end < source.length() && strchr("+-0123456789.eE", source[end]) != nullptr)
+            end++;
+        if (end == position)
+            return -1;
+        std::string digits(source.substr(position, end - position));
+        char* stop;
+        value.kind = JSON_NUMBER;
+        value.number = strtod(digits.c_str(), &stop);
+        if (*stop != '\0')
+            return -1;
+        position = end;
+        return 0;
+    }
+
+    static int HexDigits(std::string_view source, size_t position, uint32_t& code) {
+        if (position + 4 > source.length())
+            return -1;
+        code = 0;
+        for (size_t i=position; i < position + 4; i++) {
+            char ch = source[i];
+            uint32_t digit;
+            if (ch >= '0' && ch <= '9') digit = ch - '0';
+            else if (ch >= 'a' && ch <= 'f') digit = ch - 'a' + 10;
+            else if (ch >= 'A' && ch <= 'F') digit = ch - 'A' + 10;
+            else return -1;
+            code = code * 16 + digit;
+        }
+        return 0;
+    }
+
+    static void PutUtf8(uint32_t code, std::string& output) {
+        if (code < 0x80) {
+            output += (char)code;
+        } else if (code < 0x800) {
+            output += (char)(0xC0 | (code >> 6));
+            output += (char)(0x80 | (code & 0x3F));
+        } else if (code < 0x10000) {
+            output += (char)(0xE0 | (code >> 12));
+            output += (char)(0x80 | ((code >> 6) & 0x3F));
+            output += (char)(0x80 | (code & 0x3F));
+        } else {
+            output += (char)(0xF0 | (code >> 18));
+            output += (char)(0x80 | ((code >> 12) & 0x3F));
+            output += (char)(0x80 | ((code >> 6) & 0x3F));
+            output += (char)(0x80 | (code & 0x3F));
+        }
+    }
+
+    static int ParseString(std::string_view source, size_t& position, std::string& output) {
+        if (position >= source.length() || source[position] != '"')
+            return -1;
+        position++;
+        output.clear();
+        while (position < source.length()) {
+            // Copy the run up to the next quote or escape at once, document texts are long
+            size_t run = position;
+            while (run < source.length() && source[run] != '"' && source[run] != '\\')
+                run++;
+            output.append(source.data() + position, run - position);
+            position = run;
+            if (position >= source.length())
+                return -1;
+            if (source[position] == '"') {
+                position++;
+                return 0;
+            }
+
+            position++;
+            if (position >= source.length())
+                return -1;
+            char escape = source[position++];
+            switch (escape) {
+                case '"': output += '"'; break;
+                case '\\': output += '\\'; break;
+                case '/': output += '/'; break;
+                case 'b': output += '\b'; break;
+                case 'f': output += '\f'; break;
+                case 'n': output += '\n'; break;
+                case 'r': output += '\r'; break;
+                case 't': output += '\t'; break;
+                case 'u': {
+                    uint32_t code;
+                    if (HexDigits(source, position, code) != 0)
+                        return -1;
+                    position += 4;
+                    // A surrogate pair is one character
+                    uint32_t low;
+                    if (code >= 0xD800 && code < 0xDC00 && source.substr(position, 2) == "\\u" &&
+                        HexDigits(source, position + 2, low) == 0 && low >= 0xDC00 && low < 0xE000) {
+                        code = 0x10000 + ((code - 0xD800) << 10) + (low - 0xDC00);
+                        position += 6;
+                    }
+                    PutUtf8(code, output);
+                    break;
+                }
+                default: return -1;
+            }
+        }
+        return -1;
+    }
+
+    static void WriteNumber(double value, std::string& output) {
+        char digits[32];
+        if (value == (double)(int64_t)value)
+            snprintf(digits, sizeof(digits), "%lld", (long long)value);
+        else
+            snprintf(digits, sizeof(digits), "%.17g", value);
+        output += digits;
+    }
+
+    static void WriteString(const std::string& value, std::string& output) {
+        output += '"';
+        for (unsigned char ch : value) {
+            switch (ch) {
+                case '"': output += "\\\""; break;
+                case '\\': output += "\\\\"; break;
+                case '\n': output += "\\n"; break;
+                case '\r': output += "\\r"; break;
+                case '\t': output += "\\t"; break;
+                default:
+                    if (ch < 0x20) {
+                        char escape[8];
+                        snprintf(escape, sizeof(escape), "\\u%04x", ch);
+                        output += escape;
+                    } else {
+                        output += (char)ch;
+                    }
+            }
+        }
+        output += '"';
+    }
+
+};
+
+#endif
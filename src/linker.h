@@ -0,0 +1,109 @@
+#ifndef _OBJECT_LINKER__
+#define _OBJECT_LINKER__
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "arena.h"
+#include "symbols.h"
+#include "image.h"
+#include "object.h"
+
+struct LinkResult {
+    Image image;
+    std::vector<std::string> errors;
+};
+
+
+/// Link objects into one image, names are only used in the error messages.
+/// Relocatable sections are placed back to back from address zero in the order given,
+/// absolute sections at their own base. Returns -1 if the objects could not be linked.
+inline int Link(const std::vector<ObjectFile>& objects, const std::vector<std::string>& names, LinkResult& result) {
+    result.image.clear();
+    result.errors.clear();
+
+    // Place every section, the bytes are copied as they are
+    std::vector<std::vector<uint32_t>> sectionBase(objects.size());
+    uint64_t cursor = 0;
+    for (unsigned int o=0; o < objects.size(); o++) {
+        const ObjectFile& object = objects[o];
+        sectionBase[o].resize(object.sections.size());
+
+        for (unsigned int s=0; s < object.sections.size(); s++) {
+            const ObjectSection& section = object.sections[s];
+            bool relocatable = (section.flags & SECTION_RELOCATABLE) != 0;
+            uint64_t base = relocatable ? cursor : section.base;
+            sectionBase[o][s] = (uint32_t)base;
+            if (relocatable)
+                cursor += section.bytes.size();
+            if (section.bytes.size() == 0)
+                continue;
+
+            uint8_t* output = nullptr;
+            if (base < MAX_PROGRAM_SIZE && result.image.Origin((uint32_t)base) == 0)
+                output = result.image.Append(section.bytes.size());
+            if (output == nullptr) {
+                result.errors.push_back("Section " + std::to_string(s) + " of " + names[o] + " overlaps another section or is out of range");
+                continue;
+            }
+            memcpy(output, section.bytes.data(), section.bytes.size());
+        }
+    }
+    if (result.errors.size() > 0)
+        return -1;
+
+    // Exported symbols of every object in one hashed table
+    Arena arena;
+    SymbolTable globals(&arena);
+    for (unsigned int o=0; o < objects.size(); o++) {
+        const ObjectFile& object = objects[o];
+        for (unsigned int i=0; i < object.exports.size(); i++) {
+            const ObjectSymbol& symbol = object.exports[i];
+            uint32_t address = symbol.value;
+            if (symbol.section != SECTION_ABSOLUTE)
+                address += sectionBase[o][symbol.section];
+            if (globals.Insert(symbol.name, address) == SYMBOL_NOT_FOUND)
+                result.errors.push_back("Duplicate symbol " + symbol.name + " in " + names[o]);
+        }
+    }
+
+    // Resolve the imports of an object once, then patch its fields
+    std::vector<uint32_t> importAddress;
+    for (unsigned int o=0; o < objects.size(); o++) {
+        const ObjectFile& object = objects[o];
+
+        importAddress.resize(object.imports.size());
+        for (unsigned int i=0; i < object.imports.size(); i++) {
+            uint32_t index = globals.Find(object.imports[i]);
+            if (index == SYMBOL_NOT_FOUND || !globals[index].defined) {
+                result.errors.push_back("Undefined symbol " + object.imports[i] + " in " + names[o]);
+                importAddress[i] = 0;
+                continue;
+            }
+            importAddress[i] = globals[index].byteOffset;
+        }
+
+        for (unsigned int i=0; i < object.relocations.size(); i++) {
+            const ObjectRelocation& relocation = object.relocations[i];
+            uint8_t* field = result.image.Data(sectionBase[o][relocation.section] + relocation.offset, 4);
+
+            uint32_t value;
+            memcpy(&value, field, 4);
+            if (relocation.kind == RELOCATION_SECTION)
+                value += sectionBase[o][relocation.target];
+            else
+                value = importAddress[relocation.target];
+            memcpy(field, &value, 4);
+        }
+    }
+
+    globals.clear();
+
+    if (result.errors.size() > 0)
+        return -1;
+    return 0;
+}
+
+#endif
@@ -0,0 +1,997 @@
+#ifndef _LANGUAGE_SERVER__
+#define _LANGUAGE_SERVER__
+
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <iterator>
+#include <map>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "arena.h"
+#include "assembler.h"
+#include "image.h"
+#include "json.h"
+#include "relax.h"
+#include "symbols.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+ #define LSP_POSIX
+ #include <poll.h>
+ #include <strings.h>
+ #include <unistd.h>
+#endif
+
+// JSON-RPC error codes
+#define LSP_PARSE_ERROR             -32700
+#define LSP_INVALID_REQUEST         -32600
+#define LSP_METHOD_NOT_FOUND        -32601
+#define LSP_SERVER_NOT_INITIALIZED  -32002
+
+// Diagnostic severities of the protocol
+#define LSP_SEVERITY_ERROR    1
+#define LSP_SEVERITY_WARNING  2
+
+
+// One line of an open document and what it assembled to
+struct DocumentLine {
+    std::string text;
+    x4::LineAssembly assembly;
+    std::vector<uint32_t> referenceNames;   // Name of every reference of the assembly
+};
+
+// What the layout needs of a line, kept apart from the lines so the layout reads little memory
+struct LineLayout {
+    uint32_t size;                  // Bytes the line places
+    uint32_t labelName;             // Name of the label defined on the line, SYMBOL_NOT_FOUND if there is none
+    uint8_t kind;
+    uint8_t flags;
+    bool textFound;                 // What the line was assembled with, it changes the meaning of "="
+    bool dirty;                     // Edited since it was last assembled
+};
+
+// Line layout flags
+#define LAYOUT_REFERENCES   0x01
+#define LAYOUT_DIAGNOSTICS  0x02
+
+// Names interned before the table is built again from the lines
+#define DOCUMENT_STALE_NAMES  4096
+
+// A diagnostic with the columns it covers
+struct DocumentDiagnostic {
+    uint32_t line;
+    uint32_t start;
+    uint32_t end;
+    int type;
+    std::string message;
+};
+
+// A label name in a document
+struct DocumentLocation {
+    uint32_t line;
+    uint32_t column;
+    uint32_t length;
+};
+
+
+// Source kept line by line the way the editor has it
+// An edit replaces a range of lines, and only those lines are assembled again. Every label name is
+// interned once and counts its definitions and references, the counts change only with the lines
+// assembled again. Update then lays the document out in one pass over the line layouts, and only looks
+// for duplicate or unknown labels while the counts say there are some. The checks and messages are
+// those of the assembler, but every error is reported rather than the first one. Columns are byte
+// offsets into the line. The layout is that of the long branches, the branches are relaxed as the
+// assembler does only once an address is asked for, the diagnostics do not depend on their forms.
+class SourceDocument {
+
+public:
+
+    explicit SourceDocument(bool longBranches = false) : version(0), names(&nameArena), liveNames(0), unknownNames(0), duplicateNames(0),
+        diagnosticLines(0), variables(&variableArena), branchList{}, relaxed(false), longBranches(longBranches), changed(true) {}
+
+    SourceDocument(const SourceDocument&) = delete;
+    SourceDocument& operator=(const SourceDocument&) = delete;
+
+    /// Replace the whole text.
+    void Open(std::string_view text) {
+        std::vector<std::string> split = SplitLines(text);
+        Replace(0, lines.size(), split);
+    }
+
+    /// Replace the text from one position to another, positions past the end of a line or the
+    /// document are taken to be its end.
+    void Change(uint32_t startLine, uint32_t startColumn, uint32_t endLine, uint32_t endColumn, std::string_view text) {
+        if (startLine >= lines.size()) {
+            startLine = lines.size() - 1;
+            startColumn = lines[startLine]->text.length();
+        }
+        if (endLine >= lines.size()) {
+            endLine = lines.size() - 1;
+            endColumn = lines[endLine]->text.length();
+        }
+        if (endLine < startLine || (endLine == startLine && endColumn < startColumn)) {
+            std::swap(startLine, endLine);
+            std::swap(startColumn, endColumn);
+        }
+
+        const std::string& first = lines[startLine]->text;
+        const std::string& last = lines[endLine]->text;
+        std::string joined = first.substr(0, std::min<size_t>(startColumn, first.length()));
+        joined.append(text.data(), text.length());
+        joined.append(last, std::min<size_t>(endColumn, last.length()), std::string::npos);
+        std::vector<std::string> split = SplitLines(joined);
+        Replace(startLine, endLine - startLine + 1, split);
+    }
+
+    /// Assemble the edited lines and lay the document out again, nothing is done if it has not changed.
+    void Update(x4::Assembler& assembler) {
+        if (!changed)
+            return;
+        changed = false;
+
+        bool textFound = false;
+        bool placed = false;
+        for (uint32_t i=0; i < layouts.size(); i++) {
+            LineLayout& layout = layouts[i];
+            if (layout.dirty || layout.textFound != textFound) {
+                Uncount(i);
+                assembler.AssembleLine(lines[i]->text, textFound, lines[i]->assembly);
+                layout.textFound = textFound;
+                layout.dirty = false;
+                Count(i);
+            }
+            if (layout.kind == LINE_SECTION && lines[i]->assembly.name == ".text")
+                textFound = true;
+            if (layout.kind == LINE_ORG)
+                placed = true;
+        }
+
+        if (names.size() > liveNames * 2 + DOCUMENT_STALE_NAMES)
+            Intern();
+        Layout(textFound, placed);
+    }
+
+    const std::vector<DocumentDiagnostic>& Diagnostics() const {return diagnostics;}
+
+    uint32_t LineCount() const {return lines.size();}
+    const DocumentLine& Line(uint32_t line) const {return *lines[line];}
+
+    /// Address of the first byte of a line, or of the next one if the line has none.
+    uint32_t Address(uint32_t line) const {
+        Relax();
+        return RelaxedAddress(branchList, addresses[line]);
+    }
+
+    /// The label name at a position, empty if there is none.
+    std::string_view LabelAt(uint32_t line, uint32_t column) const {
+        if (line >= lines.size())
+            return std::string_view();
+        std::string_view text = lines[line]->text;
+        if (column > text.length())
+            return std::string_view();
+
+        size_t start = column;
+        while (start > 0 && IsNameCharacter(text[start - 1]))
+            start--;
+        size_t end = column;
+        while (end < text.length() && IsNameCharacter(text[end]))
+            end++;
+        std::string_view name = text.substr(start, end - start);
+
+        const x4::LineAssembly& assembly = lines[line]->assembly;
+        if (!assembly.label.empty() && start == assembly.labelColumn)
+            return name;
+        for (unsigned int i=0; i < assembly.references.size(); i++)
+            if (assembly.references[i].column == start && SymbolEquals(name, assembly.references[i].label))
+                return name;
+        return std::string_view();
+    }
+
+    /// Where a label is defined, the first definition if there are several. Returns -1 if it is not defined.
+    int Definition(std::string_view name, DocumentLocation& location) const {
+        uint32_t line = DefinitionLine(name);
+        if (line == SYMBOL_NOT_FOUND)
+            return -1;
+        const x4::LineAssembly& assembly = lines[line]->assembly;
+        location = {line, assembly.labelColumn, (uint32_t)assembly.label.length()};
+        return 0;
+    }
+
+    /// Every address field naming a label, in line order.
+    std::vector<DocumentLocation> References(std::string_view name) const {
+        std::vector<DocumentLocation> found;
+        uint32_t index = names.Find(name);
+        if (index == SYMBOL_NOT_FOUND)
+            return found;
+        for (uint32_t i=0; i < lines.size(); i++) {
+            if ((layouts[i].flags & LAYOUT_REFERENCES) == 0)
+                continue;
+            const DocumentLine& line = *lines[i];
+            for (unsigned int r=0; r < line.referenceNames.size(); r++)
+                if (line.referenceNames[r] == index)
+                    found.push_back({i, line.assembly.references[r].column, (uint32_t)name.length()});
+        }
+        return found;
+    }
+
+    /// Address of a label, returns -1 if it is not defined.
+    int LabelAddress(std::string_view name, uint32_t& address) const {
+        uint32_t line = DefinitionLine(name);
+        if (line == SYMBOL_NOT_FOUND)
+            return -1;
+        address = Address(line);
+        return 0;
+    }
+
+    /// Bytes of a line as they are in the image, with the label addresses patched in and every branch
+    /// in the form it was given.
+    std::vector<uint8_t> Bytes(uint32_t line) const {
+        const x4::LineAssembly& assembly = lines[line]->assembly;
+        std::vector<uint8_t> bytes = assembly.bytes;
+        Relax();
+        // Fields are patched from the last, a branch that shrinks moves the bytes after it
+        for (unsigned int i=assembly.references.size(); i-- > 0;) {
+            const x4::LineReference& reference = assembly.references[i];
+            uint32_t address;
+            if (LabelAddress(reference.label, address) != 0 || reference.offset + 4 > bytes.size())
+                continue;
+            uint32_t below = BranchesBelow(branchList, addresses[line] + reference.offset);
+            if (reference.kind == FIXUP_BRANCH && below > 0 && branchList.branches[below - 1].address == addresses[line] + reference.offset - 1) {
+                const Branch& branch = branchList.branches[below - 1];
+                uint32_t length = BranchSize(branch.form);
+                if (branch.form != BRANCH_LONG)
+                    address -= RelaxedAddress(branchList, branch.address) + length;
+                bytes[reference.offset - 1] = BranchOpcode(bytes[reference.offset - 1], branch.form);
+                for (uint32_t a=0; a < length - 1; a++)
+                    bytes[reference.offset + a] = (uint8_t)(address >> (8 * a));
+                bytes.erase(bytes.begin() + reference.offset + length - 1, bytes.begin() + reference.offset + 4);
+                continue;
+            }
+            for (uint32_t a=0; a < 4; a++)
+                bytes[reference.offset + a] = (uint8_t)(address >> (8 * a));
+        }
+        return bytes;
+    }
+
+    std::string uri;
+    int64_t version;
+
+private:
+
+    struct NameCount {
+        uint32_t definitions;
+        uint32_t references;
+    };
+
+    // The lines are held by pointer, an edit that adds or drops lines only moves the pointers below it
+    std::vector<std::unique_ptr<DocumentLine>> lines;
+    std::vector<LineLayout> layouts;
+    std::vector<uint32_t> addresses;
+    std::vector<DocumentDiagnostic> diagnostics;
+
+    // Every label name defined or referenced, by symbol index. Names no line uses any more stay
+    // until the table is built again.
+    Arena nameArena;
+    SymbolTable names;
+    std::vector<NameCount> counts;
+    uint32_t liveNames;                 // Names some line uses
+    uint32_t unknownNames;              // Names referenced and not defined
+    uint32_t duplicateNames;            // Names defined more than once
+    uint32_t diagnosticLines;           // Lines with diagnostics of their own
+
+    // Variables are few and only before the text section, they are checked by every layout
+    Arena variableArena;
+    SymbolTable variables;
+
+    // Branches of the layout with the forms they were given, none if every branch is kept long.
+    // They are relaxed again by the first query after a layout.
+    std::vector<uint32_t> bases;
+    mutable std::vector<Branch> branches;
+    mutable std::vector<uint32_t> definitions;  // Address of the first definition of every name
+    mutable BranchList branchList;
+    mutable bool relaxed;
+    bool longBranches;
+
+    bool changed;
+
+    static bool IsNameCharacter(char ch) {
+        return isalnum((uint8_t)ch) || ch == '_' || ch == '.';
+    }
+
+    static std::vector<std::string> SplitLines(std::string_view text) {
+        std::vector<std::string> split;
+        size_t start = 0;
+        while (true) {
+            size_t end = text.find('\n', start);
+            if (end == std::string_view::npos) {
+                split.emplace_back(text.substr(start));
+                return split;
+            }
+            split.emplace_back(text.substr(start, end - start));
+            start = end + 1;
+        }
+    }
+
+    // Replace lines [first, first + removed) with new ones, the lines kept in place are reused
+    void Replace(uint32_t first, uint32_t removed, std::vector<std::string>& split) {
+        uint32_t added = split.size();
+        if (added > removed) {
+            std::vector<std::unique_ptr<DocumentLine>> fresh(added - removed);
+            for (unsigned int i=0; i < fresh.size(); i++)
+                fresh[i].reset(new DocumentLine());
+            lines.insert(lines.begin() + first + removed, std::make_move_iterator(fresh.begin()), std::make_move_iterator(fresh.end()));
+            LineLayout empty = {0, SYMBOL_NOT_FOUND, LINE_EMPTY, 0, false, true};
+            layouts.insert(layouts.begin() + first + removed, added - removed, empty);
+        } else if (added < removed) {
+            for (uint32_t i=first + added; i < first + removed; i++)
+                Uncount(i);
+            lines.erase(lines.begin() + first + added, lines.begin() + first + removed);
+            layouts.erase(layouts.begin() + first + added, layouts.begin() + first + removed);
+        }
+        for (uint32_t i=0; i < added; i++) {
+            lines[first + i]->text.swap(split[i]);
+            layouts[first + i].dirty = true;
+        }
+        changed = true;
+    }
+
+    void CountName(uint32_t name, int definitions, int references) {
+        NameCount& count = counts[name];
+        bool live = count.definitions + count.references > 0;
+        unknownNames -= (count.references > 0 && count.definitions == 0);
+        duplicateNames -= (count.definitions > 1);
+        count.definitions += definitions;
+        count.references += references;
+        liveNames += (count.definitions + count.references > 0) - live;
+        unknownNames += (count.references > 0 && count.definitions == 0);
+        duplicateNames += (count.definitions > 1);
+    }
+
+    uint32_t Intern(std::string_view name) {
+        uint32_t index = names.Reference(name);
+        if (index == counts.size())
+            counts.push_back({0, 0});
+        return index;
+    }
+
+    // Take the assembly of a line into the layout and the name counts
+    void Count(uint32_t i) {
+        DocumentLine& line = *lines[i];
+        const x4::LineAssembly& assembly = line.assembly;
+        LineLayout& layout = layouts[i];
+        layout.size = assembly.bytes.size();
+        layout.kind = assembly.kind;
+        layout.flags = (assembly.references.empty() ? 0 : LAYOUT_REFERENCES) | (assembly.diagnostics.empty() ? 0 : LAYOUT_DIAGNOSTICS);
+        diagnosticLines += !assembly.diagnostics.empty();
+
+        layout.labelName = SYMBOL_NOT_FOUND;
+        if (!assembly.label.empty()) {
+            layout.labelName = Intern(assembly.label);
+            CountName(layout.labelName, 1, 0);
+        }
+        line.referenceNames.resize(assembly.references.size());
+        for (unsigned int r=0; r < assembly.references.size(); r++) {
+            line.referenceNames[r] = Intern(assembly.references[r].label);
+            CountName(line.referenceNames[r], 0, 1);
+        }
+    }
+
+    // Take a line out of the name counts before it is assembled again or dropped
+    void Uncount(uint32_t i) {
+        const DocumentLine& line = *lines[i];
+        const LineLayout& layout = layouts[i];
+        diagnosticLines -= (layout.flags & LAYOUT_DIAGNOSTICS) != 0;
+        if (layout.labelName != SYMBOL_NOT_FOUND)
+            CountName(layout.labelName, -1, 0);
+        for (unsigned int r=0; r < line.referenceNames.size(); r++)
+            CountName(line.referenceNames[r], 0, -1);
+        layouts[i].flags = 0;
+        layouts[i].labelName = SYMBOL_NOT_FOUND;
+        lines[i]->referenceNames.clear();
+    }
+
+    // Build the name table again from the lines, dropping the names no line uses
+    void Intern() {
+        names.clear();
+        nameArena.Reset();
+        counts.clear();
+        liveNames = unknownNames = duplicateNames = 0;
+        for (uint32_t i=0; i < lines.size(); i++) {
+            if (layouts[i].labelName == SYMBOL_NOT_FOUND && (layouts[i].flags & LAYOUT_REFERENCES) == 0)
+                continue;
+            diagnosticLines -= (layouts[i].flags & LAYOUT_DIAGNOSTICS) != 0;
+            Count(i);
+        }
+    }
+
+    uint32_t DefinitionLine(std::string_view name) const {
+        uint32_t index = names.Find(name);
+        if (index == SYMBOL_NOT_FOUND || counts[index].definitions == 0)
+            return SYMBOL_NOT_FOUND;
+        for (uint32_t i=0; i < layouts.size(); i++)
+            if (layouts[i].labelName == index)
+                return i;
+        return SYMBOL_NOT_FOUND;
+    }
+
+    void AddDiagnostic(uint32_t line, uint32_t start, uint32_t end, int type, std::string message) {
+        diagnostics.push_back({line, start, end, type, std::move(message)});
+    }
+
+    // The passes of BakeTheCake over the assembled lines. Without an ORG the code is one run from
+    // address zero, and the image is not needed to check that it fits.
+    void Layout(bool textFound, bool placed) {
+        variables.clear();
+        variableArena.Reset();
+        diagnostics.clear();
+        addresses.resize(lines.size());
+
+        Image image;
+        uint32_t address = 0;
+        bool overrun = false;               // Reported once until the next ORG
+        for (uint32_t i=0; i < layouts.size(); i++) {
+            const LineLayout& layout = layouts[i];
+            if ((layout.kind == LINE_VARIABLE || layout.kind == LINE_ORG) && (layout.flags & LAYOUT_DIAGNOSTICS) == 0)
+                LayoutLine(i, image, address, overrun);
+            addresses[i] = address;
+
+            if (layout.size == 0)
+                continue;
+            bool fits = placed ? (image.Append(layout.size) != nullptr) : (layout.size <= MAX_PROGRAM_SIZE - address);
+            if (!fits) {
+                if (!overrun)
+                    AddDiagnostic(i, 0, lines[i]->text.length(), DIAGNOSTIC_ERROR, "Program runs into code placed at a higher address or past the maximum size");
+                overrun = true;
+                continue;
+            }
+            address += layout.size;
+        }
+
+        for (uint32_t i=0; i < layouts.size() && diagnosticLines > 0; i++) {
+            if ((layouts[i].flags & LAYOUT_DIAGNOSTICS) == 0)
+                continue;
+            const std::vector<x4::Diagnostic>& own = lines[i]->assembly.diagnostics;
+            for (unsigned int d=0; d < own.size(); d++)
+                AddDiagnostic(i, 0, lines[i]->text.length(), own[d].type, own[d].message);
+        }
+
+        // Every definition after the first is a duplicate
+        if (duplicateNames > 0) {
+            std::vector<bool> defined(counts.size(), false);
+            for (uint32_t i=0; i < layouts.size(); i++) {
+                uint32_t name = layouts[i].labelName;
+                if (name == SYMBOL_NOT_FOUND)
+                    continue;
+                if (defined[name]) {
+                    const x4::LineAssembly& assembly = lines[i]->assembly;
+                    AddDiagnostic(i, assembly.labelColumn, assembly.labelColumn + assembly.label.length(), DIAGNOSTIC_ERROR, "Duplicate label " + assembly.label);
+                }
+                defined[name] = true;
+            }
+        }
+
+        if (unknownNames > 0) {
+            for (uint32_t i=0; i < layouts.size(); i++) {
+                if ((layouts[i].flags & LAYOUT_REFERENCES) == 0)
+                    continue;
+                const DocumentLine& line = *lines[i];
+                for (unsigned int r=0; r < line.referenceNames.size(); r++) {
+                    if (counts[line.referenceNames[r]].definitions > 0)
+                        continue;
+                    const x4::LineReference& reference = line.assembly.references[r];
+                    AddDiagnostic(i, reference.column, reference.column + reference.label.length(), DIAGNOSTIC_ERROR, "Unknown label " + reference.label);
+                }
+            }
+        }
+
+        if (!textFound) {
+            uint32_t last = lines.size() - 1;
+            AddDiagnostic(last, 0, lines[last]->text.length(), DIAGNOSTIC_ERROR, "'Section .text' not found");
+        }
+
+        std::stable_sort(diagnostics.begin(), diagnostics.end(), [](const DocumentDiagnostic& a, const DocumentDiagnostic& b) {return a.line < b.line;});
+
+        bases.clear();
+        for (uint32_t i=0; placed && i < image.SegmentCount(); i++)
+            bases.push_back(image.Segment(i).base);
+        if (bases.empty())
+            bases.push_back(0);
+        branches.clear();
+        branchList = {};
+        relaxed = longBranches;
+    }
+
+    // Choose the branch forms over the long layout, a branch to an undefined label stays long
+    void Relax() const {
+        if (relaxed)
+            return;
+        relaxed = true;
+
+        definitions.assign(counts.size(), SYMBOL_NOT_FOUND);
+        for (uint32_t i=0; i < layouts.size(); i++) {
+            uint32_t name = layouts[i].labelName;
+            if (name != SYMBOL_NOT_FOUND && definitions[name] == SYMBOL_NOT_FOUND)
+                definitions[name] = addresses[i];
+        }
+        for (uint32_t i=0; i < layouts.size(); i++) {
+            if ((layouts[i].flags & LAYOUT_REFERENCES) == 0)
+                continue;
+            const DocumentLine& line = *lines[i];
+            for (unsigned int r=0; r < line.referenceNames.size(); r++) {
+                if (line.assembly.references[r].kind != FIXUP_BRANCH)
+                    continue;
+                Branch branch = {};
+                branch.address = addresses[i] + line.assembly.references[r].offset - 1;
+                branch.target = definitions[line.referenceNames[r]];
+                branch.form = BRANCH_SHORT;
+                if (branch.target == SYMBOL_NOT_FOUND) {
+                    branch.target = branch.address;
+                    branch.form = BRANCH_LONG;
+                }
+                branches.push_back(branch);
+            }
+        }
+        if (!std::is_sorted(branches.begin(), branches.end(), [](const Branch& a, const Branch& b) {return a.address < b.address;}))
+            std::sort(branches.begin(), branches.end(), [](const Branch& a, const Branch& b) {return a.address < b.address;});
+
+        branchList = {branches.data(), (uint32_t)branches.size(), bases.data(), (uint32_t)bases.size()};
+        RelaxBranches(branchList);
+    }
+
+    // A variable or an origin, before the bytes of the line are placed
+    void LayoutLine(uint32_t i, Image& image, uint32_t& address, bool& overrun) {
+        const x4::LineAssembly& assembly = lines[i]->assembly;
+        uint32_t width = lines[i]->text.length();
+        if (assembly.kind == LINE_VARIABLE) {
+            if (variables.Insert(assembly.name, assembly.value) == SYMBOL_NOT_FOUND)
+                AddDiagnostic(i, 0, width, DIAGNOSTIC_ERROR, "Duplicate variable " + assembly.name);
+            return;
+        }
+        if (image.Origin(assembly.value) != 0) {
+            AddDiagnostic(i, 0, width, DIAGNOSTIC_ERROR, "Origin overlaps placed code or is out of range " + assembly.name);
+            // Carry on where the code was, as if the line were not there
+            image.Origin(address);
+            return;
+        }
+        address = assembly.value;
+        overrun = false;
+    }
+
+};
+
+
+// Language server over the standard input and output
+// Messages are read as they come, and the diagnostics of edited documents are published only once no
+// more input is waiting, so the edits of fast typing are assembled together.
+class LanguageServer {
+
+public:
+
+    explicit LanguageServer(bool longBranches = false) : consumed(0), initialized(false), shutdown(false), utf8(false), longBranches(longBranches) {}
+
+    LanguageServer(const LanguageServer&) = delete;
+    LanguageServer& operator=(const LanguageServer&) = delete;
+
+    /// True if the server can run on this platform.
+    static bool Supported() {
+#ifdef LSP_POSIX
+        return true;
+#else
+        return false;
+#endif
+    }
+
+    /// Serve until the client exits. Returns 0 if it asked to shut down first, -1 otherwise.
+    int Run() {
+#ifdef LSP_POSIX
+        std::string body;
+        while (true) {
+            if (!InputPending())
+                PublishChanged();
+            if (ReadMessage(body) != 0)
+                return -1;
+
+            JsonValue message;
+            if (JsonValue::Parse(body, message) != 0 || message.Kind() != JSON_OBJECT) {
+                SendError(JsonValue(), LSP_PARSE_ERROR, "Message is not a JSON object");
+                continue;
+            }
+            if (message["method"].AsString() == "exit")
+                return shutdown ? 0 : -1;
+            Handle(message);
+        }
+#else
+        return -1;
+#endif
+    }
+
+private:
+
+    std::map<std::string, std::unique_ptr<SourceDocument>> documents;
+    std::vector<std::string> changedUris;
+    x4::Assembler assembler;
+
+    std::string input;
+    size_t consumed;
+
+    bool initialized;
+    bool shutdown;
+    bool utf8;                      // Columns are counted in bytes rather than UTF-16 units
+    bool longBranches;              // Documents keep every branch long
+
+    void Handle(const JsonValue& message) {
+        const std::string& method = message["method"].AsString();
+        const JsonValue& id = message["id"];
+        const JsonValue& params = message["params"];
+        bool request = message.Has("id");
+
+        if (!initialized && method != "initialize") {
+            if (request)
+                SendError(id, LSP_SERVER_NOT_INITIALIZED, "Server not initialized");
+            return;
+        }
+        if (shutdown && request) {
+            SendError(id, LSP_INVALID_REQUEST, "Server is shutting down");
+            return;
+        }
+
+        if (method == "initialize") {
+            SendResult(id, Initialize(params));
+        } else if (method == "initialized") {
+        } else if (method == "shutdown") {
+            shutdown = true;
+            SendResult(id, JsonValue());
+        } else if (method == "textDocument/didOpen") {
+            const JsonValue& item = params["textDocument"];
+            std::unique_ptr<SourceDocument>& document = documents[item["uri"].AsString()];
+            document.reset(new SourceDocument(longBranches));
+            document->uri = item["uri"].AsString();
+            document->version = item["version"].AsInteger();
+            document->Open(item["text"].AsString());
+            MarkChanged(document->uri);
+        } else if (method == "textDocument/didChange") {
+            SourceDocument* document = FindDocument(params);
+            if (document == nullptr)
+                return;
+            document->version = params["textDocument"]["version"].AsInteger();
+            const JsonValue& changes = params["contentChanges"];
+            for (unsigned int i=0; i < changes.Size(); i++)
+                ApplyChange(*document, changes[i]);
+            MarkChanged(document->uri);
+        } else if (method == "textDocument/didClose") {
+            SourceDocument* document = FindDocument(params);
+            if (document == nullptr)
+                return;
+            std::string uri = document->uri;
+            documents.erase(uri);
+            Publish(uri, nullptr);
+        } else if (method == "textDocument/definition") {
+            SendResult(id, Definition(params));
+        } else if (method == "textDocument/references") {
+            SendResult(id, References(params));
+        } else if (method == "textDocument/hover") {
+            SendResult(id, Hover(params));
+        } else if (request) {
+            SendError(id, LSP_METHOD_NOT_FOUND, "Unknown method " + method);
+        }
+    }
+
+    JsonValue Initialize(const JsonValue& params) {
+        initialized = true;
+
+        // Byte columns spare converting every position, if the client can take them
+        const JsonValue& encodings = params["capabilities"]["general"]["positionEncodings"];
+        for (unsigned int i=0; i < encodings.Size(); i++)
+            if (encodings[i].AsString() == "utf-8")
+                utf8 = true;
+
+        JsonValue capabilities = JsonValue::Object();
+        capabilities.Set("positionEncoding", JsonValue::String(utf8 ? "utf-8" : "utf-16"));
+        capabilities.Set("textDocumentSync", JsonValue::Object().Set("openClose", JsonValue::Bool(true)).Set("change", JsonValue::Number(2)));
+        capabilities.Set("definitionProvider", JsonValue::Bool(true));
+        capabilities.Set("referencesProvider", JsonValue::Bool(true));
+        capabilities.Set("hoverProvider", JsonValue::Bool(true));
+
+        JsonValue result = JsonValue::Object();
+        result.Set("capabilities", std::move(capabilities));
+        result.Set("serverInfo", JsonValue::Object().Set("name", JsonValue::String("x4asm")).Set("version", JsonValue::String(std::to_string(ASSEMBLER_VERSION))));
+        return result;
+    }
+
+    SourceDocument* FindDocument(const JsonValue& params) {
+        auto found = documents.find(params["textDocument"]["uri"].AsString());
+        return (found == documents.end()) ? nullptr : found->second.get();
+    }
+
+    void MarkChanged(const std::string& uri) {
+        for (unsigned int i=0; i < changedUris.size(); i++)
+            if (changedUris[i] == uri)
+                return;
+        changedUris.push_back(uri);
+    }
+
+    void ApplyChange(SourceDocument& document, const JsonValue& change) {
+        const std::string& text = change["text"].AsString();
+        if (!change.Has("range")) {
+            document.Open(text);
+            return;
+        }
+        const JsonValue& start = change["range"]["start"];
+        const JsonValue& end = change["range"]["end"];
+        uint32_t startLine = start["line"].AsInteger();
+        uint32_t endLine = end["line"].AsInteger();
+        document.Change(startLine, ByteColumn(document, startLine, start["character"].AsInteger()),
+                        endLine, ByteColumn(document, endLine, end["character"].AsInteger()), text);
+    }
+
+    void PublishChanged() {
+        for (unsigned int i=0; i < changedUris.size(); i++) {
+            auto found = documents.find(changedUris[i]);
+            if (found == documents.end())
+                continue;
+            found->second->Update(assembler);
+            Publish(changedUris[i], found->second.get());
+        }
+        changedUris.clear();
+    }
+
+    // Diagnostics of a document, or none for a closed one
+    void Publish(const std::string& uri, const SourceDocument* document) {
+        JsonValue list = JsonValue::Array();
+        if (document != nullptr) {
+            const std::vector<DocumentDiagnostic>& diagnostics = document->Diagnostics();
+            for (unsigned int i=0; i < diagnostics.size(); i++) {
+                const DocumentDiagnostic& diagnostic = diagnostics[i];
+                JsonValue item = JsonValue::Object();
+                item.Set("range", Range(*document, diagnostic.line, diagnostic.start, diagnostic.end));
+                item.Set("severity", JsonValue::Number(diagnostic.type == DIAGNOSTIC_ERROR ? LSP_SEVERITY_ERROR : LSP_SEVERITY_WARNING));
+                item.Set("source", JsonValue::String("x4asm"));
+                item.Set("message", JsonValue::String(diagnostic.message));
+                list.Push(std::move(item));
+            }
+        }
+
+        JsonValue params = JsonValue::Object();
+        params.Set("uri", JsonValue::String(uri));
+        if (document != nullptr)
+            params.Set("version", JsonValue::Number(document->version));
+        params.Set("diagnostics", std::move(list));
+        SendNotification("textDocument/publishDiagnostics", std::move(params));
+    }
+
+    // The document of a request brought up to date, and the byte column of its position
+    SourceDocument* RequestDocument(const JsonValue& params, uint32_t& line, uint32_t& column) {
+        SourceDocument* document = FindDocument(params);
+        if (document == nullptr)
+            return nullptr;
+        document->Update(assembler);
+        line = params["position"]["line"].AsInteger();
+        if (line >= document->LineCount())
+            return nullptr;
+        column = ByteColumn(*document, line, params["position"]["character"].AsInteger());
+        return document;
+    }
+
+    JsonValue Definition(const JsonValue& params) {
+        uint32_t line, column;
+        SourceDocument* document = RequestDocument(params, line, column);
+        DocumentLocation location;
+        if (document == nullptr || document->Definition(document->LabelAt(line, column), location) != 0)
+            return JsonValue();
+        return Location(*document, location);
+    }
+
+    JsonValue References(const JsonValue& params) {
+        uint32_t line, column;
+        SourceDocument* document = RequestDocument(params, line, column);
+        if (document == nullptr)
+            return JsonValue();
+        std::string_view name = document->LabelAt(line, column);
+        if (name.empty())
+            return JsonValue();
+
+        JsonValue list = JsonValue::Array();
+        DocumentLocation definition;
+        if (params["context"]["includeDeclaration"].AsBool() && document->Definition(name, definition) == 0)
+            list.Push(Location(*document, definition));
+        std::vector<DocumentLocation> references = document->References(name);
+        for (unsigned int i=0; i < references.size(); i++)
+            list.Push(Location(*document, references[i]));
+        return list;
+    }
+
+    // Address and bytes of the line, and the address of a label under the cursor
+    JsonValue Hover(const JsonValue& params) {
+        uint32_t line, column;
+        SourceDocument* document = RequestDocument(params, line, column);
+        if (document == nullptr)
+            return JsonValue();
+
+        char text[64];
+        std::string value;
+        std::string_view name = document->LabelAt(line, column);
+        uint32_t address;
+        if (!name.empty() && document->LabelAddress(name, address) == 0) {
+            snprintf(text, sizeof(text), " = 0x%08X\n", address);
+            value += std::string(name) + text;
+        }
+
+        const DocumentLine& source = document->Line(line);
+        if (source.assembly.kind == LINE_CODE && !source.assembly.bytes.empty()) {
+            snprintf(text, sizeof(text), "0x%08X:", document->Address(line));
+            value += text;
+            std::vector<uint8_t> bytes = document->Bytes(line);
+            for (unsigned int i=0; i < bytes.size(); i++) {
+                snprintf(text, sizeof(text), " %02X", bytes[i]);
+                value += text;
+            }
+            value += '\n';
+        } else if (source.assembly.kind == LINE_VARIABLE && source.assembly.diagnostics.empty()) {
+            snprintf(text, sizeof(text), " = 0x%08X\n", source.assembly.value);
+            value += source.assembly.name + text;
+        }
+        if (value.empty())
+            return JsonValue();
+
+        JsonValue contents = JsonValue::Object();
+        contents.Set("kind", JsonValue::String("markdown"));
+        contents.Set("value", JsonValue::String("```\n" + value + "```"));
+        return JsonValue::Object().Set("contents", std::move(contents));
+    }
+
+    // Columns of the protocol are UTF-16 units unless the client took UTF-8
+    uint32_t ByteColumn(const SourceDocument& document, uint32_t line, uint32_t character) const {
+        if (line >= document.LineCount())
+            return character;
+        const std::string& text = document.Line(line).text;
+        if (utf8)
+            return std::min<size_t>(character, text.length());
+        uint32_t column = 0;
+        for (uint32_t units=0; column < text.length() && units < character;) {
+            uint8_t lead = text[column];
+            uint32_t length = (lead < 0x80) ? 1 : (lead >= 0xF0) ? 4 : (lead >= 0xE0) ? 3 : (lead >= 0xC0) ? 2 : 1;
+            units += (length == 4) ? 2 : 1;
+            column += length;
+        }
+        return std::min<size_t>(column, text.length());
+    }
+
+    uint32_t Character(const SourceDocument& document, uint32_t line, uint32_t column) const {
+        const std::string& text = document.Line(line).text;
+        if (utf8)
+            return column;
+        uint32_t units = 0;
+        for (uint32_t i=0; i < column && i < text.length(); i++) {
+            uint8_t byte = text[i];
+            if ((byte & 0xC0) != 0x80)
+                units += (byte >= 0xF0) ? 2 : 1;
+        }
+        return units;
+    }
+
+    JsonValue Position(const SourceDocument& document, uint32_t line, uint32_t column) const {
+        return JsonValue::Object().Set("line", JsonValue::Number(line)).Set("character", JsonValue::Number(Character(document, line, column)));
+    }
+
+    JsonValue Range(const SourceDocument& document, uint32_t line, uint32_t start, uint32_t end) const {
+        return JsonValue::Object().Set("start", Position(document, line, start)).Set("end", Position(document, line, end));
+    }
+
+    JsonValue Location(const SourceDocument& document, const DocumentLocation& location) const {
+        JsonValue result = JsonValue::Object();
+        result.Set("uri", JsonValue::String(document.uri));
+        result.Set("range", Range(document, location.line, location.column, location.column + location.length));
+        return result;
+    }
+
+    void SendResult(const JsonValue& id, JsonValue result) {
+        JsonValue message = JsonValue::Object();
+        message.Set("jsonrpc", JsonValue::String("2.0"));
+        message.Set("id", id);
+        message.Set("result", std::move(result));
+        Send(message);
+    }
+
+    void SendError(const JsonValue& id, int code, std::string text) {
+        JsonValue error = JsonValue::Object();
+        error.Set("code", JsonValue::Number(code));
+        error.Set("message", JsonValue::String(std::move(text)));
+        JsonValue message = JsonValue::Object();
+        message.Set("jsonrpc", JsonValue::String("2.0"));
+        message.Set("id", id);
+        message.Set("error", std::move(error));
+        Send(message);
+    }
+
+    void SendNotification(const char* method, JsonValue params) {
+        JsonValue message = JsonValue::Object();
+        message.Set("jsonrpc", JsonValue::String("2.0"));
+        message.Set("method", JsonValue::String(method));
+        message.Set("params", std::move(params));
+        Send(message);
+    }
+
+#ifdef LSP_POSIX
+    void Send(const JsonValue& message) {
+        std::string body = message.Write();
+        std::string frame = "Content-Length: " + std::to_string(body.size()) + "\r\n\r\n" + body;
+        const char* data = frame.data();
+        size_t size = frame.size();
+        while (size > 0) {
+            ssize_t written = write(STDOUT_FILENO, data, size);
+            if (written < 0 && errno == EINTR)
+                continue;
+            if (written <= 0)
+                return;
+            data += written;
+            size -= written;
+        }
+    }
+
+    // A message is buffered or more is waiting to be read
+    bool InputPending() {
+        if (consumed < input.size())
+            return true;
+        struct pollfd request = {STDIN_FILENO, POLLIN, 0};
+        return poll(&request, 1, 0) > 0;
+    }
+
+    int Fill() {
+        char buffer[65536];
+        while (true) {
+            ssize_t length = read(STDIN_FILENO, buffer, sizeof(buffer));
+            if (length < 0 && errno == EINTR)
+                continue;
+            if (length <= 0)
+                return -1;
+            input.append(buffer, length);
+            return 0;
+        }
+    }
+
+    // Read the headers and the body of the next message
+    int ReadMessage(std::string& body) {
+        while (true) {
+            size_t headerEnd = input.find("\r\n\r\n", consumed);
+            if (headerEnd != std::string::npos) {
+                size_t length = std::string::npos;
+                for (size_t line=consumed; line < headerEnd;) {
+                    size_t next = input.find("\r\n", line);
+                    if (next - line > 15 && strncasecmp(input.data() + line, "Content-Length:", 15) == 0)
+                        length = strtoull(input.c_str() + line + 15, nullptr, 10);
+                    line = next + 2;
+                }
+                if (length == std::string::npos)
+                    return -1;
+
+                size_t start = headerEnd + 4;
+                if (input.size() - start >= length) {
+                    body.assign(input, start, length);
+                    consumed = start + length;
+                    if (consumed == input.size()) {
+                        input.clear();
+                        consumed = 0;
+                    }
+                    return 0;
+                }
+            }
+            if (consumed > 0) {
+                input.erase(0, consumed);
+                consumed = 0;
+            }
+            if (Fill() != 0)
+                return -1;
+        }
+    }
+#else
+    void Send(const JsonValue&) {}
+#endif
+
+};
+
+#endif
@@ -2,101 +2,1129 @@
 #include <fstream>
 #include <sstream>
 #include <vector>
+#include <future>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <chrono>
+#include <algorithm>
+#include <cstdlib>
+#include <iomanip>
+
+// Heap allocations are counted for --stats only in a build with -DX4ASM_COUNT_ALLOCATIONS, the
+// counting operator new costs every allocation an atomic add
+#ifdef X4ASM_COUNT_ALLOCATIONS
+ #define COUNT_HEAP_ALLOCATIONS
+#endif
 
 #include "types.h"
+#include "source.h"
+#include "assembler.h"
+#include "threadpool.h"
+#include "writers.h"
+#include "stats.h"
+#include "object.h"
+#include "linker.h"
+#include "preprocessor.h"
+#include "cache.h"
+#include "watch.h"
+#include "server.h"
+#include "lsp.h"
+#include "peephole.h"
 
-int errorCount = 0;
-int warningCount = 0;
-std::string assemblyFilename;
-std::string outputFilename;
+// One output file and its format
+struct OutputTarget {
+    int format;
+    std::string filename;
+};
 
-std::vector<uint8_t> outputBinaryData;
+// One input file and where its outputs go
+struct BuildJob {
+    std::string input;
+    std::vector<OutputTarget> outputs;
+    std::string depfile;            // Make rule of the outputs, empty for none
+    const std::string* text;        // Source of an input named -, nullptr for a file
 
-//#define DEBUG_OUTPUT_LABEL_OFFSETS
-//#define DEBUG_OUTPUT_VARIABLE_OFFSET
+    BuildJob() : text(nullptr) {}
+};
 
-#include "registers.h"
-#include "utill.h"
-#include "assembler.h"
 
-int main(int argc, char* argv[]) {
-    if (argc < 2) { // Usage tip - Must have at least two argument
-        std::cerr << "Usage: " << argv[0] << " <input.asm> [output.bin]\n";
-        return 1;
+// Replace the extension of the input file name, .bin unless another one is given
+std::string DefaultOutputName(const std::string& input, const std::string& extension = ".bin") {
+    size_t slash = input.find_last_of("/\\");
+    size_t dot = input.find_last_of('.');
+    if (dot == std::string::npos || (slash != std::string::npos && dot < slash))
+        return input + extension;
+    return input.substr(0, dot) + extension;
+}
+
+// Add an output named on the command line, a .hex name is a C array, a .bin name a raw binary
+// and a .x4o name an object
+void AddOutput(BuildJob& job, const std::string& filename) {
+    OutputTarget target;
+    target.filename = filename;
+
+    if (filename.find(".x4o") != std::string::npos) {
+        target.format = OUTPUT_OBJECT;
+        job.outputs.push_back(target);
+        return;
     }
-    
-    // Set the output file name
-    outputFilename = argv[2];
-    
-    // Open the file
-    std::ifstream assemblySource(argv[1], std::ios::in);
-    
-    // Check if the file was successfully opened
-    if (!assemblySource) {
-        std::cerr << "Error: Could not open the file.\n";
-        return 1;
+
+    if (filename.find(".hex") != std::string::npos) {
+        target.format = OUTPUT_CARRAY;
+        job.outputs.push_back(target);
+    }
+    if (filename.find(".bin") != std::string::npos) {
+        target.format = OUTPUT_BINARY;
+        job.outputs.push_back(target);
+    }
+}
+
+// Parse an "input.asm" or "input.asm=output.bin" batch argument
+// Inputs without an output are given the default one once every option is known
+BuildJob ParseJob(const std::string& argument) {
+    BuildJob job;
+    size_t equals = argument.find('=');
+    if (equals == std::string::npos) {
+        job.input = argument;
+    } else {
+        job.input = argument.substr(0, equals);
+        AddOutput(job, argument.substr(equals + 1));
+    }
+    return job;
+}
+
+// Read a manifest with one "input.asm [output.bin]" pair per line
+// Blank lines and lines starting with # or ; are skipped
+int ReadManifest(const std::string& filename, std::vector<BuildJob>& jobs) {
+    std::ifstream manifest(filename);
+    if (!manifest)
+        return -1;
+
+    std::string line;
+    while (std::getline(manifest, line)) {
+        std::string_view text = StringRemoveTrailingWhitespace(StringRemoveLeadingWhitespace(std::string_view(line)));
+        if (text.empty() || text[0] == '#' || text[0] == ';')
+            continue;
+
+        size_t split = text.find_first_of(" \t");
+        BuildJob job;
+        job.input = std::string(text.substr(0, split));
+        if (split != std::string_view::npos)
+            AddOutput(job, std::string(StringRemoveLeadingWhitespace(text.substr(split))));
+        jobs.push_back(job);
+    }
+    return 0;
+}
+
+
+// Write every requested output of a job from the same image
+// The first output is written here while the others are written on their own threads
+int WriteOutputs(const BuildJob& job, const Image& outputBinaryData, Stats* stats, std::ostream& err) {
+    std::vector<std::future<int>> written;
+    for (unsigned int i=1; i < job.outputs.size(); i++) {
+        const OutputTarget& target = job.outputs[i];
+        written.push_back(std::async(std::launch::async, [&target, &outputBinaryData, stats]() {
+            ScopedTimer timer(stats, "write");
+            return WriteImage(target.format, target.filename, outputBinaryData);
+        }));
+    }
+
+    std::vector<int> status(job.outputs.size(), 0);
+    if (job.outputs.size() > 0) {
+        ScopedTimer timer(stats, "write");
+        status[0] = WriteImage(job.outputs[0].format, job.outputs[0].filename, outputBinaryData);
+    }
+    for (unsigned int i=1; i < job.outputs.size(); i++)
+        status[i] = written[i - 1].get();
+
+    int result = 0;
+    for (unsigned int i=0; i < job.outputs.size(); i++) {
+        if (status[i] != 0) {
+            err << "Error opening output file " << job.outputs[i].filename << std::endl << std::endl;
+            result = -1;
+        }
+    }
+    return result;
+}
+
+
+// Print the diagnostics of a file
+// Lines of preprocessed source are reported in the file they came from
+void PrintDiagnostics(const BuildJob& job, const std::vector<x4::Diagnostic>& diagnostics, const Preprocessor* preprocessor, std::ostream& out) {
+    for (unsigned int i=0; i < diagnostics.size(); i++) {
+        const x4::Diagnostic& diagnostic = diagnostics[i];
+        out << std::endl << std::endl;
+        if (preprocessor != nullptr) {
+            LineOrigin origin = preprocessor->Origin(diagnostic.line);
+            out << preprocessor->FileName(origin.file) << "(" << (origin.line + 1) << "): ";
+        } else {
+            out << job.input << "(" << (diagnostic.line + 1) << "): ";
+        }
+        out << (diagnostic.type == DIAGNOSTIC_ERROR ? "Error: " : "Warning: ") << diagnostic.message;
+    }
+}
+
+// What every peephole rule saved
+void PrintPeepholeReport(const PeepholeReport& report, std::ostream& out) {
+    out << std::endl << std::endl << "Peephole optimizer, " << report.passes << " passes" << std::endl;
+    out << std::left << std::setw(20) << "rule" << std::right << std::setw(10) << "rewrites" << std::setw(10) << "bytes" << std::setw(14) << "est. cycles";
+    uint64_t total[3] = {0, 0, 0};
+    for (unsigned int rule=0; rule < PEEPHOLE_RULES; rule++) {
+        out << std::endl << std::left << std::setw(20) << peepholeRuleNames[rule] << std::right << std::setw(10) << report.rewrites[rule]
+            << std::setw(10) << report.bytes[rule] << std::setw(14) << report.cycles[rule];
+        total[0] += report.rewrites[rule];
+        total[1] += report.bytes[rule];
+        total[2] += report.cycles[rule];
+    }
+    out << std::endl << std::left << std::setw(20) << "total" << std::right << std::setw(10) << total[0] << std::setw(10) << total[1] << std::setw(14) << total[2];
+}
+
+void PrintPreprocessErrors(const Preprocessor& preprocessor, std::ostream& out) {
+    for (unsigned int i=0; i < preprocessor.Errors().size(); i++) {
+        const PreprocessError& error = preprocessor.Errors()[i];
+        out << std::endl << std::endl;
+        out << preprocessor.FileName(error.origin.file) << "(" << (error.origin.line + 1) << "): Error: " << error.message;
+    }
+}
+
+// Name every output as depending on the sources that were read
+int WriteJobDepfile(const BuildJob& job, const Preprocessor& preprocessor, std::ostream& err) {
+    if (job.depfile.empty())
+        return 0;
+
+    std::vector<std::string> targets;
+    for (unsigned int i=0; i < job.outputs.size(); i++)
+        targets.push_back(job.outputs[i].filename);
+    if (WriteDepfile(job.depfile, targets, preprocessor.Dependencies()) != 0) {
+        err << "Error opening output file " << job.depfile << std::endl << std::endl;
+        return -1;
+    }
+    return 0;
+}
+
+
+// Assemble one file chunk by chunk straight into a raw binary
+int StreamFile(x4::Assembler& assembler, const BuildJob& job, std::ostream& out, std::ostream& err) {
+    SourceStream assemblySource;
+    if (assemblySource.Open(job.input) != 0) {
+        err << "Error: Could not open the file " << job.input << ".\n";
+        return -1;
+    }
+
+    // Stream mode writes the image as it is produced, so only a raw binary can be written
+    if (job.outputs.size() != 1 || job.outputs[0].format != OUTPUT_BINARY) {
+        err << "Error: Streaming writes exactly one raw binary output.\n";
+        return -1;
+    }
+    const std::string& outputFilename = job.outputs[0].filename;
+
+    std::fstream outputFile(outputFilename, std::ios::in | std::ios::out | std::ios::trunc | std::ios::binary);
+    if (!outputFile) {
+        err << "Error opening output file" << std::endl << std::endl;
+        return -1;
+    }
+
+    out << "Assembling " << job.input << "...";
+
+    x4::AssemblyResult result;
+    int theCakeBaked = assembler.AssembleStream(assemblySource, outputFile, result);
+    PrintDiagnostics(job, result.diagnostics, nullptr, out);
+
+    // Drop the partial output
+    if (theCakeBaked != 0) {
+        outputFile.close();
+        std::remove(outputFilename.c_str());
+        return -1;
+    }
+    return 0;
+}
+
+
+// Assemble the preprocessed lines, or the lines the peephole optimizer rewrote from them when there
+// are any, or take the finished assembly from the cache
+// Failed assemblies are cached as well, a hit reports the same diagnostics
+void BuildEntry(x4::Assembler& assembler, const Preprocessor& preprocessor, const ScanResult* optimized, uint32_t kind, const BuildCache* cache, Stats* stats, CacheEntry& entry) {
+    const ScanResult& lines = (optimized != nullptr) ? *optimized : preprocessor.Lines();
+    uint64_t key = 0;
+    if (cache != nullptr) {
+        ScopedTimer timer(stats, "cache");
+        if (preprocessor.PassedThrough() && optimized == nullptr)
+            key = BuildCache::Key(preprocessor.MainText(), kind);
+        else
+            key = BuildCache::Key(lines, kind);
+        if (cache->Load(key, entry) == 0 && entry.kind == kind) {
+            if (stats != nullptr)
+                stats->Count(STAT_CACHE_HITS, 1);
+            return;
+        }
+        if (stats != nullptr)
+            stats->Count(STAT_CACHE_MISSES, 1);
+    }
+
+    x4::AssemblyResult result;
+    entry.kind = kind;
+    entry.image.clear();
+    entry.object.clear();
+    if (kind == CACHE_OBJECT) {
+        ObjectFile object;
+        entry.status = assembler.AssembleObject(lines, result, object);
+        if (entry.status == 0) {
+            entry.object.resize(ObjectSize(object));
+            FormatObject(object, entry.object.data());
+        }
+    } else {
+        entry.status = assembler.Assemble(lines, result);
+        if (entry.status == 0)
+            entry.image.swap(result.image);
+    }
+    entry.diagnostics.swap(result.diagnostics);
+
+    // A cache that cannot be written only costs the next run an assembly
+    if (cache != nullptr) {
+        ScopedTimer timer(stats, "cache");
+        cache->Store(key, entry);
+    }
+}
+
+
+// Write a finished object file
+int WriteObjectBytes(const std::string& filename, const std::vector<uint8_t>& object) {
+    OutputFile output;
+    if (output.Open(filename, object.size()) != 0)
+        return -1;
+    if (object.size() > 0)
+        memcpy(output.Data(), object.data(), object.size());
+    return output.Close();
+}
+
+
+// Assemble one file and write its output
+int AssembleFile(x4::Assembler& assembler, const BuildJob& job, bool stream, bool optimize, const PreprocessOptions& options, const BuildCache* cache, Stats* stats, std::ostream& out, std::ostream& err) {
+    assembler.SetStats(stats);
+    if (stats != nullptr)
+        stats->Count(STAT_FILES, 1);
+
+    if (stream)
+        return StreamFile(assembler, job, out, err);
+
+    // Map the file, includes and macros are expanded in front of the assembler
+    Preprocessor preprocessor(options, stats);
+    if (job.text != nullptr) {
+        preprocessor.OpenText(job.input, *job.text);
+    } else if (preprocessor.Open(job.input) != 0) {
+        err << "Error: Could not open the file " << job.input << ".\n";
+        return -1;
     }
-    
-    assemblyFilename = argv[1];
-    
-    // Read the file into a buffer
-    std::ostringstream buffer;
-    buffer << assemblySource.rdbuf();
-    std::string fileContents = buffer.str();
-    assemblySource.close();
-    
-    std::vector<std::string> assemblyLines = String.Explode(fileContents, '\n');
-    
+
     // Assemble the file
-    std::cout << "Assembling " << assemblyFilename << "...";
-    
-    // Bake the assembly file
-    int theCakeBaked = BakeTheCake(assemblyLines);
-    
+    out << "Assembling " << job.input << "...";
+
+    if (preprocessor.Run() != 0) {
+        PrintPreprocessErrors(preprocessor, out);
+        return -1;
+    }
+
+    // An object is the only output of a module
+    for (unsigned int i=0; i < job.outputs.size(); i++) {
+        if (job.outputs[i].format == OUTPUT_OBJECT && job.outputs.size() > 1) {
+            err << "Error: An object file must be the only output of " << job.input << ".\n";
+            return -1;
+        }
+    }
+    bool module = (job.outputs.size() == 1 && job.outputs[0].format == OUTPUT_OBJECT);
+
+    // The rewritten lines are assembled in place of the preprocessed ones and key the cache
+    PeepholeOptimizer optimizer;
+    ScanResult optimized;
+    if (optimize) {
+        ScopedTimer timer(stats, "peephole");
+        optimizer.Optimize(preprocessor.Lines(), optimized);
+    }
+
+    CacheEntry entry;
+    uint32_t kind = module ? CACHE_OBJECT : (assembler.LongBranches() ? CACHE_IMAGE_LONG : CACHE_IMAGE);
+    BuildEntry(assembler, preprocessor, optimize ? &optimized : nullptr, kind, cache, stats, entry);
+    PrintDiagnostics(job, entry.diagnostics, &preprocessor, out);
+
     // Check if the cake baked
-    if (errorCount > 0 || warningCount > 0 || theCakeBaked != 0) {
-        return -1;
-    }
-    
-    
-    // Build a hex file
-    if (outputFilename.find(".hex") != std::string::npos) {
-        std::string hexFileString = "uint8_t program[] = {\n";
-        hexFileString += "    ";
-        uint8_t counter=0;
-        for (uint32_t i=0; i < outputBinaryData.size(); i++) {
-            hexFileString += toHexString( outputBinaryData[i] ) + ", ";
-            counter++;
-            if (counter == 24) {
-                counter=0;
-                hexFileString += '\n';
-                hexFileString += "    ";
+    if (entry.status != 0)
+        return -1;
+    if (optimize)
+        PrintPeepholeReport(optimizer.Report(), out);
+
+    if (module) {
+        ScopedTimer timer(stats, "write");
+        if (WriteObjectBytes(job.outputs[0].filename, entry.object) != 0) {
+            err << "Error opening output file " << job.outputs[0].filename << std::endl << std::endl;
+            return -1;
+        }
+    } else if (WriteOutputs(job, entry.image, stats, err) != 0) {
+        return -1;
+    }
+    return WriteJobDepfile(job, preprocessor, err);
+}
+
+
+// Link objects into one image and write its outputs
+int LinkFiles(const BuildJob& job, const std::vector<std::string>& inputs, Stats* stats, std::ostream& out, std::ostream& err) {
+    std::vector<ObjectFile> objects(inputs.size());
+    {
+        ScopedTimer timer(stats, "load");
+        for (unsigned int i=0; i < inputs.size(); i++) {
+            if (ReadObject(inputs[i], objects[i]) != 0) {
+                err << "Error: Could not read the object " << inputs[i] << ".\n";
+                return -1;
+            }
+        }
+    }
+
+    out << "Linking " << inputs.size() << " object(s)...";
+
+    LinkResult result;
+    int linked;
+    {
+        ScopedTimer timer(stats, "link");
+        linked = Link(objects, inputs, result);
+    }
+    for (unsigned int i=0; i < result.errors.size(); i++)
+        out << std::endl << std::endl << "Error: " << result.errors[i];
+
+    if (stats != nullptr) {
+        stats->Count(STAT_FILES, inputs.size());
+        stats->Count(STAT_OUTPUT_BYTES, result.image.Size());
+    }
+
+    if (linked != 0)
+        return -1;
+    return WriteOutputs(job, result.image, stats, err);
+}
+
+
+// Assemble every job on a thread pool
+// Each file's messages are collected and printed in input order once the file is done,
+// so printing and writing overlap with the assembly of later files
+int AssembleBatch(const std::vector<BuildJob>& jobs, unsigned int threadCount, bool stream, bool optimize, bool longBranches, const PreprocessOptions& options, const BuildCache* cache, Stats* stats, std::ostream& out) {
+    std::vector<std::ostringstream> logs(jobs.size());
+    std::vector<int> status(jobs.size(), -1);
+    std::vector<std::future<void>> done;
+    done.reserve(jobs.size());
+
+    ThreadPool pool(threadCount);
+    for (unsigned int i=0; i < jobs.size(); i++) {
+        done.push_back(pool.Submit([&, i]() {
+            // One assembler per worker, its arena stays warm between files
+            static thread_local x4::Assembler assembler;
+            assembler.SetLongBranches(longBranches);
+            status[i] = AssembleFile(assembler, jobs[i], stream, optimize, options, cache, stats, logs[i], logs[i]);
+        }));
+    }
+
+    unsigned int failed = 0;
+    for (unsigned int i=0; i < jobs.size(); i++) {
+        done[i].wait();
+        out << logs[i].str() << std::endl;
+        if (status[i] != 0)
+            failed++;
+    }
+
+    out << std::endl << jobs.size() << " file(s), " << failed << " failed" << std::endl;
+
+    if (failed > 0)
+        return -1;
+    return 0;
+}
+
+
+// The preprocessed source as one text, the text a watch compares between saves
+void CanonicalText(const Preprocessor& preprocessor, std::string& text) {
+    if (preprocessor.PassedThrough()) {
+        text.assign(preprocessor.MainText().data(), preprocessor.MainText().size());
+        return;
+    }
+    const ScanResult& lines = preprocessor.Lines();
+    text.clear();
+    for (uint32_t i=0; i < lines.lines.size(); i++) {
+        text.append(lines.lines[i].data(), lines.lines[i].size());
+        text.push_back('\n');
+    }
+}
+
+// Whole lines of one text replaced by whole lines of another
+struct SourceEdit {
+    size_t start;                   // Byte offset of the first line, the same in both texts
+    size_t oldEnd;                  // End of the replaced lines in the old text
+    size_t newEnd;                  // End of the lines replacing them in the new text
+    uint32_t first;                 // Index of the first replaced line
+    uint32_t removed;               // Number of lines replaced
+};
+
+// Offset of every line of a text, lines are counted as the scanner counts them
+void FindLineStarts(std::string_view text, size_t offset, std::vector<uint32_t>& starts) {
+    size_t lineStart = 0;
+    for (size_t newline = text.find('\n'); newline != std::string_view::npos; newline = text.find('\n', lineStart)) {
+        starts.push_back(offset + lineStart);
+        lineStart = newline + 1;
+    }
+    if (lineStart < text.size())
+        starts.push_back(offset + lineStart);
+}
+
+// Find the smallest run of lines outside of which both texts are the same
+// The lines are looked up in the line starts of the old text, nothing outside the edit is counted.
+void FindEdit(std::string_view before, std::string_view after, const std::vector<uint32_t>& lineStarts, SourceEdit& edit) {
+    // Whole blocks are compared with memcmp first, a save usually changes a few bytes of a large file
+    const size_t block = 4096;
+    size_t shorter = std::min(before.size(), after.size());
+    size_t prefix = 0;
+    while (prefix + block <= shorter && memcmp(before.data() + prefix, after.data() + prefix, block) == 0)
+        prefix += block;
+    while (prefix < shorter && before[prefix] == after[prefix])
+        prefix++;
+    size_t suffix = 0;
+    while (suffix + block <= shorter - prefix &&
+           memcmp(before.data() + before.size() - suffix - block, after.data() + after.size() - suffix - block, block) == 0)
+        suffix += block;
+    while (suffix < shorter - prefix && before[before.size() - 1 - suffix] == after[after.size() - 1 - suffix])
+        suffix++;
+
+    // Back to the start of the line, the prefix is shared so both texts agree
+    edit.start = prefix;
+    while (edit.start > 0 && before[edit.start - 1] != '\n')
+        edit.start--;
+
+    // On to the end of a line of the shared suffix
+    size_t oldEnd = before.size() - suffix;
+    size_t newline = before.find('\n', oldEnd);
+    size_t extra = (newline == std::string_view::npos) ? suffix : newline + 1 - oldEnd;
+    edit.oldEnd = oldEnd + extra;
+    edit.newEnd = after.size() - suffix + extra;
+
+    edit.first = std::lower_bound(lineStarts.begin(), lineStarts.end(), edit.start) - lineStarts.begin();
+    edit.removed = std::lower_bound(lineStarts.begin() + edit.first, lineStarts.end(), edit.oldEnd) - lineStarts.begin() - edit.first;
+}
+
+// Move the line starts of the old text over to the new one
+void ApplyEdit(std::string_view after, const SourceEdit& edit, std::vector<uint32_t>& lineStarts) {
+    std::vector<uint32_t> inserted;
+    FindLineStarts(after.substr(edit.start, edit.newEnd - edit.start), edit.start, inserted);
+
+    lineStarts.erase(lineStarts.begin() + edit.first, lineStarts.begin() + edit.first + edit.removed);
+    lineStarts.insert(lineStarts.begin() + edit.first, inserted.begin(), inserted.end());
+
+    uint32_t delta = edit.newEnd - edit.oldEnd;     // Wraps for a shrinking edit
+    if (delta != 0) {
+        for (size_t i=edit.first + inserted.size(); i < lineStarts.size(); i++)
+            lineStarts[i] += delta;
+    }
+}
+
+
+// Report one build of a watched file
+void PrintRebuild(bool unchanged, bool built, bool incremental, std::chrono::steady_clock::time_point started, Stats* stats) {
+    std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - started;
+    if (unchanged)
+        std::cout << " unchanged";
+    else if (built)
+        std::cout << " done in " << elapsed.count() << " ms" << (incremental ? "" : ", full assembly");
+    std::cout << std::endl;
+    if (stats != nullptr)
+        stats->PrintSummary(std::cout);
+}
+
+// Apply a save of a file the preprocessor passed through to the retained assembly
+// The file had no directive before the save, so it has none after it unless the edit added one. That
+// is checked in the edited lines alone and the preprocessor is not run. Returns REASSEMBLE_FULL
+// when the file must be preprocessed and assembled in full after all.
+int RebuildPassedThrough(x4::Assembler& assembler, const BuildJob& job, std::string& previous, std::vector<uint32_t>& lineStarts, Stats* stats, bool& unchanged) {
+    SourceFile file;
+    {
+        ScopedTimer timer(stats, "load");
+        if (file.Open(job.input) != 0)
+            return REASSEMBLE_FULL;
+    }
+    std::string_view text = file.Text();
+    unchanged = (text == std::string_view(previous));
+    if (unchanged)
+        return 0;
+
+    SourceEdit edit;
+    {
+        ScopedTimer timer(stats, "diff");
+        FindEdit(previous, text, lineStarts, edit);
+
+        // A directive may straddle the start or the end of the edit
+        const size_t margin = 4;
+        size_t windowStart = (edit.start > margin) ? edit.start - margin : 0;
+        size_t windowEnd = std::min(edit.newEnd + margin, text.size());
+        if (Preprocessor::NeedsPreprocessing(text.substr(windowStart, windowEnd - windowStart)))
+            return REASSEMBLE_FULL;
+    }
+
+    ScanResult lines;
+    ScanSource(text.substr(edit.start, edit.newEnd - edit.start), lines);
+    x4::AssemblyResult result;
+    if (assembler.Reassemble(edit.first, edit.removed, lines, result) != 0)
+        return REASSEMBLE_FULL;
+    {
+        ScopedTimer timer(stats, "retain");
+        ApplyEdit(text, edit, lineStarts);
+        previous.replace(edit.start, edit.oldEnd - edit.start, text.data() + edit.start, edit.newEnd - edit.start);
+    }
+
+    std::cout << "Assembling " << job.input << "...";
+    if (WriteOutputs(job, result.image, stats, std::cerr) != 0)
+        return -1;
+    return 0;
+}
+
+
+// Assemble a file again and write its outputs whenever it or one of its includes is saved
+// The assembler keeps the last image with the address of every line, an edit assembles only the lines
+// it changed and patches the references that moved. Edits it cannot apply assemble the whole file.
+int WatchFile(x4::Assembler& assembler, const BuildJob& job, const PreprocessOptions& options, bool printStats) {
+    if (!FileWatcher::Supported()) {
+        std::cerr << "Error: --watch is not supported on this platform.\n";
+        return -1;
+    }
+
+    // Included files change between saves, so nothing is kept from one build to the next
+    PreprocessOptions fresh = options;
+    fresh.cache = nullptr;
+
+    FileWatcher watcher;
+    std::string text;
+    std::string previous;           // Preprocessed source of the retained assembly
+    std::vector<uint32_t> lineStarts;
+    bool retained = false;
+    bool passedThrough = false;
+    bool firstBuild = true;
+
+    while (true) {
+        if (!firstBuild && watcher.Wait() != 0) {
+            std::cerr << "Error: Could not watch the sources of " << job.input << ".\n";
+            return -1;
+        }
+        firstBuild = false;
+        std::chrono::steady_clock::time_point started = std::chrono::steady_clock::now();
+
+        std::unique_ptr<Stats> stats;
+        if (printStats)
+            stats.reset(new Stats());
+        assembler.SetStats(stats.get());
+
+        // The common save: a few lines of a file without directives
+        bool tried = false;
+        if (retained && passedThrough) {
+            bool unchanged = false;
+            int status = RebuildPassedThrough(assembler, job, previous, lineStarts, stats.get(), unchanged);
+            if (status != REASSEMBLE_FULL) {
+                if (unchanged)
+                    std::cout << "Assembling " << job.input << "...";
+                PrintRebuild(unchanged, status == 0, true, started, stats.get());
+                std::cout << "Watching " << job.input << " for changes..." << std::endl;
+                continue;
+            }
+            tried = true;
+        }
+
+        Preprocessor preprocessor(fresh, stats.get());
+        if (preprocessor.Open(job.input) != 0) {
+            // An editor may have the file renamed away for a moment
+            std::cerr << "Error: Could not open the file " << job.input << ".\n";
+            if (!retained && previous.empty())
+                return -1;
+            continue;
+        }
+
+        std::cout << "Assembling " << job.input << "...";
+        if (preprocessor.Run() != 0) {
+            PrintPreprocessErrors(preprocessor, std::cout);
+            std::cout << std::endl;
+        } else {
+            CanonicalText(preprocessor, text);
+            bool unchanged = (retained && text == previous);
+
+            x4::AssemblyResult result;
+            int status = REASSEMBLE_FULL;
+            if (retained && !unchanged && !tried) {
+                SourceEdit edit;
+                FindEdit(previous, text, lineStarts, edit);
+                ScanResult lines;
+                ScanSource(std::string_view(text).substr(edit.start, edit.newEnd - edit.start), lines);
+                status = assembler.Reassemble(edit.first, edit.removed, lines, result);
             }
+
+            // A directive that expands to nothing leaves the source unchanged but ends the passing through
+            passedThrough = preprocessor.PassedThrough();
+            bool incremental = (status == 0);
+            if (!unchanged) {
+                if (!incremental)
+                    status = assembler.AssembleRetained(preprocessor.Lines(), result);
+                retained = (status == 0);
+                previous.swap(text);
+                lineStarts.clear();
+                FindLineStarts(previous, 0, lineStarts);
+            }
+
+            PrintDiagnostics(job, result.diagnostics, &preprocessor, std::cout);
+            bool built = (!unchanged && status == 0);
+            if (built && (WriteOutputs(job, result.image, stats.get(), std::cerr) != 0 || WriteJobDepfile(job, preprocessor, std::cerr) != 0))
+                built = false;
+            PrintRebuild(unchanged, built, incremental, started, stats.get());
         }
-        hexFileString += "\n};";
-        
-        // Write the file
-        std::ofstream outputFileHex(outputFilename, std::ios::binary);
-        if (!outputFileHex) {
-            std::cerr << "Error opening output file" << std::endl << std::endl;
+
+        // Includes may have been added or dropped
+        if (watcher.Watch(preprocessor.Dependencies()) != 0) {
+            std::cerr << "Error: Could not watch the sources of " << job.input << ".\n";
             return -1;
         }
-        outputFileHex.write(reinterpret_cast<const char*>(hexFileString.data()), hexFileString.size());
-        outputFileHex.close();
+        std::cout << "Watching " << job.input << " for changes..." << std::endl;
     }
-    
-    
-    // Build the resulting binary file
-    if (outputFilename.find(".bin") != std::string::npos) {
-        std::ofstream outputFileBin(outputFilename, std::ios::binary);
-        if (!outputFileBin) {
-            std::cerr << "Error opening output file" << std::endl << std::endl;
-            return -1;
+}
+
+
+void PrintUsage(const std::string& program, std::ostream& err) {
+    err << "Usage: " << program << " [--jobs=N] [-O] [--long-branches] [format options] <input.asm> [output.bin|output.hex]\n";
+    err << "       " << program << " --stream <input.asm> [output.bin]\n";
+    err << "       " << program << " [--jobs=N] [-O] [--stream] --batch <input.asm[=output.bin]>...\n";
+    err << "       " << program << " [--jobs=N] [-O] [--stream] --manifest=<file>\n";
+    err << "       " << program << " --object [-O] <input.asm> [output.x4o]\n";
+    err << "       " << program << " --link [format options] <input.x4o>...\n";
+    err << "       " << program << " --watch [format options] <input.asm> [output.bin|output.hex]\n";
+    err << "       " << program << " --server=<socket> [--jobs=N]\n";
+    err << "       " << program << " --lsp [--long-branches]\n";
+    err << "Format options, any number of them:\n";
+    err << "  --bin=<file>     raw binary\n";
+    err << "  --carray=<file>  C array\n";
+    err << "  --ihex=<file>    Intel HEX\n";
+    err << "  --srec=<file>    Motorola S-record\n";
+    err << "--stream assembles in bounded memory and always writes a raw binary\n";
+    err << "--stats prints phase timings and counters, --trace=<file.json> writes a Chrome trace\n";
+    err << "--object writes relocatable objects, GLOBAL and EXTERN name the symbols they share\n";
+    err << "Preprocessor options:\n";
+    err << "  --include-dir=<dir>  search the directory for INCLUDE files, any number of them\n";
+    err << "  --define=<name>      define a symbol for IFDEF, any number of them\n";
+    err << "  --depfile=<file>     write a Make/Ninja depfile of the output\n";
+    err << "  --depfiles           write a depfile next to the first output of every batch input\n";
+    err << "--stream does not preprocess\n";
+    err << "--cache-dir=<dir> reuses the result of any earlier assembly of the same preprocessed source\n";
+    err << "--watch assembles again every time the input or one of its includes is saved, reassembling only the edited lines\n";
+    err << "--server runs command lines sent by --connect=<socket>, or by any run while X4ASM_SERVER names the socket\n";
+    err << "--lsp speaks the Language Server Protocol on the standard input and output\n";
+    err << "--long-branches keeps every branch in its long form with a 32-bit address, otherwise branches take\n";
+    err << "  the shortest relative form that reaches their label. --object and --stream always keep them long\n";
+    err << "-O removes self moves, jumps to the next instruction, PUSH r POP r pairs and repeated compares, sends\n";
+    err << "  jumps to a jump straight to its label and prints what every rule saved. Not with --stream or --watch\n";
+    err << "An input named - is read from the standard input\n";
+}
+
+
+// Print and write the instrumentation once everything is done
+int ReportStats(Stats& stats, bool summary, const std::string& traceFilename, std::ostream& out, std::ostream& err) {
+    if (summary)
+        stats.PrintSummary(out);
+
+    if (!traceFilename.empty() && stats.WriteTrace(traceFilename) != 0) {
+        err << "Error: Could not write the trace " << traceFilename << ".\n";
+        return -1;
+    }
+    return 0;
+}
+
+
+// Where a command line runs, in this process or for a client of a server
+struct CommandContext {
+    std::string program;
+    IncludeCache* includes;             // Shared by every command the process runs
+    x4::Assembler* assembler;           // Assembler of a single file, kept warm by the caller
+    const std::string* source;          // Text of an input named -, nullptr if there is none
+    bool server;                        // Run for a client, nothing may wait for input
+    std::ostream& out;
+    std::ostream& err;
+};
+
+// A command line that is not valid, a server refuses it and leaves it to the client to report
+int UsageError(const CommandContext& context) {
+    if (context.server)
+        return SERVER_REFUSED;
+    PrintUsage(context.program, context.err);
+    return 1;
+}
+
+// Run one command line, returns the exit status
+int RunCommand(const std::vector<std::string>& arguments, CommandContext& context) {
+    std::vector<BuildJob> jobs;
+    std::vector<OutputTarget> formatOutputs;
+    std::vector<std::string> positional;
+    unsigned int threadCount = 0;
+    bool batch = false;
+    bool stream = false;
+    bool object = false;
+    bool link = false;
+    bool watch = false;
+    bool optimize = false;
+    bool longBranches = false;
+    bool printStats = false;
+    std::string traceFilename;
+    PreprocessOptions preprocess;
+    preprocess.cache = context.includes;
+    std::string depfile;
+    bool depfiles = false;
+    std::string cacheDirectory;
+
+    for (unsigned int i=0; i < arguments.size(); i++) {
+        const std::string& argument = arguments[i];
+
+        if (argument.compare(0, 7, "--jobs=") == 0) {
+            threadCount = String.ToUint(argument.substr(7));
+            continue;
+        }
+
+        // Outputs in an explicit format
+        const char* formatOptions[] = {"--bin=", "--carray=", "--ihex=", "--srec="};
+        const int formats[] = {OUTPUT_BINARY, OUTPUT_CARRAY, OUTPUT_IHEX, OUTPUT_SREC};
+        bool isFormat = false;
+        for (unsigned int f=0; f < 4; f++) {
+            size_t length = strlen(formatOptions[f]);
+            if (argument.compare(0, length, formatOptions[f]) == 0) {
+                OutputTarget target;
+                target.format = formats[f];
+                target.filename = argument.substr(length);
+                formatOutputs.push_back(target);
+                isFormat = true;
+            }
+        }
+        if (isFormat)
+            continue;
+
+        if (argument == "--stream") {
+            stream = true;
+            continue;
+        }
+
+        if (argument == "--object") {
+            object = true;
+            continue;
+        }
+
+        if (argument == "--link") {
+            link = true;
+            continue;
+        }
+
+        if (argument == "--watch") {
+            watch = true;
+            continue;
+        }
+
+        if (argument == "-O") {
+            optimize = true;
+            continue;
+        }
+
+        if (argument == "--long-branches") {
+            longBranches = true;
+            continue;
+        }
+
+        if (argument.compare(0, 14, "--include-dir=") == 0) {
+            preprocess.includeDirectories.push_back(argument.substr(14));
+            continue;
+        }
+
+        if (argument.compare(0, 9, "--define=") == 0) {
+            preprocess.defines.push_back(argument.substr(9));
+            continue;
+        }
+
+        if (argument.compare(0, 10, "--depfile=") == 0) {
+            depfile = argument.substr(10);
+            continue;
+        }
+
+        if (argument.compare(0, 12, "--cache-dir=") == 0) {
+            cacheDirectory = argument.substr(12);
+            continue;
+        }
+
+        if (argument == "--depfiles") {
+            depfiles = true;
+            continue;
+        }
+
+        if (argument == "--stats") {
+            printStats = true;
+            continue;
         }
-        
-        outputFileBin.write(reinterpret_cast<const char*>(outputBinaryData.data()), outputBinaryData.size());
-        outputFileBin.close();
+
+        if (argument.compare(0, 8, "--trace=") == 0) {
+            traceFilename = argument.substr(8);
+            continue;
+        }
+
+        if (argument == "--batch") {
+            batch = true;
+            continue;
+        }
+
+        if (argument.compare(0, 11, "--manifest=") == 0) {
+            batch = true;
+            std::string manifest = argument.substr(11);
+            if (ReadManifest(manifest, jobs) != 0) {
+                context.err << "Error: Could not open the manifest " << manifest << ".\n";
+                return 1;
+            }
+            continue;
+        }
+
+        if (batch) {
+            jobs.push_back(ParseJob(argument));
+            continue;
+        }
+
+        positional.push_back(argument);
+    }
+
+    // Instrumentation is only created when asked for
+    std::unique_ptr<Stats> stats;
+    if (printStats || !traceFilename.empty())
+        stats.reset(new Stats());
+
+    std::unique_ptr<BuildCache> buildCache;
+    if (!cacheDirectory.empty())
+        buildCache.reset(new BuildCache(cacheDirectory));
+
+    // A module is written as an object and nothing else
+    if (object && (formatOutputs.size() > 0 || stream)) {
+        return UsageError(context);
+    }
+
+    // Inputs without a named output get one next to them, the standard input has nothing to name it after
+    std::string extension = object ? ".x4o" : ".bin";
+    for (unsigned int i=0; i < jobs.size(); i++) {
+        if (jobs[i].input == "-") {
+            if (jobs[i].outputs.size() == 0) {
+                return UsageError(context);
+            }
+            jobs[i].text = context.source;
+        }
+        if (jobs[i].outputs.size() == 0)
+            AddOutput(jobs[i], DefaultOutputName(jobs[i].input, extension));
+        if (depfiles && jobs[i].outputs.size() > 0)
+            jobs[i].depfile = jobs[i].outputs[0].filename + ".d";
+    }
+
+    // The optimizer rewrites whole preprocessed programs, streaming reads raw lines and watching reassembles a few
+    if (optimize && (stream || watch || link)) {
+        return UsageError(context);
+    }
+
+    // Watching rebuilds one file and writes its image
+    if (watch && (link || batch || object || stream || !traceFilename.empty() || context.server)) {
+        return UsageError(context);
+    }
+
+    if (link) {
+        // Every positional argument is an object, the outputs come from the format options
+        if (positional.size() == 0 || batch || object || stream) {
+            return UsageError(context);
+        }
+        BuildJob job;
+        job.input = positional[0];
+        job.outputs = formatOutputs;
+        if (job.outputs.size() == 0)
+            AddOutput(job, DefaultOutputName(job.input));
+
+        int result = LinkFiles(job, positional, stats.get(), context.out, context.err);
+        context.out << std::endl;
+        if (stats != nullptr && ReportStats(*stats, printStats, traceFilename, context.out, context.err) != 0)
+            return 1;
+        return result;
+    }
+
+    if (batch) {
+        // Batch outputs are named per input
+        if (jobs.size() == 0 || positional.size() > 0 || formatOutputs.size() > 0 || !depfile.empty()) {
+            return UsageError(context);
+        }
+        int result = AssembleBatch(jobs, threadCount, stream, optimize, longBranches, preprocess, buildCache.get(), stats.get(), context.out);
+        if (stats != nullptr && ReportStats(*stats, printStats, traceFilename, context.out, context.err) != 0)
+            return 1;
+        return result;
+    }
+
+    // Single file, the output name is optional
+    if (positional.size() == 0 || positional.size() > 2) {
+        return UsageError(context);
+    }
+
+    BuildJob job;
+    job.input = positional[0];
+    if (positional.size() > 1)
+        AddOutput(job, positional[1]);
+    job.outputs.insert(job.outputs.end(), formatOutputs.begin(), formatOutputs.end());
+    if (job.input == "-") {
+        if (job.outputs.size() == 0 || watch) {
+            return UsageError(context);
+        }
+        job.text = context.source;
+    }
+    if (positional.size() == 1 && formatOutputs.size() == 0)
+        AddOutput(job, DefaultOutputName(job.input, extension));
+    job.depfile = depfile;
+    if (depfiles && job.outputs.size() > 0)
+        job.depfile = job.outputs[0].filename + ".d";
+    jobs.push_back(job);
+
+    // A single large file is split across --jobs threads
+    x4::Assembler& assembler = *context.assembler;
+    assembler.SetThreadCount(threadCount);
+    assembler.SetLongBranches(longBranches);
+    if (watch)
+        return (WatchFile(assembler, jobs[0], preprocess, printStats) == 0) ? 0 : 1;
+    int result = AssembleFile(assembler, jobs[0], stream, optimize, preprocess, buildCache.get(), stats.get(), context.out, context.err);
+    if (stats != nullptr && ReportStats(*stats, printStats, traceFilename, context.out, context.err) != 0)
+        return 1;
+    return result;
+}
+
+
+// Run command lines sent to a socket until the server is stopped
+// Included files stay loaded between requests and every worker keeps its assembler, so a request
+// pays for its own assembly and little else.
+int ServeCommands(const std::string& program, const std::string& socketPath, unsigned int threadCount) {
+    if (!AssemblerServer::Supported()) {
+        std::cerr << "Error: --server is not supported on this platform.\n";
+        return -1;
+    }
+
+    IncludeCache includes(true);
+    AssemblerServer server(socketPath, [&program, &includes](const ServerRequest& request, std::ostream& out, std::ostream& err) {
+        static thread_local x4::Assembler assembler;
+        CommandContext context = {program, &includes, &assembler, request.hasSource ? &request.source : nullptr, true, out, err};
+        return RunCommand(request.arguments, context);
+    });
+    if (server.Listen() != 0) {
+        std::cerr << "Error: Could not listen on " << socketPath << ".\n";
+        return -1;
     }
-    
+
+    std::cout << "Serving on " << socketPath << std::endl;
+    return server.Run(threadCount);
+}
+
+// Serve an editor until it exits, every document open in it is kept assembled
+int ServeLanguage(bool longBranches) {
+    if (!LanguageServer::Supported()) {
+        std::cerr << "Error: --lsp is not supported on this platform.\n";
+        return -1;
+    }
+    LanguageServer server(longBranches);
+    return server.Run();
+}
+
+// Send a command line to a server and print what it printed. Returns -1 if it could not be sent, or
+// SERVER_REFUSED if it has to run here.
+int RunOnServer(const std::string& socketPath, const std::vector<std::string>& arguments, const std::string* source, int& status) {
+    ServerRequest request;
+    request.directory = CurrentDirectory();
+    if (request.directory.empty())
+        return -1;
+    request.arguments = arguments;
+    request.hasSource = (source != nullptr);
+    if (source != nullptr)
+        request.source = *source;
+
+    ServerResponse response;
+    int sent = ForwardRequest(socketPath, request, response);
+    if (sent != 0)
+        return sent;
+    std::cout << response.out;
+    std::cerr << response.err;
+    status = response.status;
     return 0;
 }
+
+
+int main(int argc, char* argv[]) {
+    if (argc < 2) { // Usage tip - Must have at least one argument
+        PrintUsage(argv[0], std::cerr);
+        return 1;
+    }
+
+    // The server and the client options are taken out, the rest is the command line to run
+    std::vector<std::string> arguments;
+    std::string serverSocket;
+    bool languageServer = false;
+    std::string connectSocket;
+    unsigned int threadCount = 0;
+    bool readsInput = false;
+    for (int i=1; i < argc; i++) {
+        std::string argument = argv[i];
+        if (argument.compare(0, 9, "--server=") == 0) {
+            serverSocket = argument.substr(9);
+            continue;
+        }
+        if (argument == "--lsp") {
+            languageServer = true;
+            continue;
+        }
+        if (argument.compare(0, 10, "--connect=") == 0) {
+            connectSocket = argument.substr(10);
+            continue;
+        }
+        if (argument.compare(0, 7, "--jobs=") == 0)
+            threadCount = String.ToUint(argument.substr(7));
+        if (argument == "-")
+            readsInput = true;
+        arguments.push_back(argument);
+    }
+
+    if (!serverSocket.empty()) {
+        // Only the size of the thread pool is the server's own
+        if (!connectSocket.empty() || arguments.size() > (threadCount > 0 ? 1u : 0u)) {
+            PrintUsage(argv[0], std::cerr);
+            return 1;
+        }
+        return (ServeCommands(argv[0], serverSocket, threadCount) == 0) ? 0 : 1;
+    }
+
+    if (languageServer) {
+        bool longBranches = (arguments.size() == 1 && arguments[0] == "--long-branches");
+        if (!connectSocket.empty() || arguments.size() > (longBranches ? 1u : 0u)) {
+            PrintUsage(argv[0], std::cerr);
+            return 1;
+        }
+        return (ServeLanguage(longBranches) == 0) ? 0 : 1;
+    }
+
+    std::string source;
+    if (readsInput) {
+        std::ostringstream input;
+        input << std::cin.rdbuf();
+        source = input.str();
+    }
+
+    // A build that sets X4ASM_SERVER uses the server if one is running and runs here if not
+    // Command lines the server does not run, a watch or one it refuses, run here as well
+    const char* environmentSocket = std::getenv("X4ASM_SERVER");
+    bool required = !connectSocket.empty();
+    if (!required && environmentSocket != nullptr)
+        connectSocket = environmentSocket;
+    if (!connectSocket.empty()) {
+        int status;
+        int sent = RunOnServer(connectSocket, arguments, readsInput ? &source : nullptr, status);
+        if (sent == 0)
+            return status;
+        if (sent != SERVER_REFUSED && required) {
+            std::cerr << "Error: Could not reach the server at " << connectSocket << ".\n";
+            return 1;
+        }
+    }
+
+    IncludeCache includes;
+    x4::Assembler assembler;
+    CommandContext context = {argv[0], &includes, &assembler, readsInput ? &source : nullptr, false, std::cout, std::cerr};
+    return RunCommand(arguments, context);
+}
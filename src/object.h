@@ -0,0 +1,273 @@
+#ifndef _OBJECT_FILE__
+#define _OBJECT_FILE__
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "source.h"
+#include "writers.h"
+
+// Relocatable object file (.x4o)
+// Every field is a little endian 32-bit word, the layout is
+//   header       magic, version, section count, export count, import count, relocation count, string bytes
+//   sections     base, flags, size, then the bytes padded to a whole word
+//   exports      name offset, name length, section, value
+//   imports      name offset, name length
+//   relocations  section, offset, kind, target
+//   strings      every symbol name back to back
+
+#define OBJECT_MAGIC    0x4F345800      // "\0X4O"
+#define OBJECT_VERSION  1
+
+// Section flags
+#define SECTION_RELOCATABLE  0x01       // Placed by the linker, otherwise linked at its own base
+
+// Section of an absolute symbol
+#define SECTION_ABSOLUTE     0xFFFFFFFF
+
+// Relocation kinds, the 32-bit field receives
+#define RELOCATION_SECTION   0          // its value plus the final base of the target section
+#define RELOCATION_IMPORT    1          // the address of the target import
+
+struct ObjectSection {
+    uint32_t base;                      // Zero for a relocatable section
+    uint32_t flags;
+    std::vector<uint8_t> bytes;
+};
+
+struct ObjectSymbol {
+    std::string name;
+    uint32_t section;                   // Section index or SECTION_ABSOLUTE
+    uint32_t value;                     // Offset in the section or the absolute address
+};
+
+struct ObjectRelocation {
+    uint32_t section;                   // Section holding the field
+    uint32_t offset;                    // Offset of the field in the section
+    uint32_t kind;
+    uint32_t target;                    // Section index or import index
+};
+
+struct ObjectFile {
+    std::vector<ObjectSection> sections;
+    std::vector<ObjectSymbol> exports;
+    std::vector<std::string> imports;
+    std::vector<ObjectRelocation> relocations;
+
+    void clear() {
+        sections.clear();
+        exports.clear();
+        imports.clear();
+        relocations.clear();
+    }
+};
+
+
+inline uint8_t* PutObjectWord(uint8_t* output, uint32_t value) {
+    memcpy(output, &value, 4);
+    return output + 4;
+}
+
+/// Return the exact length of the serialized object.
+inline size_t ObjectSize(const ObjectFile& object) {
+    size_t size = 7 * 4;
+    for (unsigned int i=0; i < object.sections.size(); i++)
+        size += 3 * 4 + (object.sections[i].bytes.size() + 3) / 4 * 4;
+    size += object.exports.size() * 4 * 4 + object.imports.size() * 2 * 4 + object.relocations.size() * 4 * 4;
+    for (unsigned int i=0; i < object.exports.size(); i++)
+        size += object.exports[i].name.size();
+    for (unsigned int i=0; i < object.imports.size(); i++)
+        size += object.imports[i].size();
+    return size;
+}
+
+/// Serialize the object into a buffer of ObjectSize bytes.
+inline void FormatObject(const ObjectFile& object, uint8_t* output) {
+    uint32_t stringBytes = 0;
+    for (unsigned int i=0; i < object.exports.size(); i++)
+        stringBytes += object.exports[i].name.size();
+    for (unsigned int i=0; i < object.imports.size(); i++)
+        stringBytes += object.imports[i].size();
+
+    output = PutObjectWord(output, OBJECT_MAGIC);
+    output = PutObjectWord(output, OBJECT_VERSION);
+    output = PutObjectWord(output, object.sections.size());
+    output = PutObjectWord(output, object.exports.size());
+    output = PutObjectWord(output, object.imports.size());
+    output = PutObjectWord(output, object.relocations.size());
+    output = PutObjectWord(output, stringBytes);
+
+    for (unsigned int i=0; i < object.sections.size(); i++) {
+        const ObjectSection& section = object.sections[i];
+        output = PutObjectWord(output, section.base);
+        output = PutObjectWord(output, section.flags);
+        output = PutObjectWord(output, section.bytes.size());
+        size_t padded = (section.bytes.size() + 3) / 4 * 4;
+        if (section.bytes.size() > 0)
+            memcpy(output, section.bytes.data(), section.bytes.size());
+        memset(output + section.bytes.size(), 0, padded - section.bytes.size());
+        output += padded;
+    }
+
+    uint32_t name = 0;
+    for (unsigned int i=0; i < object.exports.size(); i++) {
+        output = PutObjectWord(output, name);
+        output = PutObjectWord(output, object.exports[i].name.size());
+        output = PutObjectWord(output, object.exports[i].section);
+        output = PutObjectWord(output, object.exports[i].value);
+        name += object.exports[i].name.size();
+    }
+    for (unsigned int i=0; i < object.imports.size(); i++) {
+        output = PutObjectWord(output, name);
+        output = PutObjectWord(output, object.imports[i].size());
+        name += object.imports[i].size();
+    }
+
+    for (unsigned int i=0; i < object.relocations.size(); i++) {
+        output = PutObjectWord(output, object.relocations[i].section);
+        output = PutObjectWord(output, object.relocations[i].offset);
+        output = PutObjectWord(output, object.relocations[i].kind);
+        output = PutObjectWord(output, object.relocations[i].target);
+    }
+
+    for (unsigned int i=0; i < object.exports.size(); i++) {
+        memcpy(output, object.exports[i].name.data(), object.exports[i].name.size());
+        output += object.exports[i].name.size();
+    }
+    for (unsigned int i=0; i < object.imports.size(); i++) {
+        memcpy(output, object.imports[i].data(), object.imports[i].size());
+        output += object.imports[i].size();
+    }
+}
+
+/// Write the object file, returns -1 if the file could not be written.
+inline int WriteObject(const std::string& filename, const ObjectFile& object) {
+    OutputFile output;
+    if (output.Open(filename, ObjectSize(object)) != 0)
+        return -1;
+    FormatObject(object, output.Data());
+    return output.Close();
+}
+
+
+// Reads words from a serialized object, every read is checked against the end
+struct ObjectReader {
+    const uint8_t* data;
+    size_t size;
+    size_t position;
+
+    bool Word(uint32_t& value) {
+        if (size - position < 4)
+            return false;
+        memcpy(&value, data + position, 4);
+        position += 4;
+        return true;
+    }
+
+    const uint8_t* Bytes(size_t count) {
+        if (size - position < count)
+            return nullptr;
+        const uint8_t* bytes = data + position;
+        position += count;
+        return bytes;
+    }
+};
+
+/// Parse a serialized object, returns -1 if it is not a valid object.
+inline int ParseObject(std::string_view text, ObjectFile& object) {
+    object.clear();
+
+    ObjectReader reader = {reinterpret_cast<const uint8_t*>(text.data()), text.size(), 0};
+    uint32_t magic, version, sectionCount, exportCount, importCount, relocationCount, stringBytes;
+    if (!reader.Word(magic) || !reader.Word(version) || magic != OBJECT_MAGIC || version != OBJECT_VERSION)
+        return -1;
+    if (!reader.Word(sectionCount) || !reader.Word(exportCount) || !reader.Word(importCount) ||
+        !reader.Word(relocationCount) || !reader.Word(stringBytes))
+        return -1;
+
+    // Counts larger than the file can hold are rejected before anything is allocated
+    if (sectionCount > text.size() / 12 || exportCount > text.size() / 16 ||
+        importCount > text.size() / 8 || relocationCount > text.size() / 16)
+        return -1;
+
+    object.sections.resize(sectionCount);
+    for (uint32_t i=0; i < sectionCount; i++) {
+        ObjectSection& section = object.sections[i];
+        uint32_t size;
+        if (!reader.Word(section.base) || !reader.Word(section.flags) || !reader.Word(size))
+            return -1;
+        const uint8_t* bytes = reader.Bytes((size_t(size) + 3) / 4 * 4);
+        if (bytes == nullptr)
+            return -1;
+        section.bytes.assign(bytes, bytes + size);
+    }
+
+    // Names are resolved once the string table position is known
+    std::vector<uint32_t> names((exportCount + importCount) * 2);
+    object.exports.resize(exportCount);
+    for (uint32_t i=0; i < exportCount; i++) {
+        if (!reader.Word(names[i * 2]) || !reader.Word(names[i * 2 + 1]) ||
+            !reader.Word(object.exports[i].section) || !reader.Word(object.exports[i].value))
+            return -1;
+    }
+    for (uint32_t i=exportCount; i < exportCount + importCount; i++) {
+        if (!reader.Word(names[i * 2]) || !reader.Word(names[i * 2 + 1]))
+            return -1;
+    }
+
+    object.relocations.resize(relocationCount);
+    for (uint32_t i=0; i < relocationCount; i++) {
+        ObjectRelocation& relocation = object.relocations[i];
+        if (!reader.Word(relocation.section) || !reader.Word(relocation.offset) ||
+            !reader.Word(relocation.kind) || !reader.Word(relocation.target))
+            return -1;
+    }
+
+    const uint8_t* strings = reader.Bytes(stringBytes);
+    if (strings == nullptr)
+        return -1;
+    for (uint32_t i=0; i < exportCount + importCount; i++) {
+        uint32_t offset = names[i * 2];
+        uint32_t length = names[i * 2 + 1];
+        if (offset > stringBytes || length > stringBytes - offset)
+            return -1;
+        std::string name(reinterpret_cast<const char*>(strings) + offset, length);
+        if (i < exportCount)
+            object.exports[i].name = std::move(name);
+        else
+            object.imports.push_back(std::move(name));
+    }
+
+    // Every reference must land inside the object
+    for (uint32_t i=0; i < exportCount; i++) {
+        const ObjectSymbol& symbol = object.exports[i];
+        if (symbol.section != SECTION_ABSOLUTE && symbol.section >= sectionCount)
+            return -1;
+    }
+    for (uint32_t i=0; i < relocationCount; i++) {
+        const ObjectRelocation& relocation = object.relocations[i];
+        if (relocation.section >= sectionCount || object.sections[relocation.section].bytes.size() < 4 ||
+            relocation.offset > object.sections[relocation.section].bytes.size() - 4)
+            return -1;
+        if (relocation.kind == RELOCATION_SECTION && relocation.target >= sectionCount)
+            return -1;
+        if (relocation.kind == RELOCATION_IMPORT && relocation.target >= importCount)
+            return -1;
+        if (relocation.kind > RELOCATION_IMPORT)
+            return -1;
+    }
+    return 0;
+}
+
+/// Read an object file, returns -1 if it could not be read or is not a valid object.
+inline int ReadObject(const std::string& filename, ObjectFile& object) {
+    SourceFile file;
+    if (file.Open(filename) != 0)
+        return -1;
+    return ParseObject(file.Text(), object);
+}
+
+#endif
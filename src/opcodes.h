@@ -0,0 +1,248 @@
+#ifndef _OPCODE_TABLE__
+#define _OPCODE_TABLE__
+
+#include <array>
+#include <cstdint>
+#include <string_view>
+
+#include "scanner.h"
+
+// Opcodes
+#define  NOP_OPCODE    0x90
+#define  MOVB_OPCODE   0x89
+#define  MOVR_OPCODE   0x88
+#define  MOVA_OPCODE   0x83
+#define  MOVMW_OPCODE  0x82
+#define  MOVMR_OPCODE  0x81
+
+#define  ADD_OPCODE    0x00
+#define  SUB_OPCODE    0x80
+#define  MUL_OPCODE    0xF6
+#define  DIV_OPCODE    0xF4
+#define  INC_OPCODE    0xFD
+#define  DEC_OPCODE    0xFC
+#define  CMP_OPCODE    0x38
+#define  CMPR_OPCODE   0x39
+#define  JMP_OPCODE    0xFE
+#define  JE_OPCODE     0x74
+#define  JNE_OPCODE    0xF3
+#define  JG_OPCODE     0x75
+#define  JL_OPCODE     0xF1
+#define  CALL_OPCODE   0x9A
+#define  RET_OPCODE    0xCB
+#define  PUSH_OPCODE   0xF0
+#define  POP_OPCODE    0x0F
+#define  INT_OPCODE    0xCD
+#define  STI_OPCODE    0xFB
+#define  CLI_OPCODE    0xFA
+
+// Relative forms of the branches, the displacement counts from the end of the instruction
+#define  JMP_SHORT_OPCODE   0xE0   // 8-bit displacement
+#define  JE_SHORT_OPCODE    0xE1
+#define  JNE_SHORT_OPCODE   0xE2
+#define  JG_SHORT_OPCODE    0xE3
+#define  JL_SHORT_OPCODE    0xE4
+#define  CALL_SHORT_OPCODE  0xE5
+#define  JMP_NEAR_OPCODE    0xE8   // 16-bit displacement
+#define  JE_NEAR_OPCODE     0xE9
+#define  JNE_NEAR_OPCODE    0xEA
+#define  JG_NEAR_OPCODE     0xEB
+#define  JL_NEAR_OPCODE     0xEC
+#define  CALL_NEAR_OPCODE   0xED
+
+// Operand forms
+#define  OPERAND_NONE      0   // NOP
+#define  OPERAND_REG8      1   // PUSH AL
+#define  OPERAND_IMM8      2   // INT 0x10
+#define  OPERAND_COMPARE   3   // CMP AL, BL  /  CMP AL, 0x10
+#define  OPERAND_MOVE      4   // MOV AL, BL  /  MOV AL, 0x10  /  MOV AX, $label  /  MOV AL, [var]
+#define  OPERAND_LABEL     5   // JMP label
+#define  OPERAND_STRING    6   // DB 'text', 0
+
+
+// Mnemonic, opcode, encoded size and cost of an instruction
+// X4 has no published timing, the costs are nominal weights that only rank the instructions against
+// each other, a move or a compare against a call or a division. The peephole report adds them up as an
+// estimate, they are not measured cycles.
+// Everything here is constexpr, the assembler and the compile time assembler share it.
+struct Opcode {
+    std::string_view mnemonic;
+    uint8_t opcode;
+    uint8_t operands;
+    uint8_t size;          // Encoded size in bytes, zero if it depends on the operands
+    uint8_t cycles;        // Nominal cost of the register or long form, a taken branch for the jumps
+};
+
+constexpr Opcode opcodeTable[] = {
+    {"NOP",  NOP_OPCODE,  OPERAND_NONE,    1,  1},
+    {"RET",  RET_OPCODE,  OPERAND_NONE,    1,  4},
+    {"CLI",  CLI_OPCODE,  OPERAND_NONE,    1,  1},
+    {"STI",  STI_OPCODE,  OPERAND_NONE,    1,  1},
+
+    {"ADD",  ADD_OPCODE,  OPERAND_NONE,    3,  2},
+    {"SUB",  SUB_OPCODE,  OPERAND_NONE,    3,  2},
+    {"MUL",  MUL_OPCODE,  OPERAND_NONE,    4,  8},
+    {"DIV",  DIV_OPCODE,  OPERAND_NONE,    4, 12},
+    {"INC",  INC_OPCODE,  OPERAND_NONE,    2,  1},
+    {"DEC",  DEC_OPCODE,  OPERAND_NONE,    2,  1},
+
+    {"PUSH", PUSH_OPCODE, OPERAND_REG8,    2,  3},
+    {"POP",  POP_OPCODE,  OPERAND_REG8,    2,  3},
+    {"INT",  INT_OPCODE,  OPERAND_IMM8,    2,  8},
+    {"CMP",  CMP_OPCODE,  OPERAND_COMPARE, 3,  2},
+    {"MOV",  MOVB_OPCODE, OPERAND_MOVE,    0,  2},
+
+    {"JMP",  JMP_OPCODE,  OPERAND_LABEL,   5,  3},
+    {"JE",   JE_OPCODE,   OPERAND_LABEL,   5,  3},
+    {"JNE",  JNE_OPCODE,  OPERAND_LABEL,   5,  3},
+    {"JG",   JG_OPCODE,   OPERAND_LABEL,   5,  3},
+    {"JL",   JL_OPCODE,   OPERAND_LABEL,   5,  3},
+    {"CALL", CALL_OPCODE, OPERAND_LABEL,   5,  5},
+
+    {"DB",   0x00,        OPERAND_STRING,  0,  0},   // Data directive, no opcode
+};
+
+constexpr uint32_t opcodeCount = sizeof(opcodeTable) / sizeof(Opcode);
+
+#define OPCODE_NOT_FOUND  0xFFFFFFFF
+
+
+// Perfect hash over the mnemonics
+// The seed is searched at compile time so that no two mnemonics share a slot
+
+#define INSTRUCTION_HASH_SLOTS  64
+
+constexpr uint32_t MnemonicHash(std::string_view mnemonic, uint32_t seed) {
+    uint32_t hash = seed;
+    for (char ch : mnemonic) {
+        hash ^= (uint8_t)ch;
+        hash *= 16777619u;
+    }
+    return (hash ^ (hash >> 15)) & (INSTRUCTION_HASH_SLOTS - 1);
+}
+
+constexpr uint32_t FindMnemonicSeed() {
+    for (uint32_t seed = 1;; seed++) {
+        uint64_t used = 0;
+        bool collision = false;
+        for (uint32_t i=0; i < opcodeCount; i++) {
+            uint64_t bit = 1ull << MnemonicHash(opcodeTable[i].mnemonic, seed);
+            if (used & bit) {collision = true; break;}
+            used |= bit;
+        }
+        if (!collision)
+            return seed;
+    }
+}
+
+constexpr uint32_t mnemonicSeed = FindMnemonicSeed();
+
+// Slot to table index plus one, zero marks an empty slot
+constexpr std::array<uint8_t, INSTRUCTION_HASH_SLOTS> BuildMnemonicSlots() {
+    std::array<uint8_t, INSTRUCTION_HASH_SLOTS> slots = {};
+    for (uint32_t i=0; i < opcodeCount; i++)
+        slots[MnemonicHash(opcodeTable[i].mnemonic, mnemonicSeed)] = i + 1;
+    return slots;
+}
+
+constexpr std::array<uint8_t, INSTRUCTION_HASH_SLOTS> mnemonicSlots = BuildMnemonicSlots();
+
+static_assert(INSTRUCTION_HASH_SLOTS <= 64, "Seed search tracks the slots in a 64-bit mask");
+
+
+// Return the table index of a mnemonic or OPCODE_NOT_FOUND
+constexpr uint32_t FindOpcode(std::string_view mnemonic) {
+    uint8_t slot = mnemonicSlots[MnemonicHash(mnemonic, mnemonicSeed)];
+    if (slot == 0 || opcodeTable[slot - 1].mnemonic != mnemonic)
+        return OPCODE_NOT_FOUND;
+    return slot - 1;
+}
+
+
+// Branch forms
+#define  BRANCH_SHORT  0   // Opcode and an 8-bit displacement
+#define  BRANCH_NEAR   1   // Opcode and a 16-bit displacement
+#define  BRANCH_LONG   2   // Opcode and the 32-bit address of the label
+
+constexpr uint32_t BranchSize(uint8_t form) {
+    return (form == BRANCH_SHORT) ? 2 : (form == BRANCH_NEAR) ? 3 : 5;
+}
+
+// Return the opcode of a branch in a form, the long opcode is the one in the table
+constexpr uint8_t BranchOpcode(uint8_t opcode, uint8_t form) {
+    if (form == BRANCH_LONG)
+        return opcode;
+    uint8_t base = (form == BRANCH_SHORT) ? JMP_SHORT_OPCODE : JMP_NEAR_OPCODE;
+    switch (opcode) {
+        case JMP_OPCODE:  return base + 0;
+        case JE_OPCODE:   return base + 1;
+        case JNE_OPCODE:  return base + 2;
+        case JG_OPCODE:   return base + 3;
+        case JL_OPCODE:   return base + 4;
+        case CALL_OPCODE: return base + 5;
+    }
+    return opcode;
+}
+
+
+// Return the number of operands, quoted text counts as one operand
+constexpr uint32_t OperandCount(const Statement& statement) {
+    if (statement.tokenCount == 0)
+        return 0;
+    return statement.tokenCount - 1 + (statement.hasString ? 1 : 0);
+}
+
+// Return an operand by index, quoted text is returned with its quotes
+constexpr std::string_view GetOperand(const Statement& statement, uint32_t index) {
+    uint32_t tokenIndex = index + 1;
+    if (statement.hasString) {
+        if (tokenIndex == statement.stringToken)
+            return std::string_view(statement.string.data() - 1, statement.string.length() + (statement.closedString ? 2 : 1));
+        if (tokenIndex > statement.stringToken)
+            tokenIndex--;
+    }
+    return statement.token[tokenIndex];
+}
+
+// Check if any operand of a statement contains a character
+constexpr bool OperandContains(const Statement& statement, char character) {
+    for (uint32_t i=1; i < statement.tokenCount; i++)
+        if (statement.token[i].find(character) != std::string_view::npos)
+            return true;
+    return false;
+}
+
+// Check if a DB statement asks for a null terminator after its string
+constexpr bool StringTerminated(const Statement& statement) {
+    for (uint32_t i=statement.stringToken; i < statement.tokenCount; i++)
+        if (statement.token[i].find('0') != std::string_view::npos)
+            return true;
+    return false;
+}
+
+// Return the number of bytes an instruction encodes into
+constexpr uint32_t InstructionSize(const Opcode& instruction, const Statement& statement) {
+    if (instruction.size != 0)
+        return instruction.size;
+
+    // Check MOV sub type
+    if (instruction.operands == OPERAND_MOVE) {
+        if (OperandContains(statement, '[') &&
+            OperandContains(statement, ']'))
+            return 6;  // Memory move
+        if (OperandContains(statement, '$'))
+            return 6;  // Address move
+        return 3;      // Byte/register move
+    }
+
+    // String bytes plus an optional terminator
+    if (instruction.operands == OPERAND_STRING) {
+        if (!statement.hasString)
+            return 0;
+        return statement.string.length() + (StringTerminated(statement) ? 1 : 0);
+    }
+
+    return 0;
+}
+
+#endif
@@ -0,0 +1,382 @@
+#ifndef _PEEPHOLE_OPTIMIZER__
+#define _PEEPHOLE_OPTIMIZER__
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "types.h"
+#include "arena.h"
+#include "opcodes.h"
+#include "registers.h"
+#include "scanner.h"
+#include "symbols.h"
+
+// Rules
+#define PEEPHOLE_SELF_MOVE      0   // MOV AL, AL
+#define PEEPHOLE_JUMP_TO_NEXT   1   // JMP L  followed by  L:
+#define PEEPHOLE_JUMP_CHAIN     2   // JMP L  to  L: JMP M  jumps to M
+#define PEEPHOLE_PUSH_POP       3   // PUSH AL  followed by  POP AL
+#define PEEPHOLE_REPEATED_CMP   4   // CMP AL, BL  JE L  CMP AL, BL
+#define PEEPHOLE_RULES          5
+
+// Kinds of the IR nodes
+#define PEEP_OTHER    0   // Nothing a rule looks into
+#define PEEP_ORIGIN   1   // ORG and the end of the program, nothing falls through it
+#define PEEP_MOVE     2   // Register to register move
+#define PEEP_PUSH     3
+#define PEEP_POP      4
+#define PEEP_COMPARE  5
+#define PEEP_JUMP     6
+#define PEEP_BRANCH   7   // Conditional jump, it leaves the flags alone
+#define PEEP_CALL     8
+
+#define PEEPHOLE_NONE  0xFFFFFFFF
+
+constexpr const char* peepholeRuleNames[PEEPHOLE_RULES] = {
+    "self move", "jump to next", "jump chain", "push pop", "repeated compare",
+};
+
+// What the rules did to one program
+struct PeepholeReport {
+    uint32_t rewrites[PEEPHOLE_RULES];
+    uint64_t bytes[PEEPHOLE_RULES];     // Of the long encoding, before the branches are relaxed
+    uint64_t cycles[PEEPHOLE_RULES];    // Estimated saving of one run through the rewritten code, in the nominal costs of opcodeTable
+    uint32_t passes;
+};
+
+
+// Peephole optimizer over the parsed lines of a program
+// Every instruction is decoded once into a compact node and every label into the node it stands
+// before. The rules rewrite the nodes until no rule applies, then the lines are emitted again: a
+// removed instruction leaves its label behind and a retargeted branch names its new label. The
+// line count stays the same, so the diagnostics of the assembly point into the source as written.
+// Labels keep their meaning. An instruction is only removed where going on to the next one does
+// the same, and no rule reasons across an instruction a label stands before.
+class PeepholeOptimizer {
+
+public:
+
+    PeepholeOptimizer() : labels(&arena), report() {}
+
+    PeepholeOptimizer(const PeepholeOptimizer&) = delete;
+    PeepholeOptimizer& operator=(const PeepholeOptimizer&) = delete;
+
+    /// Rewrite the lines of a program into output, which holds views of the source lines and of the
+    /// optimizer. Returns the number of rewrites.
+    uint32_t Optimize(const ScanResult& source, ScanResult& output) {
+        report = PeepholeReport();
+        Decode(source);
+
+        bool rewritten = true;
+        while (rewritten) {
+            rewritten = false;
+            report.passes++;
+            for (uint32_t i=0; i < nodes.size(); i++)
+                if (!nodes[i].removed && Rewrite(i))
+                    rewritten = true;
+        }
+
+        Emit(source, output);
+        uint32_t rewrites = 0;
+        for (uint32_t rule=0; rule < PEEPHOLE_RULES; rule++)
+            rewrites += report.rewrites[rule];
+        return rewrites;
+    }
+
+    const PeepholeReport& Report() const {return report;}
+
+private:
+
+    struct Node {
+        uint32_t line;                  // PEEPHOLE_NONE for the end of the program
+        uint32_t labelsBefore;          // Labels standing right before the node
+        uint32_t label;                 // Symbol a branch goes to, PEEPHOLE_NONE if there is none
+        std::string_view target;        // Name of that label as the source writes it
+        std::string_view operands[2];   // As written, the written branch target is the first
+        uint8_t kind;
+        uint8_t registerA;
+        uint8_t registerB;
+        uint8_t size;
+        uint8_t cycles;
+        bool removed;
+        bool retargeted;
+    };
+
+    Arena arena;
+    SymbolTable labels;                 // The byte offset of a label is the node it stands before
+    std::vector<Node> nodes;
+    std::string text;                   // Rewritten lines
+    PeepholeReport report;
+
+    // Build the nodes the way Assembler::AssembleLines walks the lines
+    void Decode(const ScanResult& source) {
+        labels.clear();
+        arena.Reset();
+        nodes.clear();
+
+        Statement statement;
+        bool textFound = false;
+        uint32_t pending = 0;               // Labels waiting for the next node
+        for (uint32_t index=0; index < source.lines.size(); index++) {
+            uint32_t firstMark = source.lineMarks[index];
+            ParseStatement(source.lines[index], source.marks.data() + firstMark, source.lineMarks[index + 1] - firstMark, statement);
+
+            if (statement.tokenCount == 0 && statement.label.empty())
+                continue;
+            if (statement.tokenCount > 0 && statement.token[0] == "section") {
+                if (statement.tokenCount > 1 && statement.token[1] == ".text")
+                    textFound = true;
+                continue;
+            }
+            if (!textFound && statement.hasEquals)
+                continue;
+
+            // A label on the line of an ORG names the new address
+            if (statement.tokenCount > 0 && statement.token[0] == "ORG")
+                Push(MakeNode(index, PEEP_ORIGIN, 0, 0), pending);
+            if (!statement.label.empty() && labels.Insert(statement.label, nodes.size()) != SYMBOL_NOT_FOUND)
+                pending++;
+
+            if (statement.tokenCount == 0 || statement.token[0] == "ORG")
+                continue;
+            uint32_t opcode = FindOpcode(statement.token[0]);
+            if (opcode == OPCODE_NOT_FOUND)
+                continue;
+            const Opcode& instruction = opcodeTable[opcode];
+            Push(DecodeInstruction(index, instruction, statement), pending);
+        }
+        Push(MakeNode(PEEPHOLE_NONE, PEEP_ORIGIN, 0, 0), pending);
+    }
+
+    void Push(const Node& node, uint32_t& pending) {
+        nodes.push_back(node);
+        nodes.back().labelsBefore = pending;
+        pending = 0;
+    }
+
+    static Node MakeNode(uint32_t line, uint8_t kind, uint32_t size, uint32_t cycles) {
+        Node node = {};
+        node.line = line;
+        node.label = PEEPHOLE_NONE;
+        node.kind = kind;
+        node.size = size;
+        node.cycles = cycles;
+        return node;
+    }
+
+    Node DecodeInstruction(uint32_t line, const Opcode& instruction, const Statement& statement) {
+        uint32_t size = InstructionSize(instruction, statement);
+        Node node = MakeNode(line, PEEP_OTHER, size > 0xFF ? 0xFF : size, instruction.cycles);
+
+        switch (instruction.opcode) {
+            case MOVB_OPCODE:
+                if (OperandCount(statement) < 2)
+                    break;
+                node.registerA = get_register_code(GetOperand(statement, 0));
+                node.registerB = get_register_code(GetOperand(statement, 1));
+                if (node.registerA != 0xFF && node.registerB != 0xFF)
+                    node.kind = PEEP_MOVE;
+                break;
+
+            case PUSH_OPCODE:
+            case POP_OPCODE:
+                if (statement.tokenCount < 2)
+                    break;
+                node.registerA = get_register_code(statement.token[1]);
+                if (node.registerA != 0xFF)
+                    node.kind = (instruction.opcode == PUSH_OPCODE) ? PEEP_PUSH : PEEP_POP;
+                break;
+
+            // Only a compare that assembles, removing a copy must not hide an error
+            case CMP_OPCODE: {
+                if (OperandCount(statement) < 2)
+                    break;
+                node.operands[0] = GetOperand(statement, 0);
+                node.operands[1] = GetOperand(statement, 1);
+                uint32_t value = 0;
+                if (get_register_code(node.operands[0]) != 0xFF &&
+                    (get_register_code(node.operands[1]) != 0xFF || ParseLiteral(node.operands[1], 8, value) == LITERAL_OK))
+                    node.kind = PEEP_COMPARE;
+                break;
+            }
+
+            case JMP_OPCODE:
+            case JE_OPCODE:
+            case JNE_OPCODE:
+            case JG_OPCODE:
+            case JL_OPCODE:
+            case CALL_OPCODE:
+                if (statement.tokenCount < 2)
+                    break;
+                node.kind = (instruction.opcode == JMP_OPCODE) ? PEEP_JUMP : (instruction.opcode == CALL_OPCODE) ? PEEP_CALL : PEEP_BRANCH;
+                node.label = labels.Reference(statement.token[1]);
+                node.target = statement.token[1];
+                node.operands[0] = statement.token[1];
+                break;
+        }
+        return node;
+    }
+
+    // The node a position runs into, removed nodes are skipped. The end of the program is never removed.
+    uint32_t Live(uint32_t position) const {
+        while (nodes[position].removed)
+            position++;
+        return position;
+    }
+
+    // Node a label stands before, PEEPHOLE_NONE if it is not defined
+    uint32_t LabelNode(uint32_t label) const {
+        if (label == PEEPHOLE_NONE || !labels[label].defined)
+            return PEEPHOLE_NONE;
+        return Live(labels[label].byteOffset);
+    }
+
+    // True if a label stands before any node after the first up to the last
+    bool Labeled(uint32_t first, uint32_t last) const {
+        for (uint32_t i=first + 1; i <= last; i++)
+            if (nodes[i].labelsBefore > 0)
+                return true;
+        return false;
+    }
+
+    void Remove(uint32_t i, uint32_t rule) {
+        nodes[i].removed = true;
+        report.bytes[rule] += nodes[i].size;
+        report.cycles[rule] += nodes[i].cycles;
+    }
+
+    // Apply the first rule that fits a node, returns true if one did
+    bool Rewrite(uint32_t i) {
+        Node& node = nodes[i];
+        uint32_t next = Live(i + 1);
+
+        switch (node.kind) {
+            case PEEP_MOVE:
+                if (node.registerA != node.registerB)
+                    return false;
+                Remove(i, PEEPHOLE_SELF_MOVE);
+                report.rewrites[PEEPHOLE_SELF_MOVE]++;
+                return true;
+
+            case PEEP_PUSH:
+                if (nodes[next].kind != PEEP_POP || nodes[next].registerA != node.registerA || Labeled(i, next))
+                    return false;
+                Remove(i, PEEPHOLE_PUSH_POP);
+                Remove(next, PEEPHOLE_PUSH_POP);
+                report.rewrites[PEEPHOLE_PUSH_POP]++;
+                return true;
+
+            // The branches between two compares leave the flags as the first one set them
+            case PEEP_COMPARE: {
+                uint32_t later = next;
+                while (nodes[later].kind == PEEP_BRANCH)
+                    later = Live(later + 1);
+                const Node& compare = nodes[later];
+                if (compare.kind != PEEP_COMPARE || compare.operands[0] != node.operands[0] ||
+                    compare.operands[1] != node.operands[1] || Labeled(i, later))
+                    return false;
+                Remove(later, PEEPHOLE_REPEATED_CMP);
+                report.rewrites[PEEPHOLE_REPEATED_CMP]++;
+                return true;
+            }
+
+            case PEEP_JUMP:
+            case PEEP_BRANCH:
+                if (LabelNode(node.label) == next) {
+                    Remove(i, PEEPHOLE_JUMP_TO_NEXT);
+                    report.rewrites[PEEPHOLE_JUMP_TO_NEXT]++;
+                    return true;
+                }
+                return Retarget(node);
+
+            case PEEP_CALL:
+                return Retarget(node);
+        }
+        return false;
+    }
+
+    // Send a branch to a jump straight to where the jump goes, a loop of jumps is left alone
+    bool Retarget(Node& node) {
+        uint32_t label = node.label;
+        std::string_view target = node.target;
+        uint32_t hops = 0;
+        uint64_t cycles = 0;
+        while (true) {
+            uint32_t position = LabelNode(label);
+            if (position == PEEPHOLE_NONE)
+                break;
+            const Node& jump = nodes[position];
+            if (jump.kind != PEEP_JUMP || LabelNode(jump.label) == PEEPHOLE_NONE)
+                break;
+            if (hops == nodes.size())
+                return false;
+            label = jump.label;
+            target = jump.target;
+            cycles += jump.cycles;
+            hops++;
+        }
+        if (hops == 0)
+            return false;
+
+        node.label = label;
+        node.target = target;
+        node.retargeted = true;
+        report.rewrites[PEEPHOLE_JUMP_CHAIN]++;
+        report.cycles[PEEPHOLE_JUMP_CHAIN] += cycles;
+        return true;
+    }
+
+    // Write the lines again, only the rewritten ones are copied
+    void Emit(const ScanResult& source, ScanResult& output) {
+        std::vector<uint32_t> rewritten;        // Line, start in the text
+        text.clear();
+        for (uint32_t i=0; i < nodes.size(); i++) {
+            const Node& node = nodes[i];
+            if (!node.removed && !node.retargeted)
+                continue;
+            std::string_view line = source.lines[node.line];
+            rewritten.push_back(node.line);
+            rewritten.push_back(text.length());
+
+            // A removed instruction leaves what is before its mnemonic, the label
+            Statement statement;
+            uint32_t firstMark = source.lineMarks[node.line];
+            ParseStatement(line, source.marks.data() + firstMark, source.lineMarks[node.line + 1] - firstMark, statement);
+            if (node.removed) {
+                text.append(line.data(), statement.token[0].data() - line.data());
+            } else {
+                size_t column = node.operands[0].data() - line.data();
+                text.append(line.data(), column);
+                text.append(node.target.data(), node.target.length());
+                text.append(line.data() + column + node.operands[0].length(), line.length() - column - node.operands[0].length());
+            }
+        }
+        rewritten.push_back(source.lines.size());
+        rewritten.push_back(text.length());
+
+        output.lines.clear();
+        output.marks.clear();
+        output.lineMarks.clear();
+        output.lineMarks.push_back(0);
+        uint32_t next = 0;
+        for (uint32_t index=0; index < source.lines.size(); index++) {
+            if (index != rewritten[next]) {
+                output.lines.push_back(source.lines[index]);
+                output.marks.insert(output.marks.end(), source.marks.begin() + source.lineMarks[index], source.marks.begin() + source.lineMarks[index + 1]);
+            } else {
+                std::string_view line(text.data() + rewritten[next + 1], rewritten[next + 3] - rewritten[next + 1]);
+                output.lines.push_back(line);
+                for (uint32_t i=0; i < line.length(); i++)
+                    if (delimiterTable[(uint8_t)line[i]])
+                        output.marks.push_back(i);
+                next += 2;
+            }
+            output.lineMarks.push_back(output.marks.size());
+        }
+    }
+
+};
+
+#endif
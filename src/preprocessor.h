@@ -0,0 +1,626 @@
+#ifndef _SOURCE_PREPROCESSOR__
+#define _SOURCE_PREPROCESSOR__
+
+#include <cstdint>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "scanner.h"
+#include "source.h"
+#include "stats.h"
+
+// Deepest nesting of includes and macro expansions
+#define MAX_PREPROCESS_DEPTH  32
+
+// Directives handled before assembly, a source without any of them is passed through as scanned
+//   INCLUDE 'file'           insert a file, searched next to the including file then in the include directories
+//   MACRO name a, b ... ENDM define a macro, its parameters are replaced by whole tokens outside quotes
+//   DEFINE name              define a preprocessor symbol
+//   IFDEF name, IFNDEF name  assemble the following lines if the symbol is (not) defined
+//   ELSE, ENDIF
+
+// Every directive that opens a block contains one of these, each starts with a letter rare in code
+// so the search for it stops less often. A false match only costs a full preprocessing pass.
+const char* const preprocessorNeedles[] = {"FDEF", "FNDEF", "FINE", "RO", "UDE"};
+
+
+// What tells one version of a file from another without reading it
+struct FileIdentity {
+    uint64_t device;
+    uint64_t inode;
+    uint64_t size;
+    int64_t modified;                               // Nanoseconds
+
+    bool operator==(const FileIdentity& other) const {
+        return device == other.device && inode == other.inode && size == other.size && modified == other.modified;
+    }
+};
+
+/// Identify the file at a path, returns -1 if there is none.
+/// Without POSIX stat every file is the same version for as long as it is cached.
+inline int IdentifyFile(const std::string& path, FileIdentity& identity) {
+    identity = FileIdentity{0, 0, 0, 0};
+#ifdef SOURCE_MMAP
+    struct stat info;
+    if (stat(path.c_str(), &info) != 0)
+        return -1;
+    identity.device = info.st_dev;
+    identity.inode = info.st_ino;
+    identity.size = info.st_size;
+#ifdef __APPLE__
+    identity.modified = (int64_t)info.st_mtimespec.tv_sec * 1000000000 + info.st_mtimespec.tv_nsec;
+#else
+    identity.modified = (int64_t)info.st_mtim.tv_sec * 1000000000 + info.st_mtim.tv_nsec;
+#endif
+#else
+    (void)path;
+#endif
+    return 0;
+}
+
+// Source file loaded and scanned once per version
+struct IncludedFile {
+    SourceFile file;
+    ScanResult scan;
+    FileIdentity identity;
+    bool valid;
+    std::once_flag loaded;
+
+    IncludedFile() : identity{0, 0, 0, 0}, valid(false) {}
+};
+
+// Every file included during a run, shared by the threads of a batch
+// A cache that outlives a run, as a server's does, checks the identity of a file every time it is
+// asked for and loads it again once it changed. Preprocessors hold the versions they read, so a
+// file reloaded for one request never changes under another one.
+class IncludeCache {
+
+public:
+
+    explicit IncludeCache(bool revalidate = false) : revalidate(revalidate) {}
+
+    /// Return the scanned file or nullptr if it could not be read. The first caller loads it,
+    /// the others wait for it.
+    std::shared_ptr<const IncludedFile> Load(const std::string& path, Stats* stats) {
+        std::string key = path;
+        FileIdentity identity = FileIdentity{0, 0, 0, 0};
+        bool exists = true;
+        if (revalidate) {
+            key = AbsolutePath(path);
+            exists = (IdentifyFile(path, identity) == 0);
+        }
+
+        std::shared_ptr<IncludedFile> entry;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            std::shared_ptr<IncludedFile>& slot = files[key];
+            if (slot == nullptr || (revalidate && (!exists || !(slot->identity == identity)))) {
+                slot = std::make_shared<IncludedFile>();
+                slot->identity = identity;
+            }
+            entry = slot;
+        }
+
+        IncludedFile* loading = entry.get();
+        std::call_once(entry->loaded, [loading, &path, stats]() {
+            {
+                ScopedTimer timer(stats, "load");
+                loading->valid = (loading->file.Open(path) == 0);
+            }
+            if (loading->valid) {
+                ScopedTimer timer(stats, "lex");
+                ScanSource(loading->file.Text(), loading->scan);
+            }
+        });
+        if (!entry->valid)
+            return nullptr;
+        return entry;
+    }
+
+private:
+
+    bool revalidate;
+    std::mutex mutex;
+    std::unordered_map<std::string, std::shared_ptr<IncludedFile>> files;
+
+    // Relative paths of requests run in different directories name different files
+    static std::string AbsolutePath(const std::string& path) {
+#ifdef SOURCE_MMAP
+        if (!path.empty() && path[0] != '/') {
+            char directory[4096];
+            if (getcwd(directory, sizeof(directory)) != nullptr)
+                return std::string(directory) + "/" + path;
+        }
+#endif
+        return path;
+    }
+
+};
+
+
+struct PreprocessOptions {
+    IncludeCache* cache;                            // Shared cache, nullptr gives every preprocessor its own
+    std::vector<std::string> includeDirectories;
+    std::vector<std::string> defines;
+
+    PreprocessOptions() : cache(nullptr) {}
+};
+
+// File and zero based line a preprocessed line came from, lines of a macro come from its invocation
+struct LineOrigin {
+    uint32_t file;
+    uint32_t line;
+};
+
+struct PreprocessError {
+    LineOrigin origin;
+    std::string message;
+};
+
+
+// Preprocessor in front of the assembler
+// The output is a ScanResult whose lines point into the main file, the cached includes and
+// the macro expansions, so the preprocessor must outlive the assembly of its lines.
+// Each expansion is kept by macro and arguments, a repeated invocation reuses its scanned lines.
+class Preprocessor {
+
+public:
+
+    Preprocessor(const PreprocessOptions& options, Stats* stats) :
+        includeDirectories(options.includeDirectories),
+        cache(options.cache != nullptr ? options.cache : &ownCache),
+        stats(stats),
+        passThrough(false),
+        mainScanned(false) {
+        for (unsigned int i=0; i < options.defines.size(); i++)
+            defines.insert(options.defines[i]);
+    }
+
+    Preprocessor(const Preprocessor&) = delete;
+    Preprocessor& operator=(const Preprocessor&) = delete;
+
+    /// Load the main file, returns -1 if it could not be opened.
+    int Open(const std::string& filename) {
+        files.push_back(filename);
+        fileIndex[filename] = 0;
+        ScopedTimer timer(stats, "load");
+        if (mainFile.Open(filename) != 0)
+            return -1;
+        mainText = mainFile.Text();
+        return 0;
+    }
+
+    /// Take the main file from memory, the text must outlive the preprocessor.
+    void OpenText(const std::string& filename, std::string_view text) {
+        files.push_back(filename);
+        fileIndex[filename] = 0;
+        mainText = text;
+    }
+
+    /// Expand the main file, returns -1 and fills Errors() if it could not be preprocessed.
+    int Run() {
+        ScopedTimer timer(stats, "preprocess");
+
+        passThrough = !NeedsPreprocessing(mainText);
+        if (passThrough)
+            return 0;
+
+        ScanMain();
+        output.lines.reserve(mainScan.lines.size());
+        output.marks.reserve(mainScan.marks.size());
+        output.lineMarks.reserve(mainScan.lineMarks.size());
+        output.lineMarks.push_back(0);
+        origins.reserve(mainScan.lines.size());
+
+        Process(mainScan, 0, mainScan.lines.size(), 0, nullptr, 0);
+        return errors.empty() ? 0 : -1;
+    }
+
+    /// Preprocessed lines, ready for the assembler.
+    /// A file passed through is scanned here, a caller that only needs its text never pays for the scan.
+    const ScanResult& Lines() const {
+        if (!passThrough)
+            return output;
+        ScanMain();
+        return mainScan;
+    }
+
+    /// Origin of a preprocessed line, a line past the end is placed after the main file.
+    LineOrigin Origin(uint32_t line) const {
+        if (passThrough || line >= origins.size())
+            return LineOrigin{0, passThrough ? line : (uint32_t)mainScan.lines.size()};
+        return origins[line];
+    }
+
+    /// True when the main file had nothing to expand, its text is then the whole preprocessed source.
+    bool PassedThrough() const {return passThrough;}
+    std::string_view MainText() const {return mainText;}
+
+    const std::string& FileName(uint32_t file) const {return files[file];}
+
+    /// The main file followed by every file it included, each named once.
+    const std::vector<std::string>& Dependencies() const {return files;}
+
+    const std::vector<PreprocessError>& Errors() const {return errors;}
+
+    /// True if the text may hold a directive, text without one is the preprocessed source as it is.
+    static bool NeedsPreprocessing(std::string_view text) {
+        for (unsigned int i=0; i < sizeof(preprocessorNeedles) / sizeof(preprocessorNeedles[0]); i++)
+            if (text.find(preprocessorNeedles[i]) != std::string_view::npos)
+                return true;
+        return false;
+    }
+
+private:
+
+    struct Macro {
+        const ScanResult* source;           // Lines of the body, in a file or an expansion
+        uint32_t first;
+        uint32_t last;
+        std::vector<std::string> parameters;
+    };
+
+    struct Expansion {
+        std::string text;
+        ScanResult scan;
+    };
+
+    struct Conditional {
+        bool parentActive;
+        bool taken;
+        bool hasElse;
+        LineOrigin origin;
+    };
+
+    std::vector<std::string> includeDirectories;
+    IncludeCache ownCache;
+    IncludeCache* cache;
+    Stats* stats;
+
+    SourceFile mainFile;
+    std::string_view mainText;
+    mutable ScanResult mainScan;
+    bool passThrough;
+    mutable bool mainScanned;
+
+    ScanResult output;
+    std::vector<LineOrigin> origins;
+
+    std::vector<std::string> files;
+    std::unordered_map<std::string, uint32_t> fileIndex;
+    std::unordered_set<std::string> defines;
+    std::unordered_map<std::string, Macro> macros;
+    std::unordered_map<std::string, std::unique_ptr<Expansion>> expansions;
+    std::vector<PreprocessError> errors;
+    std::vector<std::shared_ptr<const IncludedFile>> includedFiles;     // The output points into them
+
+    // Reused by every invocation, never held across a nested expansion
+    std::vector<std::string> arguments;
+    std::string key;
+
+    void ScanMain() const {
+        if (mainScanned)
+            return;
+        ScopedTimer timer(stats, "lex");
+        ScanSource(mainText, mainScan);
+        mainScanned = true;
+    }
+
+    int Error(LineOrigin origin, std::string message) {
+        errors.push_back(PreprocessError{origin, std::move(message)});
+        return -1;
+    }
+
+    // Copy a scanned line to the output, or only its first length characters
+    void AppendLine(const ScanResult& source, uint32_t index, LineOrigin origin, size_t length = std::string_view::npos) {
+        std::string_view line = source.lines[index];
+        uint32_t firstMark = source.lineMarks[index];
+        uint32_t lastMark = source.lineMarks[index + 1];
+        if (length < line.size()) {
+            line = line.substr(0, length);
+            while (lastMark > firstMark && source.marks[lastMark - 1] >= length)
+                lastMark--;
+        }
+
+        output.lines.push_back(line);
+        output.marks.insert(output.marks.end(), source.marks.begin() + firstMark, source.marks.begin() + lastMark);
+        output.lineMarks.push_back(output.marks.size());
+        origins.push_back(origin);
+    }
+
+    // Keep the label of a line the preprocessor consumes, the colon follows the label directly
+    void AppendLabel(const ScanResult& source, uint32_t index, const Statement& statement, LineOrigin origin) {
+        if (statement.label.empty())
+            return;
+        size_t length = (statement.label.data() - source.lines[index].data()) + statement.label.size() + 1;
+        AppendLine(source, index, origin, length);
+    }
+
+    static bool IsDirective(std::string_view token) {
+        return token == "INCLUDE" || token == "MACRO" || token == "ENDM" || token == "DEFINE" ||
+               token == "IFDEF" || token == "IFNDEF" || token == "ELSE" || token == "ENDIF";
+    }
+
+    uint32_t FileIndex(const std::string& path) {
+        std::unordered_map<std::string, uint32_t>::iterator found = fileIndex.find(path);
+        if (found != fileIndex.end())
+            return found->second;
+        files.push_back(path);
+        fileIndex[path] = files.size() - 1;
+        return files.size() - 1;
+    }
+
+    // Find an included file next to the file including it, then in the include directories
+    const IncludedFile* FindInclude(std::string_view name, uint32_t from, uint32_t& index) {
+        std::vector<std::string> candidates;
+        if (!name.empty() && name[0] == '/') {
+            candidates.push_back(std::string(name));
+        } else {
+            const std::string& including = files[from];
+            size_t slash = including.find_last_of("/\\");
+            candidates.push_back((slash == std::string::npos ? std::string() : including.substr(0, slash + 1)) + std::string(name));
+            for (unsigned int i=0; i < includeDirectories.size(); i++)
+                candidates.push_back(includeDirectories[i] + "/" + std::string(name));
+        }
+
+        for (unsigned int i=0; i < candidates.size(); i++) {
+            std::shared_ptr<const IncludedFile> included = cache->Load(candidates[i], stats);
+            if (included != nullptr) {
+                index = FileIndex(candidates[i]);
+                includedFiles.push_back(included);
+                return included.get();
+            }
+        }
+        return nullptr;
+    }
+
+    // Replace every parameter token of a body line outside quoted text
+    static void Substitute(std::string_view line, const uint32_t* marks, uint32_t markCount, const Macro& macro,
+                           const std::vector<std::string>& arguments, std::string& text) {
+        size_t start = 0;
+        bool inString = false;
+        for (uint32_t i=0; i <= markCount; i++) {
+            size_t position = (i < markCount) ? marks[i] : line.size();
+            if (position > line.size())
+                position = line.size();
+
+            std::string_view piece = line.substr(start, position - start);
+            bool replaced = false;
+            if (!inString && !piece.empty()) {
+                for (unsigned int p=0; p < macro.parameters.size(); p++) {
+                    if (piece == macro.parameters[p]) {
+                        text += arguments[p];
+                        replaced = true;
+                        break;
+                    }
+                }
+            }
+            if (!replaced)
+                text.append(piece.data(), piece.size());
+
+            if (position >= line.size())
+                break;
+            if (line[position] == '\'')
+                inString = !inString;
+            text += line[position];
+            start = position + 1;
+        }
+    }
+
+    // Expand a macro once per distinct argument list
+    const Expansion& Expand(std::string_view name, const Macro& macro) {
+        key.assign(name.data(), name.size());
+        for (unsigned int i=0; i < arguments.size(); i++) {
+            key += '\0';
+            key += arguments[i];
+        }
+
+        std::unique_ptr<Expansion>& expansion = expansions[key];
+        if (expansion != nullptr)
+            return *expansion;
+
+        expansion.reset(new Expansion());
+        const ScanResult& source = *macro.source;
+        for (uint32_t index=macro.first; index < macro.last; index++) {
+            uint32_t firstMark = source.lineMarks[index];
+            Substitute(source.lines[index], source.marks.data() + firstMark, source.lineMarks[index + 1] - firstMark,
+                       macro, arguments, expansion->text);
+            expansion->text += '\n';
+        }
+        ScanSource(expansion->text, expansion->scan);
+        return *expansion;
+    }
+
+    // Expand a range of lines into the output
+    // Lines of a macro expansion all take the origin of its invocation
+    int Process(const ScanResult& source, uint32_t first, uint32_t last, uint32_t file, const LineOrigin* invocation, uint32_t depth) {
+        std::vector<Conditional> conditionals;
+        bool active = true;
+        Statement statement;
+
+        for (uint32_t index=first; index < last; index++) {
+            LineOrigin origin = (invocation != nullptr) ? *invocation : LineOrigin{file, index};
+
+            uint32_t firstMark = source.lineMarks[index];
+            ParseStatement(source.lines[index], source.marks.data() + firstMark, source.lineMarks[index + 1] - firstMark, statement);
+
+            std::string_view directive = (statement.tokenCount > 0) ? statement.token[0] : std::string_view();
+            const Macro* macro = nullptr;
+            if (!macros.empty() && statement.tokenCount > 0) {
+                std::unordered_map<std::string, Macro>::const_iterator found = macros.find(std::string(directive));
+                if (found != macros.end())
+                    macro = &found->second;
+            }
+
+            // Plain lines are copied as they are
+            if (macro == nullptr && !IsDirective(directive)) {
+                if (active)
+                    AppendLine(source, index, origin);
+                continue;
+            }
+
+            // Conditionals nest inside the file or macro they start in
+            if (directive == "IFDEF" || directive == "IFNDEF") {
+                if (statement.tokenCount < 2)
+                    return Error(origin, "Missing symbol");
+                bool defined = defines.count(std::string(statement.token[1])) > 0;
+                bool taken = (defined == (directive == "IFDEF"));
+                conditionals.push_back(Conditional{active, taken, false, origin});
+                active = active && taken;
+                continue;
+            }
+            if (directive == "ELSE") {
+                if (conditionals.empty())
+                    return Error(origin, "ELSE without IFDEF");
+                Conditional& conditional = conditionals.back();
+                if (conditional.hasElse)
+                    return Error(origin, "Duplicate ELSE");
+                conditional.hasElse = true;
+                active = conditional.parentActive && !conditional.taken;
+                continue;
+            }
+            if (directive == "ENDIF") {
+                if (conditionals.empty())
+                    return Error(origin, "ENDIF without IFDEF");
+                active = conditionals.back().parentActive;
+                conditionals.pop_back();
+                continue;
+            }
+
+            // A macro body is skipped to its ENDM, defined only if assembled
+            if (directive == "MACRO") {
+                if (statement.tokenCount < 2)
+                    return Error(origin, "Missing macro name");
+                if (statement.tooManyTokens)
+                    return Error(origin, "Too many macro parameters, at most " + std::to_string(MAX_STATEMENT_TOKENS - 2));
+
+                Statement body;
+                uint32_t end = index + 1;
+                for (; end < last; end++) {
+                    uint32_t bodyMark = source.lineMarks[end];
+                    ParseStatement(source.lines[end], source.marks.data() + bodyMark, source.lineMarks[end + 1] - bodyMark, body);
+                    if (body.tokenCount > 0 && body.token[0] == "ENDM")
+                        break;
+                    if (body.tokenCount > 0 && body.token[0] == "MACRO") {
+                        LineOrigin nested = (invocation != nullptr) ? *invocation : LineOrigin{file, end};
+                        return Error(nested, "Nested macro definition");
+                    }
+                }
+                if (end == last)
+                    return Error(origin, "Missing ENDM");
+
+                if (active) {
+                    std::string name(statement.token[1]);
+                    if (IsDirective(name) || macros.count(name) > 0)
+                        return Error(origin, "Duplicate macro " + name);
+
+                    Macro& defined = macros[name];
+                    defined.source = &source;
+                    defined.first = index + 1;
+                    defined.last = end;
+                    for (uint32_t i=2; i < statement.tokenCount; i++)
+                        defined.parameters.push_back(std::string(statement.token[i]));
+                }
+                index = end;
+                continue;
+            }
+            if (directive == "ENDM")
+                return Error(origin, "ENDM without MACRO");
+
+            if (!active)
+                continue;
+
+            AppendLabel(source, index, statement, origin);
+
+            if (directive == "DEFINE") {
+                if (statement.tokenCount < 2)
+                    return Error(origin, "Missing symbol");
+                if (statement.tooManyTokens)
+                    return Error(origin, "Too many symbols, at most " + std::to_string(MAX_STATEMENT_TOKENS - 1) + " on one line");
+                for (uint32_t i=1; i < statement.tokenCount; i++)
+                    defines.insert(std::string(statement.token[i]));
+                continue;
+            }
+
+            if (depth >= MAX_PREPROCESS_DEPTH)
+                return Error(origin, "Includes or macros nested too deeply");
+
+            if (directive == "INCLUDE") {
+                std::string_view name = statement.hasString ? statement.string : (statement.tokenCount > 1 ? statement.token[1] : std::string_view());
+                if (name.empty())
+                    return Error(origin, "Missing file name");
+
+                uint32_t included;
+                const IncludedFile* includedFile = FindInclude(name, file, included);
+                if (includedFile == nullptr)
+                    return Error(origin, "Could not open the include " + std::string(name));
+                if (Process(includedFile->scan, 0, includedFile->scan.lines.size(), included, nullptr, depth + 1) != 0)
+                    return -1;
+                continue;
+            }
+
+            // Macro invocation, quoted text is passed on with its quotes
+            if (statement.tooManyTokens)
+                return Error(origin, "Too many macro arguments, at most " + std::to_string(MAX_STATEMENT_TOKENS - 1));
+            arguments.clear();
+            for (uint32_t i=1; i < statement.tokenCount; i++) {
+                if (statement.hasString && statement.stringToken == i)
+                    arguments.push_back("'" + std::string(statement.string) + "'");
+                arguments.push_back(std::string(statement.token[i]));
+            }
+            if (statement.hasString && statement.stringToken >= statement.tokenCount)
+                arguments.push_back("'" + std::string(statement.string) + "'");
+
+            if (arguments.size() != macro->parameters.size())
+                return Error(origin, "Macro " + std::string(directive) + " takes " + std::to_string(macro->parameters.size()) + " argument(s)");
+
+            const Expansion& expansion = Expand(directive, *macro);
+            if (Process(expansion.scan, 0, expansion.scan.lines.size(), file, &origin, depth + 1) != 0)
+                return -1;
+        }
+
+        if (!conditionals.empty())
+            return Error(conditionals.back().origin, "Missing ENDIF");
+        return 0;
+    }
+
+};
+
+
+// Escape a path for a Make rule, Ninja reads the same syntax
+inline std::string DepfilePath(const std::string& path) {
+    std::string escaped;
+    for (unsigned int i=0; i < path.size(); i++) {
+        if (path[i] == ' ' || path[i] == '#')
+            escaped += '\\';
+        if (path[i] == '$')
+            escaped += '$';
+        escaped += path[i];
+    }
+    return escaped;
+}
+
+/// Write a depfile with one rule making the targets depend on every source, returns -1 if it could not be written.
+inline int WriteDepfile(const std::string& filename, const std::vector<std::string>& targets, const std::vector<std::string>& dependencies) {
+    std::ofstream depfile(filename, std::ios::trunc);
+    if (!depfile)
+        return -1;
+
+    for (unsigned int i=0; i < targets.size(); i++)
+        depfile << (i > 0 ? " " : "") << DepfilePath(targets[i]);
+    depfile << ":";
+    for (unsigned int i=0; i < dependencies.size(); i++)
+        depfile << " \\\n  " << DepfilePath(dependencies[i]);
+    depfile << "\n";
+
+    depfile.close();
+    return depfile ? 0 : -1;
+}
+
+#endif
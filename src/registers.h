@@ -1,3 +1,9 @@
+#ifndef _REGISTER_CODES__
+#define _REGISTER_CODES__
+
+#include <cstdint>
+#include <string_view>
+
 #define  rAL   0x00
 #define  rAH   0x01
 #define  rBL   0x02
@@ -14,7 +20,7 @@
 
 
 // Function to get register byte code
-uint8_t get_register_code(const std::string& reg) {
+constexpr uint8_t get_register_code(std::string_view reg) {
     if (reg == "AL") return rAL;
     if (reg == "AH") return rAH;
     if (reg == "BL") return rBL;
@@ -27,7 +33,7 @@ uint8_t get_register_code(const std::string& reg) {
 }
 
 // Function to get register byte code
-uint16_t get_register_code16(const std::string& reg) {
+constexpr uint16_t get_register_code16(std::string_view reg) {
     if (reg == "AX") return rAX;
     if (reg == "BX") return rBX;
     if (reg == "CX") return rCX;
@@ -35,3 +41,4 @@ uint16_t get_register_code16(const std::string& reg) {
     return 0xFF; // Invalid register
 }
 
+#endif
@@ -0,0 +1,158 @@
+#ifndef _BRANCH_RELAXATION__
+#define _BRANCH_RELAXATION__
+
+#include <cstdint>
+
+#include "opcodes.h"
+
+// Branch relaxation
+// Every branch is encoded long first, as its opcode and the 32-bit address of its label, so the size of
+// every line follows from the line alone and the one pass of the assembler lays the program out. The
+// long layout is then relaxed: every branch starts in its short form and only ever grows, a pass finds
+// the addresses the forms give and grows the branches whose displacement does not fit. Growing only
+// lengthens the code between a branch and its label in the same segment, so the forms settle in a few
+// linear passes even over many branches. The segments placed by ORG keep their bases, the code of a
+// segment only moves down within it.
+// Everything here is constexpr, the assembler and the compile time assembler share it.
+
+struct Branch {
+    uint32_t address;       // Of the branch in the long layout
+    uint32_t target;        // Address of its label in the long layout
+    uint32_t segment;       // Holding the branch
+    uint32_t before;        // Branches before the target in its segment plus one, zero if there are none
+    uint32_t saved;         // Bytes this branch and the ones before it in its segment save
+    uint8_t form;           // Set to BRANCH_LONG before relaxing to keep a branch long
+};
+
+// Branches of a program in the address order of the long layout and the bases of its segments
+struct BranchList {
+    Branch* branches;
+    uint32_t count;
+    const uint32_t* bases;          // Ascending
+    uint32_t segments;
+};
+
+
+// Segment holding an address of the long layout
+constexpr uint32_t BranchSegment(const BranchList& list, uint32_t address) {
+    uint32_t low = 0;
+    uint32_t high = list.segments;
+    while (low < high) {
+        uint32_t middle = (low + high) / 2;
+        if (list.bases[middle] <= address)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+    return (low > 0) ? low - 1 : 0;
+}
+
+// Number of branches below an address of the long layout
+constexpr uint32_t BranchesBelow(const BranchList& list, uint32_t address) {
+    uint32_t low = 0;
+    uint32_t high = list.count;
+    while (low < high) {
+        uint32_t middle = (low + high) / 2;
+        if (list.branches[middle].address < address)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+    return low;
+}
+
+// Branches below an address in its own segment plus one, zero if there are none
+constexpr uint32_t BranchBefore(const BranchList& list, uint32_t address) {
+    uint32_t below = BranchesBelow(list, address);
+    if (below == 0 || list.branches[below - 1].segment != BranchSegment(list, address))
+        return 0;
+    return below;
+}
+
+// Address of a branch or a label once the forms are chosen, from its place among the branches
+constexpr uint32_t RelaxedAddress(const BranchList& list, uint32_t address, uint32_t before) {
+    return (before == 0) ? address : address - list.branches[before - 1].saved;
+}
+
+/// Address of any address of the long layout once the forms are chosen.
+constexpr uint32_t RelaxedAddress(const BranchList& list, uint32_t address) {
+    return RelaxedAddress(list, address, BranchBefore(list, address));
+}
+
+// Add up the bytes saved by the forms as they are
+constexpr void SumSaved(BranchList& list) {
+    for (uint32_t i=0; i < list.count; i++) {
+        Branch& branch = list.branches[i];
+        uint32_t saved = (i > 0 && list.branches[i - 1].segment == branch.segment) ? list.branches[i - 1].saved : 0;
+        branch.saved = saved + BranchSize(BRANCH_LONG) - BranchSize(branch.form);
+    }
+}
+
+/// Choose the shortest form that reaches the label of every branch. The branches must be in address
+/// order with their address, target and form set. Returns the number of passes it took.
+constexpr uint32_t RelaxBranches(BranchList& list) {
+    for (uint32_t i=0; i < list.count; i++) {
+        list.branches[i].segment = BranchSegment(list, list.branches[i].address);
+        list.branches[i].before = 0;
+    }
+    for (uint32_t i=0; i < list.count; i++)
+        list.branches[i].before = BranchBefore(list, list.branches[i].target);
+
+    uint32_t passes = 0;
+    bool grown = true;
+    while (grown) {
+        grown = false;
+        passes++;
+        SumSaved(list);
+        for (uint32_t i=0; i < list.count; i++) {
+            Branch& branch = list.branches[i];
+            if (branch.form == BRANCH_LONG)
+                continue;
+            uint32_t before = (i > 0 && list.branches[i - 1].segment == branch.segment) ? i : 0;
+            uint32_t address = RelaxedAddress(list, branch.address, before);
+            int64_t displacement = (int64_t)RelaxedAddress(list, branch.target, branch.before) - (address + BranchSize(branch.form));
+            bool fits = (branch.form == BRANCH_SHORT) ? (displacement >= -128 && displacement <= 127) : (displacement >= -32768 && displacement <= 32767);
+            if (!fits) {
+                branch.form++;
+                grown = true;
+            }
+        }
+    }
+    return passes;
+}
+
+/// Copy one segment of the long layout with every branch in its chosen form, the output may be the
+/// input. next is the first branch at or after the segment and is moved past it. Returns the size
+/// of the relaxed segment, the output may be null to only find it.
+constexpr uint32_t RelaxSegment(const BranchList& list, uint32_t& next, const uint8_t* input, uint32_t base, uint32_t size, uint8_t* output) {
+    uint32_t from = 0;              // Offsets into the segment
+    uint32_t to = 0;
+    while (true) {
+        uint32_t end = size;
+        bool branch = (next < list.count && list.branches[next].address - base < size);
+        if (branch)
+            end = list.branches[next].address - base;
+        if (output != nullptr)
+            for (uint32_t i=0; i < end - from; i++)
+                output[to + i] = input[from + i];
+        to += end - from;
+        from = end;
+        if (!branch)
+            return to;
+
+        const Branch& relaxed = list.branches[next];
+        uint32_t target = RelaxedAddress(list, relaxed.target, relaxed.before);
+        uint32_t length = BranchSize(relaxed.form);
+        if (output != nullptr) {
+            uint32_t field = (relaxed.form == BRANCH_LONG) ? target : target - (base + to + length);
+            output[to] = BranchOpcode(input[from], relaxed.form);
+            for (uint32_t i=1; i < length; i++)
+                output[to + i] = (uint8_t)(field >> ((i - 1) * 8));
+        }
+        to += length;
+        from += BranchSize(BRANCH_LONG);
+        next++;
+    }
+}
+
+#endif
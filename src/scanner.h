@@ -0,0 +1,250 @@
+#ifndef _SOURCE_SCANNER__
+#define _SOURCE_SCANNER__
+
+#include <cstdint>
+#include <string_view>
+#include <vector>
+
+#if defined(__SSE2__) || defined(_M_X64)
+ #define SCANNER_SSE2
+ #include <emmintrin.h>
+#endif
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+ #define SCANNER_AVX2
+ #define SCANNER_AVX2_DISPATCH
+ #include <immintrin.h>
+#elif defined(__AVX2__)
+ #define SCANNER_AVX2
+ #include <immintrin.h>
+#endif
+
+// Maximum number of tokens kept for one statement
+#define MAX_STATEMENT_TOKENS  8
+
+// Offsets of every delimiter in a source buffer, found in one sweep
+// Delimiters are newline, whitespace, comma, quote, colon and equals
+struct ScanResult {
+    std::vector<std::string_view> lines;   // Lines without the newline or a trailing carriage return
+    std::vector<uint32_t> marks;           // Delimiter offsets relative to the start of their line
+    std::vector<uint32_t> lineMarks;       // Index of the first mark of each line, plus one past the end
+};
+
+// One parsed source line
+struct Statement {
+    std::string_view label;                          // Label defined on this line
+    std::string_view token[MAX_STATEMENT_TOKENS];    // Mnemonic followed by the operands
+    uint32_t tokenCount;
+    std::string_view string;                         // Quoted text
+    uint32_t stringToken;                            // Number of tokens before the quoted text
+    bool hasString;
+    bool closedString;                               // Quoted text ends with a quote
+    bool hasEquals;
+    bool tooManyTokens;                              // Tokens past MAX_STATEMENT_TOKENS were dropped
+};
+
+constexpr uint8_t delimiterTable[256] = {
+    0,0,0,0,0,0,0,0, 0,1,1,0,0,1,0,0,   // \t \n \r
+    0,0,0,0,0,0,0,0, 0,0,0,0,0,0,0,0,
+    1,0,0,0,0,0,0,1, 0,0,0,0,1,0,0,0,   // space ' ,
+    0,0,0,0,0,0,0,0, 0,0,1,0,0,1,0,0,   // : =
+};
+
+
+// Record one delimiter found by the sweep
+inline void ScanMark(std::string_view text, size_t position, ScanResult& result, size_t& lineStart) {
+    if (text[position] != '\n') {
+        result.marks.push_back(position - lineStart);
+        return;
+    }
+
+    size_t length = position - lineStart;
+    if (length > 0 && text[position - 1] == '\r')
+        length--;
+    result.lines.push_back(text.substr(lineStart, length));
+    result.lineMarks.push_back(result.marks.size());
+    lineStart = position + 1;
+}
+
+#ifdef SCANNER_SSE2
+inline uint32_t DelimiterMaskSSE2(const char* data) {
+    __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data));
+    __m128i mask = _mm_cmpeq_epi8(block, _mm_set1_epi8('\n'));
+    mask = _mm_or_si128(mask, _mm_cmpeq_epi8(block, _mm_set1_epi8(' ')));
+    mask = _mm_or_si128(mask, _mm_cmpeq_epi8(block, _mm_set1_epi8('\t')));
+    mask = _mm_or_si128(mask, _mm_cmpeq_epi8(block, _mm_set1_epi8('\r')));
+    mask = _mm_or_si128(mask, _mm_cmpeq_epi8(block, _mm_set1_epi8(',')));
+    mask = _mm_or_si128(mask, _mm_cmpeq_epi8(block, _mm_set1_epi8('\'')));
+    mask = _mm_or_si128(mask, _mm_cmpeq_epi8(block, _mm_set1_epi8(':')));
+    mask = _mm_or_si128(mask, _mm_cmpeq_epi8(block, _mm_set1_epi8('=')));
+    return (uint32_t)_mm_movemask_epi8(mask);
+}
+#endif
+
+#ifdef SCANNER_AVX2
+#ifdef SCANNER_AVX2_DISPATCH
+__attribute__((target("avx2")))
+#endif
+inline size_t ScanBlocksAVX2(std::string_view text, ScanResult& result, size_t& lineStart) {
+    const char* data = text.data();
+    size_t position = 0;
+
+    const __m256i newline = _mm256_set1_epi8('\n');
+    const __m256i space   = _mm256_set1_epi8(' ');
+    const __m256i tab     = _mm256_set1_epi8('\t');
+    const __m256i cr      = _mm256_set1_epi8('\r');
+    const __m256i comma   = _mm256_set1_epi8(',');
+    const __m256i quote   = _mm256_set1_epi8('\'');
+    const __m256i colon   = _mm256_set1_epi8(':');
+    const __m256i equals  = _mm256_set1_epi8('=');
+
+    for (; position + 32 <= text.size(); position += 32) {
+        __m256i block = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + position));
+        __m256i mask = _mm256_or_si256(_mm256_cmpeq_epi8(block, newline), _mm256_cmpeq_epi8(block, space));
+        mask = _mm256_or_si256(mask, _mm256_or_si256(_mm256_cmpeq_epi8(block, tab),   _mm256_cmpeq_epi8(block, cr)));
+        mask = _mm256_or_si256(mask, _mm256_or_si256(_mm256_cmpeq_epi8(block, comma), _mm256_cmpeq_epi8(block, quote)));
+        mask = _mm256_or_si256(mask, _mm256_or_si256(_mm256_cmpeq_epi8(block, colon), _mm256_cmpeq_epi8(block, equals)));
+
+        uint32_t bits = (uint32_t)_mm256_movemask_epi8(mask);
+        while (bits != 0) {
+            ScanMark(text, position + __builtin_ctz(bits), result, lineStart);
+            bits &= bits - 1;
+        }
+    }
+    return position;
+}
+#endif
+
+#ifdef SCANNER_AVX2_DISPATCH
+inline bool CpuHasAVX2() {
+    static const bool hasAVX2 = __builtin_cpu_supports("avx2");
+    return hasAVX2;
+}
+#endif
+
+
+// Find every line and delimiter in the text
+inline void ScanSource(std::string_view text, ScanResult& result) {
+    result.lines.clear();
+    result.marks.clear();
+    result.lineMarks.clear();
+
+    result.lines.reserve(text.size() / 16 + 1);
+    result.marks.reserve(text.size() / 4 + 1);
+    result.lineMarks.reserve(text.size() / 16 + 2);
+    result.lineMarks.push_back(0);
+
+    size_t lineStart = 0;
+    size_t position = 0;
+
+#ifdef SCANNER_AVX2
+#ifdef SCANNER_AVX2_DISPATCH
+    if (CpuHasAVX2())
+#endif
+        position = ScanBlocksAVX2(text, result, lineStart);
+#endif
+
+#ifdef SCANNER_SSE2
+    for (; position + 16 <= text.size(); position += 16) {
+        uint32_t bits = DelimiterMaskSSE2(text.data() + position);
+        while (bits != 0) {
+#ifdef _MSC_VER
+            unsigned long bit;
+            _BitScanForward(&bit, bits);
+#else
+            uint32_t bit = __builtin_ctz(bits);
+#endif
+            ScanMark(text, position + bit, result, lineStart);
+            bits &= bits - 1;
+        }
+    }
+#endif
+
+    // Scalar tail
+    for (; position < text.size(); position++)
+        if (delimiterTable[(uint8_t)text[position]])
+            ScanMark(text, position, result, lineStart);
+
+    // Last line without a newline
+    if (lineStart < text.size()) {
+        size_t length = text.size() - lineStart;
+        if (text[text.size() - 1] == '\r')
+            length--;
+        result.lines.push_back(text.substr(lineStart, length));
+        result.lineMarks.push_back(result.marks.size());
+    }
+}
+
+
+// Reset a statement before the delimiters of its line are parsed
+constexpr void ClearStatement(Statement& statement) {
+    statement.label = std::string_view();
+    statement.tokenCount = 0;
+    statement.string = std::string_view();
+    statement.stringToken = 0;
+    statement.hasString = false;
+    statement.closedString = false;
+    statement.hasEquals = false;
+    statement.tooManyTokens = false;
+}
+
+// Parse the text up to one delimiter of a line, start is where the text after the last delimiter begins.
+// A position at the end of the line closes the statement.
+constexpr void ParseDelimiter(std::string_view line, size_t position, size_t& start, bool& inString, Statement& statement) {
+    if (position > line.size())
+        position = line.size();
+    char delimiter = (position < line.size()) ? line[position] : '\n';
+
+    if (inString) {
+        if (delimiter != '\'' && position < line.size())
+            return;
+
+        // Closing quote or an unterminated string
+        statement.string = line.substr(start, position - start);
+        statement.closedString = (position < line.size());
+        inString = false;
+        start = position + 1;
+        return;
+    }
+
+    // Close the current token
+    if (position > start) {
+        if (statement.tokenCount < MAX_STATEMENT_TOKENS)
+            statement.token[statement.tokenCount++] = line.substr(start, position - start);
+        else
+            statement.tooManyTokens = true;
+    }
+    start = position + 1;
+
+    if (position >= line.size())
+        return;
+
+    if (delimiter == '\'' && !statement.hasString) {
+        statement.hasString = true;
+        statement.stringToken = statement.tokenCount;
+        inString = true;
+        return;
+    }
+
+    if (delimiter == '=')
+        statement.hasEquals = true;
+
+    // A single leading token followed by a colon names a label
+    if (delimiter == ':' && statement.tokenCount == 1 && statement.label.empty() && !statement.hasString) {
+        statement.label = statement.token[0];
+        statement.tokenCount = 0;
+    }
+}
+
+// Split a line into a label, tokens and quoted text using its delimiter marks
+constexpr void ParseStatement(std::string_view line, const uint32_t* marks, uint32_t markCount, Statement& statement) {
+    ClearStatement(statement);
+
+    size_t start = 0;
+    bool inString = false;
+    for (uint32_t i=0; i < markCount; i++)
+        ParseDelimiter(line, marks[i], start, inString, statement);
+    ParseDelimiter(line, line.size(), start, inString, statement);
+}
+
+#endif
@@ -0,0 +1,404 @@
+#ifndef _ASSEMBLER_SERVER__
+#define _ASSEMBLER_SERVER__
+
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <ostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "assembler.h"
+#include "object.h"
+#include "threadpool.h"
+
+#ifdef __linux__
+ #define SERVER_SOCKETS
+ #include <sched.h>
+ #include <sys/socket.h>
+ #include <sys/stat.h>
+ #include <sys/un.h>
+ #include <unistd.h>
+#endif
+
+// Layout of a message, every field a little endian 32-bit word as in an object file
+//   header    magic, assembler version, body length in bytes
+//   request   argument count, then the working directory, every argument and the inline source
+//   response  exit status, then the standard output and the standard error text
+// Every text is its length followed by its bytes padded to a whole word. A request without an
+// inline source has the length 0xFFFFFFFF in its place.
+#define SERVER_MAGIC    0x53345800      // "\0X4S"
+
+// Largest message either side accepts
+#define MAX_SERVER_MESSAGE  0x40000000
+
+#define SERVER_NO_SOURCE  0xFFFFFFFF
+
+// Exit status of a request the server does not run, such as a command line it takes as a usage
+// error. The client runs the command line itself and reports whatever is wrong with it.
+#define SERVER_REFUSED  -2
+
+
+// One command line run by the server
+struct ServerRequest {
+    std::string directory;                  // Working directory of the client, relative paths start there
+    std::vector<std::string> arguments;     // The command line without the program name
+    bool hasSource;                         // An input named "-" reads this instead of a file
+    std::string source;
+};
+
+struct ServerResponse {
+    int32_t status;                         // Exit status of the command
+    std::string out;
+    std::string err;
+};
+
+// Runs one request, writing what the command prints to the two streams, and returns its exit status
+typedef std::function<int(const ServerRequest& request, std::ostream& out, std::ostream& err)> RequestHandler;
+
+
+inline size_t ServerTextSize(const std::string& text) {return 4 + (text.size() + 3) / 4 * 4;}
+
+inline uint8_t* PutServerText(uint8_t* output, const std::string& text) {
+    output = PutObjectWord(output, text.size());
+    if (text.size() > 0)
+        memcpy(output, text.data(), text.size());
+    size_t padded = (text.size() + 3) / 4 * 4;
+    memset(output + text.size(), 0, padded - text.size());
+    return output + padded;
+}
+
+inline bool ReadServerText(ObjectReader& reader, std::string& text) {
+    uint32_t length;
+    if (!reader.Word(length))
+        return false;
+    const uint8_t* bytes = reader.Bytes((size_t(length) + 3) / 4 * 4);
+    if (bytes == nullptr)
+        return false;
+    text.assign(reinterpret_cast<const char*>(bytes), length);
+    return true;
+}
+
+inline std::vector<uint8_t> FormatRequest(const ServerRequest& request) {
+    size_t size = 4 * 4 + ServerTextSize(request.directory);
+    for (unsigned int i=0; i < request.arguments.size(); i++)
+        size += ServerTextSize(request.arguments[i]);
+    size += request.hasSource ? ServerTextSize(request.source) : 4;
+
+    std::vector<uint8_t> message(size);
+    uint8_t* output = message.data();
+    output = PutObjectWord(output, SERVER_MAGIC);
+    output = PutObjectWord(output, ASSEMBLER_VERSION);
+    output = PutObjectWord(output, size - 3 * 4);
+    output = PutObjectWord(output, request.arguments.size());
+    output = PutServerText(output, request.directory);
+    for (unsigned int i=0; i < request.arguments.size(); i++)
+        output = PutServerText(output, request.arguments[i]);
+    if (request.hasSource)
+        PutServerText(output, request.source);
+    else
+        PutObjectWord(output, SERVER_NO_SOURCE);
+    return message;
+}
+
+/// Parse the body of a request, returns -1 if it is not valid.
+inline int ParseRequest(const std::vector<uint8_t>& body, ServerRequest& request) {
+    ObjectReader reader = {body.data(), body.size(), 0};
+    uint32_t argumentCount;
+    if (!reader.Word(argumentCount) || argumentCount > body.size() / 4 || !ReadServerText(reader, request.directory))
+        return -1;
+    request.arguments.resize(argumentCount);
+    for (uint32_t i=0; i < argumentCount; i++)
+        if (!ReadServerText(reader, request.arguments[i]))
+            return -1;
+
+    ObjectReader peek = reader;
+    uint32_t length;
+    if (!peek.Word(length))
+        return -1;
+    request.hasSource = (length != SERVER_NO_SOURCE);
+    if (!request.hasSource)
+        return 0;
+    return ReadServerText(reader, request.source) ? 0 : -1;
+}
+
+inline std::vector<uint8_t> FormatResponse(const ServerResponse& response) {
+    size_t size = 4 * 4 + ServerTextSize(response.out) + ServerTextSize(response.err);
+    std::vector<uint8_t> message(size);
+    uint8_t* output = message.data();
+    output = PutObjectWord(output, SERVER_MAGIC);
+    output = PutObjectWord(output, ASSEMBLER_VERSION);
+    output = PutObjectWord(output, size - 3 * 4);
+    output = PutObjectWord(output, (uint32_t)response.status);
+    output = PutServerText(output, response.out);
+    PutServerText(output, response.err);
+    return message;
+}
+
+inline int ParseResponse(const std::vector<uint8_t>& body, ServerResponse& response) {
+    ObjectReader reader = {body.data(), body.size(), 0};
+    uint32_t status;
+    if (!reader.Word(status) || !ReadServerText(reader, response.out) || !ReadServerText(reader, response.err))
+        return -1;
+    response.status = (int32_t)status;
+    return 0;
+}
+
+
+#ifdef SERVER_SOCKETS
+inline int SendAll(int connection, const uint8_t* data, size_t size) {
+    while (size > 0) {
+        ssize_t sent = send(connection, data, size, MSG_NOSIGNAL);
+        if (sent <= 0)
+            return -1;
+        data += sent;
+        size -= sent;
+    }
+    return 0;
+}
+
+inline int ReceiveAll(int connection, uint8_t* data, size_t size) {
+    while (size > 0) {
+        ssize_t received = recv(connection, data, size, 0);
+        if (received <= 0)
+            return -1;
+        data += received;
+        size -= received;
+    }
+    return 0;
+}
+
+// Read the header of a message and its body, a client and server of different versions never talk
+inline int ReceiveMessage(int connection, std::vector<uint8_t>& body) {
+    uint8_t header[3 * 4];
+    if (ReceiveAll(connection, header, sizeof(header)) != 0)
+        return -1;
+    ObjectReader reader = {header, sizeof(header), 0};
+    uint32_t magic, version, length;
+    reader.Word(magic);
+    reader.Word(version);
+    reader.Word(length);
+    if (magic != SERVER_MAGIC || version != ASSEMBLER_VERSION || length > MAX_SERVER_MESSAGE)
+        return -1;
+    body.resize(length);
+    return ReceiveAll(connection, body.data(), length);
+}
+
+inline int ConnectSocket(const std::string& path) {
+    struct sockaddr_un address;
+    if (path.size() >= sizeof(address.sun_path))
+        return -1;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    memcpy(address.sun_path, path.c_str(), path.size() + 1);
+
+    int connection = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (connection < 0)
+        return -1;
+    if (connect(connection, reinterpret_cast<struct sockaddr*>(&address), sizeof(address)) != 0) {
+        close(connection);
+        return -1;
+    }
+    return connection;
+}
+
+// True if the process at the other end of a connection runs as the same user as this one
+inline bool SameUser(int connection) {
+    struct ucred credentials;
+    socklen_t length = sizeof(credentials);
+    if (getsockopt(connection, SOL_SOCKET, SO_PEERCRED, &credentials, &length) != 0)
+        return false;
+    return credentials.uid == geteuid();
+}
+#endif
+
+
+/// The working directory of this process, empty if it cannot be found.
+inline std::string CurrentDirectory() {
+#ifdef SERVER_SOCKETS
+    char directory[4096];
+    if (getcwd(directory, sizeof(directory)) != nullptr)
+        return directory;
+#endif
+    return std::string();
+}
+
+/// True if a server runs the command line. A watch, a language server and a server outlive any
+/// request, they always run in the client.
+inline bool ServerRuns(const std::vector<std::string>& arguments) {
+    for (unsigned int i=0; i < arguments.size(); i++) {
+        const std::string& argument = arguments[i];
+        if (argument == "--watch" || argument == "--lsp" || argument.compare(0, 9, "--server=") == 0 || argument.compare(0, 10, "--connect=") == 0)
+            return false;
+    }
+    return true;
+}
+
+/// Send a request to the server at a socket and wait for its response.
+/// Returns -1 if there is no server or it did not answer.
+inline int SendRequest(const std::string& path, const ServerRequest& request, ServerResponse& response) {
+#ifdef SERVER_SOCKETS
+    int connection = ConnectSocket(path);
+    if (connection < 0)
+        return -1;
+
+    std::vector<uint8_t> message = FormatRequest(request);
+    std::vector<uint8_t> body;
+    int result = -1;
+    if (SendAll(connection, message.data(), message.size()) == 0 && ReceiveMessage(connection, body) == 0)
+        result = ParseResponse(body, response);
+    close(connection);
+    return result;
+#else
+    (void)path; (void)request; (void)response;
+    return -1;
+#endif
+}
+
+/// Run a command line on the server at a socket. Returns 0 with the response of the server, -1 if
+/// there is no server or it did not answer, or SERVER_REFUSED if the client must run it itself.
+inline int ForwardRequest(const std::string& path, const ServerRequest& request, ServerResponse& response) {
+    if (!ServerRuns(request.arguments))
+        return SERVER_REFUSED;
+    if (SendRequest(path, request, response) != 0)
+        return -1;
+    return (response.status == SERVER_REFUSED) ? SERVER_REFUSED : 0;
+}
+
+
+// Server running command lines sent over a Unix domain socket
+// Every connection carries one request and its response. Connections are served on a thread pool,
+// and every worker has a working directory of its own, so a request sees the relative paths of its
+// client while others run. Whatever the handler keeps between requests stays warm.
+// A request runs with the privileges of the server and writes wherever its command line says, so only
+// the owner may use the socket and a connection from another user is closed unanswered.
+class AssemblerServer {
+
+public:
+
+    AssemblerServer(const std::string& path, RequestHandler handler) : path(path), handler(handler), listener(-1) {}
+
+    ~AssemblerServer() {
+#ifdef SERVER_SOCKETS
+        if (listener >= 0) {
+            close(listener);
+            unlink(path.c_str());
+        }
+#endif
+    }
+
+    AssemblerServer(const AssemblerServer&) = delete;
+    AssemblerServer& operator=(const AssemblerServer&) = delete;
+
+    /// True if a server can run on this platform.
+    static bool Supported() {
+#ifdef SERVER_SOCKETS
+        return true;
+#else
+        return false;
+#endif
+    }
+
+    /// Bind the socket, a socket file left behind by a server that is gone is replaced. Only the owner
+    /// may connect to it. Returns -1 if the socket could not be bound or another server is listening on it.
+    int Listen() {
+#ifdef SERVER_SOCKETS
+        struct sockaddr_un address;
+        if (path.size() >= sizeof(address.sun_path))
+            return -1;
+        memset(&address, 0, sizeof(address));
+        address.sun_family = AF_UNIX;
+        memcpy(address.sun_path, path.c_str(), path.size() + 1);
+
+        int running = ConnectSocket(path);
+        if (running >= 0) {
+            close(running);
+            return -1;
+        }
+        unlink(path.c_str());
+
+        listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (listener < 0)
+            return -1;
+
+        // No other user may connect, not even between the bind and the chmod
+        mode_t mask = umask(077);
+        int bound = bind(listener, reinterpret_cast<struct sockaddr*>(&address), sizeof(address));
+        umask(mask);
+        if (bound != 0 || chmod(path.c_str(), S_IRUSR | S_IWUSR) != 0 || listen(listener, SOMAXCONN) != 0) {
+            if (bound == 0)
+                unlink(path.c_str());
+            close(listener);
+            listener = -1;
+            return -1;
+        }
+        return 0;
+#else
+        return -1;
+#endif
+    }
+
+    /// Serve requests until accepting a connection fails.
+    int Run(unsigned int threadCount) {
+#ifdef SERVER_SOCKETS
+        ThreadPool pool(threadCount);
+        while (true) {
+            int connection = accept4(listener, nullptr, nullptr, SOCK_CLOEXEC);
+            if (connection < 0) {
+                if (errno == EINTR || errno == ECONNABORTED)
+                    continue;
+                return -1;
+            }
+            if (!SameUser(connection)) {
+                close(connection);
+                continue;
+            }
+            pool.Submit([this, connection]() {
+                Serve(connection);
+                close(connection);
+            });
+        }
+#else
+        (void)threadCount;
+        return -1;
+#endif
+    }
+
+private:
+
+    std::string path;
+    RequestHandler handler;
+    int listener;
+
+#ifdef SERVER_SOCKETS
+    void Serve(int connection) {
+        // The working directory is shared by every thread until a thread unshares it
+        static thread_local bool ownDirectory = (unshare(CLONE_FS) == 0);
+
+        std::vector<uint8_t> body;
+        ServerRequest request;
+        if (ReceiveMessage(connection, body) != 0 || ParseRequest(body, request) != 0)
+            return;
+
+        ServerResponse response;
+        std::ostringstream out;
+        std::ostringstream err;
+        if (!ownDirectory || chdir(request.directory.c_str()) != 0) {
+            err << "Error: Could not change to the directory " << request.directory << ".\n";
+            response.status = SERVER_REFUSED;
+        } else {
+            response.status = handler(request, out, err);
+        }
+        response.out = out.str();
+        response.err = err.str();
+
+        std::vector<uint8_t> message = FormatResponse(response);
+        SendAll(connection, message.data(), message.size());
+    }
+#endif
+
+};
+
+#endif
@@ -0,0 +1,173 @@
+#ifndef _SOURCE_FILE__
+#define _SOURCE_FILE__
+
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <fstream>
+
+#if defined(__unix__) || defined(__APPLE__)
+ #define SOURCE_MMAP
+ #include <sys/mman.h>
+ #include <sys/stat.h>
+ #include <fcntl.h>
+ #include <unistd.h>
+#else
+ #include <sstream>
+#endif
+
+// Size of one read in streaming mode
+#define SOURCE_STREAM_CHUNK  (1024 * 1024)
+
+// Read only view of a source file
+// The file is memory mapped where the platform allows it, otherwise it is read into a buffer
+class SourceFile {
+
+public:
+
+    SourceFile() : data(nullptr), size(0) {}
+    ~SourceFile() {Close();}
+
+    SourceFile(const SourceFile&) = delete;
+    SourceFile& operator=(const SourceFile&) = delete;
+
+    /// Map the file into memory, returns -1 if the file could not be opened.
+    int Open(const std::string& filename) {
+        Close();
+
+#ifdef SOURCE_MMAP
+        int file = open(filename.c_str(), O_RDONLY);
+        if (file < 0)
+            return -1;
+
+        struct stat info;
+        if (fstat(file, &info) != 0) {
+            close(file);
+            return -1;
+        }
+
+        size = info.st_size;
+        if (size > 0) {
+            void* mapping = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, file, 0);
+            if (mapping == MAP_FAILED) {
+                close(file);
+                size = 0;
+                return -1;
+            }
+            madvise(mapping, size, MADV_SEQUENTIAL);
+            data = static_cast<const char*>(mapping);
+        }
+
+        // The mapping stays valid after the descriptor is closed
+        close(file);
+#else
+        std::ifstream file(filename, std::ios::in | std::ios::binary);
+        if (!file)
+            return -1;
+
+        std::ostringstream stream;
+        stream << file.rdbuf();
+        buffer = stream.str();
+        data = buffer.data();
+        size = buffer.size();
+#endif
+        return 0;
+    }
+
+    void Close() {
+#ifdef SOURCE_MMAP
+        if (data != nullptr)
+            munmap(const_cast<char*>(data), size);
+#else
+        buffer.clear();
+#endif
+        data = nullptr;
+        size = 0;
+    }
+
+    /// Return the whole file as text.
+    std::string_view Text() const {return std::string_view(data == nullptr ? "" : data, size);}
+
+private:
+
+    const char* data;
+    size_t size;
+
+#ifndef SOURCE_MMAP
+    std::string buffer;
+#endif
+
+};
+
+// Source file read in fixed size chunks of whole lines
+// Only one chunk is held in memory, a line cut off by the end of a read is carried into the next chunk
+class SourceStream {
+
+public:
+
+    SourceStream() : carryStart(0), carry(0) {}
+
+    /// Open the file for reading, returns -1 if the file could not be opened.
+    int Open(const std::string& filename) {
+        file.close();
+        file.clear();
+        file.open(filename, std::ios::in | std::ios::binary);
+        if (!file)
+            return -1;
+        buffer.resize(SOURCE_STREAM_CHUNK);
+        carryStart = 0;
+        carry = 0;
+        return 0;
+    }
+
+    /// Read the next chunk of whole lines, returns false once the file is exhausted.
+    /// The text stays valid until the next call.
+    bool Next(std::string_view& text) {
+        // Move the partial line left over from the last chunk to the front
+        if (carry > 0)
+            memmove(buffer.data(), buffer.data() + carryStart, carry);
+        size_t length = carry;
+        carry = 0;
+
+        while (true) {
+            // A line longer than the buffer
+            if (length == buffer.size())
+                buffer.resize(buffer.size() * 2);
+
+            size_t count = 0;
+            if (file) {
+                file.read(buffer.data() + length, buffer.size() - length);
+                count = file.gcount();
+            }
+            length += count;
+
+            // End of the file, whatever is left is the last line
+            if (count == 0) {
+                text = std::string_view(buffer.data(), length);
+                return length > 0;
+            }
+
+            // Cut after the last newline
+            size_t end = std::string_view(buffer.data(), length).rfind('\n');
+            if (end == std::string_view::npos)
+                continue;
+
+            text = std::string_view(buffer.data(), end + 1);
+            carryStart = end + 1;
+            carry = length - carryStart;
+            return true;
+        }
+    }
+
+private:
+
+    std::ifstream file;
+    std::vector<char> buffer;
+    size_t carryStart;
+    size_t carry;
+
+};
+
+
+#endif
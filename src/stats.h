@@ -0,0 +1,197 @@
+#ifndef _BUILD_STATS__
+#define _BUILD_STATS__
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <iomanip>
+#include <map>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include "arena.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+ #define STATS_RUSAGE
+ #include <sys/resource.h>
+#endif
+
+// Counters
+#define STAT_FILES         0
+#define STAT_LINES         1
+#define STAT_SYMBOLS       2
+#define STAT_PROBES        3   // Hash slots visited by symbol lookups
+#define STAT_FIXUPS        4
+#define STAT_OUTPUT_BYTES  5
+#define STAT_CACHE_HITS    6
+#define STAT_CACHE_MISSES  7
+#define STAT_COUNTERS      8
+
+
+// Timers and counters of one run
+// Nothing is measured unless a Stats object is handed to the code being measured,
+// a disabled timer is a single null pointer check
+class Stats {
+
+public:
+
+    struct Event {
+        const char* name;
+        uint64_t start;         // Nanoseconds since the Stats object was created
+        uint64_t duration;
+        uint32_t thread;
+    };
+
+    Stats() : epoch(std::chrono::steady_clock::now()), heapAtStart(HeapAllocationCount()) {
+        for (unsigned int i=0; i < STAT_COUNTERS; i++)
+            counters[i] = 0;
+    }
+
+    /// Nanoseconds since the Stats object was created.
+    uint64_t Now() const {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - epoch).count();
+    }
+
+    /// Record a finished phase. Safe to call from any thread.
+    void AddEvent(const char* name, uint64_t start, uint64_t duration) {
+        Event event = {name, start, duration, ThreadIndex()};
+        std::lock_guard<std::mutex> lock(mutex);
+        events.push_back(event);
+    }
+
+    /// Add to one of the STAT_ counters. Safe to call from any thread.
+    void Count(unsigned int counter, uint64_t amount) {
+        counters[counter].fetch_add(amount, std::memory_order_relaxed);
+    }
+
+    uint64_t Counter(unsigned int counter) const {return counters[counter].load(std::memory_order_relaxed);}
+
+    /// Heap allocations made since the Stats object was created, zero if they are not counted.
+    uint64_t HeapAllocations() const {return HeapAllocationCount() - heapAtStart;}
+
+    /// Peak resident set size of the process in kilobytes, zero where it is not available.
+    static uint64_t PeakResidentKB() {
+#ifdef STATS_RUSAGE
+        struct rusage usage;
+        if (getrusage(RUSAGE_SELF, &usage) != 0)
+            return 0;
+ #ifdef __APPLE__
+        return usage.ru_maxrss / 1024;     // Bytes on macOS
+ #else
+        return usage.ru_maxrss;
+ #endif
+#else
+        return 0;
+#endif
+    }
+
+    /// Print the time spent in every phase and the counters.
+    void PrintSummary(std::ostream& out) {
+        const char* counterNames[STAT_COUNTERS] = {"files", "lines", "symbols", "symbol probes", "fixups", "output bytes", "cache hits", "cache misses"};
+
+        // Phases in the order they first ran
+        std::vector<const char*> order;
+        std::map<std::string, std::pair<uint64_t, uint64_t>> phases;   // Calls and nanoseconds
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            for (unsigned int i=0; i < events.size(); i++) {
+                std::pair<uint64_t, uint64_t>& phase = phases[events[i].name];
+                if (phase.first == 0)
+                    order.push_back(events[i].name);
+                phase.first++;
+                phase.second += events[i].duration;
+            }
+        }
+
+        out << std::endl << std::left << std::setw(20) << "phase" << std::right << std::setw(10) << "calls" << std::setw(14) << "ms" << std::endl;
+        for (unsigned int i=0; i < order.size(); i++) {
+            const std::pair<uint64_t, uint64_t>& phase = phases[order[i]];
+            out << std::left << std::setw(20) << order[i] << std::right << std::setw(10) << phase.first
+                << std::setw(14) << std::fixed << std::setprecision(3) << phase.second / 1e6 << std::endl;
+        }
+
+        out << std::endl;
+        for (unsigned int i=0; i < STAT_COUNTERS; i++)
+            out << std::left << std::setw(20) << counterNames[i] << std::right << std::setw(24) << Counter(i) << std::endl;
+        out << std::left << std::setw(20) << "heap allocations" << std::right << std::setw(24) << HeapAllocations() << std::endl;
+        out << std::left << std::setw(20) << "peak RSS (KB)" << std::right << std::setw(24) << PeakResidentKB() << std::endl;
+    }
+
+    /// Write the events as Chrome trace event JSON, returns -1 if the file could not be written.
+    int WriteTrace(const std::string& filename) {
+        std::ofstream trace(filename, std::ios::binary);
+        if (!trace)
+            return -1;
+
+        trace << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+        std::lock_guard<std::mutex> lock(mutex);
+        for (unsigned int i=0; i < events.size(); i++) {
+            const Event& event = events[i];
+            trace << "{\"name\":\"" << event.name << "\",\"cat\":\"x4\",\"ph\":\"X\",\"pid\":1,\"tid\":" << event.thread
+                  << ",\"ts\":" << event.start / 1000 << "." << std::setw(3) << std::setfill('0') << event.start % 1000
+                  << ",\"dur\":" << event.duration / 1000 << "." << std::setw(3) << std::setfill('0') << event.duration % 1000
+                  << std::setfill(' ') << "},\n";
+        }
+
+        // Counters as one sample at the end of the run
+        uint64_t end = Now();
+        trace << "{\"name\":\"counters\",\"ph\":\"C\",\"pid\":1,\"tid\":0,\"ts\":" << end / 1000 << ",\"args\":{";
+        const char* counterKeys[STAT_COUNTERS] = {"files", "lines", "symbols", "probes", "fixups", "outputBytes", "cacheHits", "cacheMisses"};
+        for (unsigned int i=0; i < STAT_COUNTERS; i++)
+            trace << "\"" << counterKeys[i] << "\":" << Counter(i) << ",";
+        trace << "\"heapAllocations\":" << HeapAllocations() << ",\"peakRssKB\":" << PeakResidentKB() << "}}\n";
+        trace << "]}\n";
+
+        return trace ? 0 : -1;
+    }
+
+private:
+
+    std::chrono::steady_clock::time_point epoch;
+    uint64_t heapAtStart;
+
+    std::atomic<uint64_t> counters[STAT_COUNTERS];
+
+    std::mutex mutex;
+    std::vector<Event> events;
+
+    // Small stable thread numbers for the trace
+    static uint32_t ThreadIndex() {
+        static std::atomic<uint32_t> nextThread(0);
+        static thread_local uint32_t index = nextThread.fetch_add(1, std::memory_order_relaxed);
+        return index;
+    }
+
+};
+
+
+// Time a scope as one phase, does nothing when stats are disabled
+class ScopedTimer {
+
+public:
+
+    ScopedTimer(Stats* owner, const char* phase) : stats(owner), name(phase), start(0) {
+        if (stats != nullptr)
+            start = stats->Now();
+    }
+
+    ~ScopedTimer() {
+        if (stats != nullptr)
+            stats->AddEvent(name, start, stats->Now() - start);
+    }
+
+    ScopedTimer(const ScopedTimer&) = delete;
+    ScopedTimer& operator=(const ScopedTimer&) = delete;
+
+private:
+
+    Stats* stats;
+    const char* name;
+    uint64_t start;
+
+};
+
+#endif
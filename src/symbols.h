@@ -0,0 +1,163 @@
+#ifndef _SYMBOL_TABLE__
+#define _SYMBOL_TABLE__
+
+#include <cctype>
+#include <string_view>
+
+#include "arena.h"
+
+#define SYMBOL_NOT_FOUND   0xFFFFFFFF
+
+// Initial number of hash slots, must be a power of two
+#define SYMBOL_TABLE_SLOTS  64
+
+struct Label {
+    std::string_view name;
+    uint32_t byteOffset;
+    bool defined;
+};
+
+// What an address field belongs to
+#define FIXUP_ADDRESS  0
+#define FIXUP_BRANCH   1                // The field of a branch, its opcode is the byte before it
+
+// 32-bit address field in the output waiting on a symbol
+struct Fixup {
+    uint32_t offset;
+    uint32_t symbol;
+    uint32_t line;
+    uint32_t kind;
+};
+
+// Case independent hash of a symbol name (FNV-1a over the upper cased characters)
+inline uint32_t SymbolHash(std::string_view name) {
+    uint32_t hash = 2166136261u;
+    for (char ch : name) {
+        hash ^= (uint8_t)toupper((uint8_t)ch);
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+// Compare a name against an interned (upper cased) symbol name
+inline bool SymbolEquals(std::string_view name, std::string_view interned) {
+    if (name.length() != interned.length())
+        return false;
+    for (size_t i=0; i < name.length(); i++)
+        if ((char)toupper((uint8_t)name[i]) != interned[i])
+            return false;
+    return true;
+}
+
+
+// Interned, case folded symbol names with hashed lookup.
+// Names, entries and hash slots are all drawn from an arena.
+class SymbolTable {
+
+public:
+
+    SymbolTable(Arena* owner) :
+        arena(owner),
+        entries(ArenaAllocator<Label>(owner)),
+        slots(ArenaAllocator<uint32_t>(owner)),
+        probeCount(0) {}
+
+    /// Return the index of a symbol or SYMBOL_NOT_FOUND.
+    uint32_t Find(std::string_view name) const {
+        uint64_t probes = 0;
+        return Find(name, probes);
+    }
+
+    /// Find a symbol, adding the number of hash slots visited to probes.
+    uint32_t Find(std::string_view name, uint64_t& probes) const {
+        if (slots.size() == 0)
+            return SYMBOL_NOT_FOUND;
+
+        uint32_t mask = slots.size() - 1;
+        for (uint32_t i = SymbolHash(name) & mask;; i = (i + 1) & mask) {
+            probes++;
+            uint32_t index = slots[i];
+            if (index == SYMBOL_NOT_FOUND)
+                return SYMBOL_NOT_FOUND;
+            if (SymbolEquals(name, entries[index].name))
+                return index;
+        }
+    }
+
+    /// Define a symbol and return its index.
+    /// Returns SYMBOL_NOT_FOUND if the name is already defined.
+    uint32_t Insert(std::string_view name, uint32_t byteOffset) {
+        uint32_t index = Reference(name);
+        if (entries[index].defined)
+            return SYMBOL_NOT_FOUND;
+        entries[index].byteOffset = byteOffset;
+        entries[index].defined = true;
+        return index;
+    }
+
+    /// Return the index of a symbol, adding it as undefined if it is not in the table yet.
+    uint32_t Reference(std::string_view name) {
+        uint32_t index = Find(name, probeCount);
+        if (index != SYMBOL_NOT_FOUND)
+            return index;
+
+        // Keep the load factor under one half
+        if ((entries.size() + 1) * 2 > slots.size())
+            Rehash(slots.size() == 0 ? SYMBOL_TABLE_SLOTS : slots.size() * 2);
+
+        // Intern the upper cased name
+        char* interned = static_cast<char*>(arena->Allocate(name.length(), 1));
+        for (size_t i=0; i < name.length(); i++)
+            interned[i] = toupper((uint8_t)name[i]);
+
+        index = entries.size();
+
+        Label label;
+        label.name = std::string_view(interned, name.length());
+        label.byteOffset = 0;
+        label.defined = false;
+        entries.push_back(label);
+
+        Place(index);
+        return index;
+    }
+
+    Label& operator[](uint32_t index) {return entries[index];}
+    const Label& operator[](uint32_t index) const {return entries[index];}
+
+    uint32_t size() const {return entries.size();}
+
+    /// Hash slots visited by the inserts and references since the last clear.
+    uint64_t Probes() const {return probeCount;}
+
+    /// Drop every symbol, must be called before the arena is reset.
+    void clear() {
+        std::vector<Label, ArenaAllocator<Label>>(ArenaAllocator<Label>(arena)).swap(entries);
+        std::vector<uint32_t, ArenaAllocator<uint32_t>>(ArenaAllocator<uint32_t>(arena)).swap(slots);
+        probeCount = 0;
+    }
+
+private:
+
+    Arena* arena;
+    std::vector<Label, ArenaAllocator<Label>> entries;
+    std::vector<uint32_t, ArenaAllocator<uint32_t>> slots;
+    uint64_t probeCount;
+
+    void Place(uint32_t index) {
+        uint32_t mask = slots.size() - 1;
+        uint32_t i = SymbolHash(entries[index].name) & mask;
+        while (slots[i] != SYMBOL_NOT_FOUND)
+            i = (i + 1) & mask;
+        slots[i] = index;
+    }
+
+    void Rehash(uint32_t slotCount) {
+        slots.assign(slotCount, SYMBOL_NOT_FOUND);
+        for (uint32_t i=0; i < entries.size(); i++)
+            Place(i);
+    }
+
+};
+
+#endif
@@ -0,0 +1,139 @@
+#ifndef _THREAD_POOL__
+#define _THREAD_POOL__
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Work stealing thread pool
+// Every worker owns a task queue. A worker runs its own newest task first and
+// steals the oldest task from another worker once its own queue is empty.
+class ThreadPool {
+
+public:
+
+    /// Start the workers, zero uses one worker per hardware thread.
+    ThreadPool(unsigned int threadCount = 0) : pending(0), stopping(false), nextQueue(0) {
+        if (threadCount == 0)
+            threadCount = std::thread::hardware_concurrency();
+        if (threadCount == 0)
+            threadCount = 1;
+
+        for (unsigned int i=0; i < threadCount; i++)
+            queues.emplace_back(new WorkQueue());
+        for (unsigned int i=0; i < threadCount; i++)
+            workers.emplace_back(&ThreadPool::WorkerLoop, this, i);
+    }
+
+    ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lock(sleepMutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (unsigned int i=0; i < workers.size(); i++)
+            workers[i].join();
+    }
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    /// Queue a task and return a future that becomes ready once it has run.
+    template <typename Task>
+    std::future<void> Submit(Task task) {
+        auto packaged = std::make_shared<std::packaged_task<void()>>(std::move(task));
+        std::future<void> future = packaged->get_future();
+
+        // Tasks queued from a worker stay on that worker, others are spread round robin
+        unsigned int index = (workerIndex != nullptr && workerPool == this) ? *workerIndex
+                           : nextQueue.fetch_add(1, std::memory_order_relaxed) % queues.size();
+        {
+            std::lock_guard<std::mutex> lock(queues[index]->mutex);
+            queues[index]->tasks.push_back([packaged]() {(*packaged)();});
+        }
+        {
+            std::lock_guard<std::mutex> lock(sleepMutex);
+            pending++;
+        }
+        wake.notify_one();
+        return future;
+    }
+
+    unsigned int size() const {return workers.size();}
+
+private:
+
+    struct WorkQueue {
+        std::mutex mutex;
+        std::deque<std::function<void()>> tasks;
+    };
+
+    std::vector<std::unique_ptr<WorkQueue>> queues;
+    std::vector<std::thread> workers;
+
+    std::mutex sleepMutex;
+    std::condition_variable wake;
+    unsigned int pending;
+    bool stopping;
+
+    std::atomic<unsigned int> nextQueue;
+
+    static inline thread_local const unsigned int* workerIndex = nullptr;
+    static inline thread_local const ThreadPool* workerPool = nullptr;
+
+    bool TakeTask(unsigned int index, std::function<void()>& task) {
+        // Newest task from our own queue
+        {
+            WorkQueue& own = *queues[index];
+            std::lock_guard<std::mutex> lock(own.mutex);
+            if (!own.tasks.empty()) {
+                task = std::move(own.tasks.back());
+                own.tasks.pop_back();
+                return true;
+            }
+        }
+
+        // Oldest task from somebody else
+        for (unsigned int i=1; i < queues.size(); i++) {
+            WorkQueue& victim = *queues[(index + i) % queues.size()];
+            std::lock_guard<std::mutex> lock(victim.mutex);
+            if (!victim.tasks.empty()) {
+                task = std::move(victim.tasks.front());
+                victim.tasks.pop_front();
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void WorkerLoop(unsigned int index) {
+        workerIndex = &index;
+        workerPool = this;
+
+        std::function<void()> task;
+        while (true) {
+            {
+                std::unique_lock<std::mutex> lock(sleepMutex);
+                wake.wait(lock, [this]() {return pending > 0 || stopping;});
+                if (pending == 0 && stopping)
+                    return;
+                pending--;
+            }
+
+            // A task was counted, keep looking until it is found in one of the queues
+            while (!TakeTask(index, task))
+                std::this_thread::yield();
+            task();
+            task = nullptr;
+        }
+    }
+
+};
+
+#endif
@@ -0,0 +1,130 @@
+#ifndef _FILE_WATCHER__
+#define _FILE_WATCHER__
+
+#include <string>
+#include <vector>
+
+#ifdef __linux__
+ #include <sys/inotify.h>
+ #include <poll.h>
+ #include <unistd.h>
+#endif
+
+
+// Waits until any of a set of files has been written
+// The directories are watched rather than the files, editors that save by writing a new file and
+// renaming it over the old one replace the file being watched.
+class FileWatcher {
+
+public:
+
+    FileWatcher() : descriptor(-1) {}
+
+    ~FileWatcher() {
+#ifdef __linux__
+        if (descriptor >= 0)
+            close(descriptor);
+#endif
+    }
+
+    FileWatcher(const FileWatcher&) = delete;
+    FileWatcher& operator=(const FileWatcher&) = delete;
+
+    /// True if files can be watched on this platform.
+    static bool Supported() {
+#ifdef __linux__
+        return true;
+#else
+        return false;
+#endif
+    }
+
+    /// Watch exactly the files given, returns -1 if one of their directories cannot be watched.
+    int Watch(const std::vector<std::string>& files) {
+#ifdef __linux__
+        if (descriptor < 0)
+            descriptor = inotify_init1(IN_CLOEXEC);
+        if (descriptor < 0)
+            return -1;
+
+        watched.clear();
+        for (unsigned int i=0; i < files.size(); i++) {
+            WatchedFile file;
+            size_t slash = files[i].find_last_of('/');
+            file.directory = (slash == std::string::npos) ? std::string(".") : files[i].substr(0, slash + 1);
+            file.name = (slash == std::string::npos) ? files[i] : files[i].substr(slash + 1);
+
+            // Adding a directory again returns the descriptor it already has
+            file.watch = inotify_add_watch(descriptor, file.directory.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO);
+            if (file.watch < 0)
+                return -1;
+            watched.push_back(file);
+        }
+        return 0;
+#else
+        (void)files;
+        return -1;
+#endif
+    }
+
+    /// Block until a watched file changes, returns -1 if the watch failed.
+    /// Every event already queued is read, a save that writes several times wakes the caller once.
+    int Wait() {
+#ifdef __linux__
+        if (descriptor < 0)
+            return -1;
+
+        bool changed = false;
+        while (!changed) {
+            struct pollfd request = {descriptor, POLLIN, 0};
+            if (poll(&request, 1, -1) < 0)
+                return -1;
+
+            do {
+                if (ReadEvents(changed) != 0)
+                    return -1;
+                request.revents = 0;
+            } while (poll(&request, 1, 0) > 0);
+        }
+        return 0;
+#else
+        return -1;
+#endif
+    }
+
+private:
+
+    struct WatchedFile {
+        std::string directory;
+        std::string name;
+        int watch;
+    };
+
+    int descriptor;
+    std::vector<WatchedFile> watched;
+
+#ifdef __linux__
+    int ReadEvents(bool& changed) {
+        alignas(struct inotify_event) char buffer[4096];
+        ssize_t length = read(descriptor, buffer, sizeof(buffer));
+        if (length <= 0)
+            return -1;
+
+        for (ssize_t offset=0; offset < length;) {
+            const struct inotify_event* event = reinterpret_cast<const struct inotify_event*>(buffer + offset);
+            offset += sizeof(struct inotify_event) + event->len;
+            if (event->len == 0)
+                continue;
+
+            std::string name(event->name);
+            for (unsigned int i=0; i < watched.size(); i++)
+                if (watched[i].watch == event->wd && watched[i].name == name)
+                    changed = true;
+        }
+        return 0;
+    }
+#endif
+
+};
+
+#endif
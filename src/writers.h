@@ -0,0 +1,428 @@
+#ifndef _OUTPUT_WRITERS__
+#define _OUTPUT_WRITERS__
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "image.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+ #define OUTPUT_MMAP
+ #include <cerrno>
+ #include <sys/mman.h>
+ #include <fcntl.h>
+ #include <unistd.h>
+ #if defined(__linux__) || defined(__FreeBSD__)
+  #define OUTPUT_PREALLOCATE
+ #endif
+#else
+ #include <fstream>
+#endif
+
+// Output formats
+#define OUTPUT_BINARY   0   // Raw image
+#define OUTPUT_CARRAY   1   // C source array
+#define OUTPUT_IHEX     2   // Intel HEX
+#define OUTPUT_SREC     3   // Motorola S-record
+#define OUTPUT_OBJECT   4   // Relocatable object, written by object.h
+
+// Bytes per row in the C array output
+#define CARRAY_BYTES_PER_ROW  24
+
+// Data bytes per record in the record formats
+#define IHEX_BYTES_PER_RECORD  16
+#define SREC_BYTES_PER_RECORD  16
+
+
+// Two upper case hex digits for every byte value
+struct HexTable {
+    char pair[256][2];
+};
+
+constexpr HexTable BuildHexTable() {
+    const char digits[] = "0123456789ABCDEF";
+    HexTable table = {};
+    for (unsigned int i=0; i < 256; i++) {
+        table.pair[i][0] = digits[i >> 4];
+        table.pair[i][1] = digits[i & 0x0F];
+    }
+    return table;
+}
+
+inline constexpr HexTable hexTable = BuildHexTable();
+
+/// Write the two hex digits of a byte and return the position after them.
+inline char* FormatHexByte(char* output, uint8_t value) {
+    output[0] = hexTable.pair[value][0];
+    output[1] = hexTable.pair[value][1];
+    return output + 2;
+}
+
+
+// Output file written in place
+// The file is created at its final size and memory mapped where the platform allows it,
+// otherwise the data is collected in a buffer and written with a single call on Close.
+// Only a file whose blocks are reserved up front is mapped. The blocks of a sparse file are found
+// when a page is first written, and a full disk or quota would then raise SIGBUS, which takes down
+// a server with every job it runs, instead of failing an open or a write.
+class OutputFile {
+
+public:
+
+    OutputFile() : data(nullptr), size(0), file(-1), mapped(false) {}
+    ~OutputFile() {Close();}
+
+    OutputFile(const OutputFile&) = delete;
+    OutputFile& operator=(const OutputFile&) = delete;
+
+    /// Create the file with the given size, returns -1 if it could not be created.
+    int Open(const std::string& filename, size_t length) {
+        Close();
+
+#ifdef OUTPUT_MMAP
+        file = open(filename.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (file < 0)
+            return -1;
+
+        if (length > 0) {
+            // A file system that cannot reserve blocks gets the buffer, a full one fails here
+            int reserved = EOPNOTSUPP;
+#ifdef OUTPUT_PREALLOCATE
+            reserved = posix_fallocate(file, 0, length);
+#endif
+            if (reserved != 0 && reserved != EINVAL && reserved != EOPNOTSUPP) {
+                Close();
+                return -1;
+            }
+            if (reserved != 0) {
+                buffer.resize(length);
+                data = buffer.data();
+                size = length;
+                return 0;
+            }
+
+            void* mapping = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_SHARED, file, 0);
+            if (mapping == MAP_FAILED) {
+                Close();
+                return -1;
+            }
+            data = static_cast<uint8_t*>(mapping);
+            size = length;
+            mapped = true;
+        }
+#else
+        name = filename;
+        buffer.resize(length);
+        data = buffer.data();
+        size = length;
+
+        // Create the file now so a bad path fails early
+        std::ofstream check(name, std::ios::binary | std::ios::trunc);
+        if (!check)
+            return -1;
+#endif
+        return 0;
+    }
+
+    /// Memory to fill with the file contents.
+    uint8_t* Data() {return data;}
+
+    /// Finish the file, returns -1 if it could not be written.
+    int Close() {
+        int result = 0;
+#ifdef OUTPUT_MMAP
+        if (mapped && munmap(data, size) != 0)
+            result = -1;
+        if (!mapped && file >= 0 && WriteBuffer() != 0)
+            result = -1;
+        if (file >= 0 && close(file) != 0)
+            result = -1;
+        file = -1;
+        mapped = false;
+        buffer.clear();
+#else
+        if (!name.empty()) {
+            std::ofstream output(name, std::ios::binary | std::ios::trunc);
+            output.write(reinterpret_cast<const char*>(buffer.data()), buffer.size());
+            if (!output)
+                result = -1;
+            name.clear();
+            buffer.clear();
+        }
+#endif
+        data = nullptr;
+        size = 0;
+        return result;
+    }
+
+private:
+
+    uint8_t* data;
+    size_t size;
+    int file;
+    bool mapped;
+    std::vector<uint8_t> buffer;        // The data when the file is not mapped
+
+#ifdef OUTPUT_MMAP
+    // Write the buffer to the file, a short write is carried on
+    int WriteBuffer() {
+        size_t written = 0;
+        while (written < buffer.size()) {
+            ssize_t result = write(file, buffer.data() + written, buffer.size() - written);
+            if (result < 0 && errno == EINTR)
+                continue;
+            if (result <= 0)
+                return -1;
+            written += result;
+        }
+        return 0;
+    }
+#else
+    std::string name;
+#endif
+
+};
+
+
+// Raw binary
+
+/// Write the image from address zero with the gaps zero filled, returns -1 if the file could not be written.
+/// Every segment is copied straight into place, the image is never flattened.
+inline int WriteBinary(const std::string& filename, const Image& image) {
+    OutputFile output;
+    if (output.Open(filename, image.End()) != 0)
+        return -1;
+    for (uint32_t i=0; i < image.SegmentCount(); i++) {
+        const ImageSegment& segment = image.Segment(i);
+        if (segment.size > 0)
+            memcpy(output.Data() + segment.base, segment.bytes.data(), segment.size);
+    }
+    return output.Close();
+}
+
+
+// C array
+//   uint8_t program[] = {
+//       0x90, 0xCB, ...
+//   };
+
+#define CARRAY_HEADER   "uint8_t program[] = {\n    "
+#define CARRAY_ROW      "\n    "
+#define CARRAY_FOOTER   "\n};"
+
+/// Return the exact length of the C array text for an image.
+inline size_t CArraySize(size_t count) {
+    return (sizeof(CARRAY_HEADER) - 1) + count * 6 + (count / CARRAY_BYTES_PER_ROW) * (sizeof(CARRAY_ROW) - 1) + (sizeof(CARRAY_FOOTER) - 1);
+}
+
+/// Format the image as a C array into a buffer of CArraySize bytes.
+inline void FormatCArray(const uint8_t* image, size_t count, char* output) {
+    memcpy(output, CARRAY_HEADER, sizeof(CARRAY_HEADER) - 1);
+    output += sizeof(CARRAY_HEADER) - 1;
+
+    unsigned int column = 0;
+    for (size_t i=0; i < count; i++) {
+        output[0] = '0';
+        output[1] = 'x';
+        output = FormatHexByte(output + 2, image[i]);
+        output[0] = ',';
+        output[1] = ' ';
+        output += 2;
+
+        if (++column == CARRAY_BYTES_PER_ROW) {
+            column = 0;
+            memcpy(output, CARRAY_ROW, sizeof(CARRAY_ROW) - 1);
+            output += sizeof(CARRAY_ROW) - 1;
+        }
+    }
+
+    memcpy(output, CARRAY_FOOTER, sizeof(CARRAY_FOOTER) - 1);
+}
+
+/// Write the image as a C array, returns -1 if the file could not be written.
+/// The array is the flat image, a sparse image is flattened first.
+inline int WriteCArray(const std::string& filename, const Image& image) {
+    std::vector<uint8_t> scratch;
+    const uint8_t* flat = image.Flat(scratch);
+
+    OutputFile output;
+    if (output.Open(filename, CArraySize(image.End())) != 0)
+        return -1;
+    FormatCArray(flat, image.End(), reinterpret_cast<char*>(output.Data()));
+    return output.Close();
+}
+
+
+// Record formats
+// Every byte is formatted and added to the record checksum in the same pass
+
+inline char* FormatRecordByte(char* output, uint8_t value, uint8_t& checksum) {
+    checksum += value;
+    return FormatHexByte(output, value);
+}
+
+
+// Intel HEX
+//   :LLAAAATT<data>CC   data records (00), an extended linear address record (04)
+//   whenever the upper 16 address bits change and the end of file record (01)
+//   Only the segments of the image are written, a record never crosses a 64K boundary
+
+/// Return the length of the data record starting at an address of a segment ending at end.
+inline unsigned int IntelHexRecordLength(uint32_t address, uint32_t end) {
+    uint32_t length = end - address;
+    if (length > IHEX_BYTES_PER_RECORD)
+        length = IHEX_BYTES_PER_RECORD;
+    uint32_t boundary = 0x10000 - (address & 0xFFFF);
+    return (length < boundary) ? length : boundary;
+}
+
+/// Return the exact length of the Intel HEX text for an image.
+inline size_t IntelHexSize(const Image& image) {
+    size_t size = 12;
+    uint32_t upper = 0;
+    for (uint32_t i=0; i < image.SegmentCount(); i++) {
+        const ImageSegment& segment = image.Segment(i);
+        uint32_t end = segment.base + segment.size;
+        for (uint32_t address=segment.base; address < end; ) {
+            if ((address >> 16) != upper) {
+                upper = address >> 16;
+                size += 16;
+            }
+            unsigned int length = IntelHexRecordLength(address, end);
+            size += 12 + length * 2;
+            address += length;
+        }
+    }
+    return size;
+}
+
+inline char* FormatIntelHexRecord(char* output, uint8_t type, uint16_t address, const uint8_t* data, unsigned int length) {
+    uint8_t checksum = 0;
+    *output++ = ':';
+    output = FormatRecordByte(output, length, checksum);
+    output = FormatRecordByte(output, address >> 8, checksum);
+    output = FormatRecordByte(output, address & 0xFF, checksum);
+    output = FormatRecordByte(output, type, checksum);
+    for (unsigned int i=0; i < length; i++)
+        output = FormatRecordByte(output, data[i], checksum);
+    output = FormatHexByte(output, (uint8_t)(0x100 - checksum));
+    *output++ = '\n';
+    return output;
+}
+
+/// Format the image as Intel HEX into a buffer of IntelHexSize bytes.
+inline void FormatIntelHex(const Image& image, char* output) {
+    uint32_t upper = 0;
+    for (uint32_t i=0; i < image.SegmentCount(); i++) {
+        const ImageSegment& segment = image.Segment(i);
+        uint32_t end = segment.base + segment.size;
+        for (uint32_t address=segment.base; address < end; ) {
+
+            // Upper 16 bits of the address for the records from here on
+            if ((address >> 16) != upper) {
+                upper = address >> 16;
+                uint8_t linear[2] = {(uint8_t)(upper >> 8), (uint8_t)upper};
+                output = FormatIntelHexRecord(output, 0x04, 0, linear, 2);
+            }
+
+            unsigned int length = IntelHexRecordLength(address, end);
+            output = FormatIntelHexRecord(output, 0x00, address & 0xFFFF, &segment.bytes[address - segment.base], length);
+            address += length;
+        }
+    }
+    FormatIntelHexRecord(output, 0x01, 0, nullptr, 0);
+}
+
+/// Write the image as Intel HEX, returns -1 if the file could not be written.
+inline int WriteIntelHex(const std::string& filename, const Image& image) {
+    OutputFile output;
+    if (output.Open(filename, IntelHexSize(image)) != 0)
+        return -1;
+    FormatIntelHex(image, reinterpret_cast<char*>(output.Data()));
+    return output.Close();
+}
+
+
+// Motorola S-record
+//   S0 header, S1/S2/S3 data records with 16, 24 or 32-bit addresses, whichever
+//   is the smallest that fits the image, and the matching S9/S8/S7 termination
+
+#define SREC_HEADER  "x4asm"
+
+/// Return the number of address bytes used for an image ending at an address.
+inline unsigned int SRecordAddressBytes(uint32_t end) {
+    if (end <= 0x10000)
+        return 2;
+    if (end <= 0x1000000)
+        return 3;
+    return 4;
+}
+
+/// Return the exact length of the S-record text for an image.
+inline size_t SRecordSize(const Image& image) {
+    size_t records = 0;
+    for (uint32_t i=0; i < image.SegmentCount(); i++)
+        records += (image.Segment(i).size + SREC_BYTES_PER_RECORD - 1) / SREC_BYTES_PER_RECORD;
+    size_t addressBytes = SRecordAddressBytes(image.End());
+    size_t header = 11 + (sizeof(SREC_HEADER) - 1) * 2;
+    return header + records * (7 + addressBytes * 2) + image.Size() * 2 + (7 + addressBytes * 2);
+}
+
+inline char* FormatSRecord(char* output, char type, unsigned int addressBytes, uint32_t address, const uint8_t* data, unsigned int length) {
+    uint8_t checksum = 0;
+    *output++ = 'S';
+    *output++ = type;
+    output = FormatRecordByte(output, addressBytes + length + 1, checksum);
+    for (unsigned int i=addressBytes; i > 0; i--)
+        output = FormatRecordByte(output, (uint8_t)(address >> ((i - 1) * 8)), checksum);
+    for (unsigned int i=0; i < length; i++)
+        output = FormatRecordByte(output, data[i], checksum);
+    output = FormatHexByte(output, (uint8_t)~checksum);
+    *output++ = '\n';
+    return output;
+}
+
+/// Format the image as S-records into a buffer of SRecordSize bytes, only the segments are written.
+inline void FormatSRecords(const Image& image, char* output) {
+    unsigned int addressBytes = SRecordAddressBytes(image.End());
+    char dataType = (char)('1' + addressBytes - 2);
+    char endType  = (char)('9' - addressBytes + 2);
+
+    output = FormatSRecord(output, '0', 2, 0, reinterpret_cast<const uint8_t*>(SREC_HEADER), sizeof(SREC_HEADER) - 1);
+
+    for (uint32_t i=0; i < image.SegmentCount(); i++) {
+        const ImageSegment& segment = image.Segment(i);
+        for (uint32_t offset=0; offset < segment.size; offset += SREC_BYTES_PER_RECORD) {
+            unsigned int length = (segment.size - offset < SREC_BYTES_PER_RECORD) ? segment.size - offset : SREC_BYTES_PER_RECORD;
+            output = FormatSRecord(output, dataType, addressBytes, segment.base + offset, &segment.bytes[offset], length);
+        }
+    }
+
+    // Execution starts at zero
+    FormatSRecord(output, endType, addressBytes, 0, nullptr, 0);
+}
+
+/// Write the image as S-records, returns -1 if the file could not be written.
+inline int WriteSRecords(const std::string& filename, const Image& image) {
+    OutputFile output;
+    if (output.Open(filename, SRecordSize(image)) != 0)
+        return -1;
+    FormatSRecords(image, reinterpret_cast<char*>(output.Data()));
+    return output.Close();
+}
+
+
+/// Write the image in one of the OUTPUT_ formats, returns -1 if the file could not be written.
+inline int WriteImage(int format, const std::string& filename, const Image& image) {
+    switch (format) {
+        case OUTPUT_BINARY: return WriteBinary(filename, image);
+        case OUTPUT_CARRAY: return WriteCArray(filename, image);
+        case OUTPUT_IHEX:   return WriteIntelHex(filename, image);
+        case OUTPUT_SREC:   return WriteSRecords(filename, image);
+    }
+    return -1;
+}
+
+#endif
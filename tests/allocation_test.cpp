@@ -0,0 +1,76 @@
+// Heap allocations of a warm assembly
+//
+// Build next to the assembler sources:
+//   g++ -std=c++17 -O2 -pthread -I../src allocation_test.cpp ../src/assembler.cpp ../src/Types.cpp -o allocation_test
+//
+// The test replaces the global operator new with the counting one of arena.h. An assembler that has
+// assembled a program once keeps its symbols, fixups and image buffers, so assembling it again into
+// the same result must not allocate at all.
+
+#define COUNT_HEAP_ALLOCATIONS
+
+#include <string>
+
+#include "types.h"
+#include "scanner.h"
+#include "assembler.h"
+
+#include "check.h"
+
+// A program with variables, labels referenced before and after they are defined, relaxed branches
+// and strings
+std::string AllocationSource() {
+    std::string source = "section .data\nCOUNT = 5\nLIMIT = 0x10\nsection .text\n";
+    for (int i=0; i < 400; i++) {
+        std::string label = "L" + std::to_string(i);
+        source += label + ": MOV AL, 0x41\n";
+        source += "  MOV AX, $L" + std::to_string((i + 7) % 400) + "\n";
+        source += "  CMP AL, BL\n";
+        source += "  JNE L" + std::to_string((i + 399) % 400) + "\n";
+        source += "  CALL L" + std::to_string((i * 13) % 400) + "\n";
+        source += "  DB 'warm', 0\n";
+        source += "  PUSH AL\n  POP BH\n";
+    }
+    source += "  RET\n";
+    return source;
+}
+
+// Assemble and return the number of heap allocations it took
+uint64_t CountAssembly(x4::Assembler& assembler, const ScanResult& scan, x4::AssemblyResult& result) {
+    uint64_t before = HeapAllocationCount();
+    int status = assembler.Assemble(scan, result);
+    uint64_t allocations = HeapAllocationCount() - before;
+    CHECK(status == 0);
+    return allocations;
+}
+
+
+void TestWarmAssembly(bool longBranches) {
+    std::string source = AllocationSource();
+    ScanResult scan;
+    ScanSource(source, scan);
+
+    x4::Assembler assembler;
+    assembler.SetLongBranches(longBranches);
+    x4::AssemblyResult result;
+
+    // The first assembly grows every buffer. The image is swapped into the result, so the second
+    // grows the buffer the result gives back and from the third on both images are warm.
+    uint64_t cold = CountAssembly(assembler, scan, result);
+    CountAssembly(assembler, scan, result);
+    CHECK(cold > 0);
+
+    std::vector<uint8_t> expected = FlatBytes(result.image);
+    for (int run=0; run < 3; run++) {
+        CHECK(CountAssembly(assembler, scan, result) == 0);
+        CHECK(result.diagnostics.empty());
+    }
+    CHECK(FlatBytes(result.image) == expected);
+}
+
+
+int main() {
+    TestWarmAssembly(false);
+    TestWarmAssembly(true);
+    return TestResult("allocation_test");
+}
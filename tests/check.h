@@ -0,0 +1,41 @@
+#ifndef _X4_TEST_CHECK__
+#define _X4_TEST_CHECK__
+
+#include <cstdint>
+#include <iostream>
+#include <vector>
+
+#include "image.h"
+
+// Checks shared by the test programs
+// A failed check prints its condition and line and the test goes on, main returns TestResult()
+// so a run with any failed check exits with 1.
+
+inline int testChecks = 0;
+inline int testFailures = 0;
+
+#define CHECK(condition) CheckCondition((condition), #condition, __FILE__, __LINE__)
+
+inline bool CheckCondition(bool passed, const char* condition, const char* file, int line) {
+    testChecks++;
+    if (!passed) {
+        testFailures++;
+        std::cerr << file << "(" << line << "): Check failed: " << condition << std::endl;
+    }
+    return passed;
+}
+
+/// Print the outcome of the checks and return the exit status of the test.
+inline int TestResult(const char* name) {
+    std::cout << name << ": " << testChecks << " checks, " << testFailures << " failed" << std::endl;
+    return (testFailures > 0) ? 1 : 0;
+}
+
+/// The image as the bytes of a flat binary.
+inline std::vector<uint8_t> FlatBytes(const Image& image) {
+    std::vector<uint8_t> scratch;
+    const uint8_t* flat = image.Flat(scratch);
+    return std::vector<uint8_t>(flat, flat + image.End());
+}
+
+#endif
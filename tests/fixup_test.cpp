@@ -0,0 +1,106 @@
+// Single pass assembly against the bytes of the two pass assembler
+//
+// Build next to the assembler sources:
+//   g++ -std=c++17 -O2 -pthread -I../src fixup_test.cpp ../src/assembler.cpp ../src/Types.cpp -o fixup_test
+//
+// The expected bytes were written by the two pass assembler the fixup list replaced. Labels are
+// referenced before and after they are defined, by branches and by $label address moves.
+
+#include <string_view>
+#include <vector>
+
+#include "types.h"
+#include "assembler.h"
+
+#include "check.h"
+
+const std::string_view fixupSource =
+    "section .data\n"
+    "COUNT = 5\n"
+    "section .text\n"
+    "START:\n"
+    "  MOV AX, $MESSAGE\n"
+    "  CALL PRINT\n"
+    "  JMP FORWARD\n"
+    "BACK:\n"
+    "  CMP AL, 0x41\n"
+    "  JE DONE\n"
+    "  MOV BX, $BACK\n"
+    "FORWARD:\n"
+    "  MOV AL, 0x41\n"
+    "  CMP AL, BL\n"
+    "  JNE BACK\n"
+    "  JG FORWARD\n"
+    "  JL PRINT\n"
+    "  MOV CX, $DONE\n"
+    "PRINT:\n"
+    "  PUSH AL\n"
+    "  INT 0x10\n"
+    "  POP AL\n"
+    "  RET\n"
+    "MESSAGE:\n"
+    "  DB 'Hi', 0\n"
+    "DONE:\n"
+    "  JMP START\n";
+
+const uint8_t twoPassBytes[] = {
+    0x83, 0x00, 0x40, 0x00, 0x00, 0x00, 0x9A, 0x39, 0x00, 0x00, 0x00, 0xFE,
+    0x1E, 0x00, 0x00, 0x00, 0x38, 0x00, 0x41, 0x74, 0x43, 0x00, 0x00, 0x00,
+    0x83, 0x02, 0x10, 0x00, 0x00, 0x00, 0x89, 0x00, 0x41, 0x39, 0x00, 0x02,
+    0xF3, 0x10, 0x00, 0x00, 0x00, 0x75, 0x1E, 0x00, 0x00, 0x00, 0xF1, 0x39,
+    0x00, 0x00, 0x00, 0x83, 0x04, 0x43, 0x00, 0x00, 0x00, 0xF0, 0x00, 0xCD,
+    0x10, 0x0F, 0x00, 0xCB, 0x48, 0x69, 0x00, 0xFE, 0x00, 0x00, 0x00, 0x00,
+};
+
+
+// Every label field is patched with the address the two pass assembler found for it
+void TestForwardReferences() {
+    x4::Assembler assembler;
+    assembler.SetLongBranches(true);
+    x4::AssemblyResult result;
+    CHECK(assembler.Assemble(fixupSource, result) == 0);
+    CHECK(result.diagnostics.empty());
+    CHECK(FlatBytes(result.image) == std::vector<uint8_t>(twoPassBytes, twoPassBytes + sizeof(twoPassBytes)));
+
+    // Nothing of the first assembly is left in the symbols of the second
+    x4::AssemblyResult again;
+    CHECK(assembler.Assemble(fixupSource, again) == 0);
+    CHECK(FlatBytes(again.image) == FlatBytes(result.image));
+}
+
+// A label that is never defined is reported on the line that names it, a forward reference is not
+void TestUnknownLabels() {
+    std::string source(fixupSource);
+    source += "  JMP NOWHERE\n";
+    source += "  MOV AX, $NOWHERE\n";
+
+    x4::Assembler assembler;
+    assembler.SetLongBranches(true);
+    x4::AssemblyResult result;
+    CHECK(assembler.Assemble(source, result) != 0);
+    CHECK(result.errorCount == 2);
+    if (CHECK(result.diagnostics.size() == 2)) {
+        CHECK(result.diagnostics[0].line == 27);
+        CHECK(result.diagnostics[0].message == "Unknown label NOWHERE");
+        CHECK(result.diagnostics[1].line == 28);
+    }
+}
+
+// An address move names its label with a $, without it the operand is not a label address
+void TestAddressMoveSyntax() {
+    x4::Assembler assembler;
+    x4::AssemblyResult result;
+    CHECK(assembler.Assemble("section .text\nSTART:\n  MOV AX, START\n", result) != 0);
+    if (CHECK(result.diagnostics.size() == 1)) {
+        CHECK(result.diagnostics[0].line == 2);
+        CHECK(result.diagnostics[0].message == "Unknown label START");
+    }
+}
+
+
+int main() {
+    TestForwardReferences();
+    TestUnknownLabels();
+    TestAddressMoveSyntax();
+    return TestResult("fixup_test");
+}
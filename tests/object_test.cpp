@@ -0,0 +1,74 @@
+// Symbols an object module shares with other modules
+//
+// Build next to the assembler sources:
+//   g++ -std=c++17 -O2 -pthread -I../src object_test.cpp ../src/assembler.cpp ../src/Types.cpp -o object_test
+//
+// GLOBAL and EXTERN name their symbols on one line, as many as a statement keeps tokens. A line
+// naming more is an error, none of its symbols may be dropped quietly.
+
+#include <string>
+
+#include "types.h"
+#include "assembler.h"
+#include "object.h"
+
+#include "check.h"
+
+// A module defining count labels, all of them named by one GLOBAL, and calling count imports named by one EXTERN
+std::string SymbolSource(uint32_t count) {
+    std::string global = "GLOBAL";
+    std::string external = "EXTERN";
+    std::string text;
+    for (uint32_t i=1; i <= count; i++) {
+        std::string name = std::to_string(i);
+        global += ((i > 1) ? ", S" : " S") + name;
+        external += ((i > 1) ? ", E" : " E") + name;
+        text += "S" + name + ":\n  CALL E" + name + "\n";
+    }
+    return "section .text\n" + global + "\n" + external + "\n" + text + "  RET\n";
+}
+
+int AssembleModule(const std::string& source, x4::AssemblyResult& result, ObjectFile& object) {
+    x4::Assembler assembler;
+    return assembler.AssembleObject(source, result, object);
+}
+
+
+// As many symbols as a line holds are all exported and imported
+void TestFullLine() {
+    uint32_t count = MAX_STATEMENT_TOKENS - 1;
+    x4::AssemblyResult result;
+    ObjectFile object;
+    CHECK(AssembleModule(SymbolSource(count), result, object) == 0);
+    CHECK(object.exports.size() == count);
+    CHECK(object.imports.size() == count);
+    for (uint32_t i=0; i < object.exports.size() && i < count; i++) {
+        CHECK(object.exports[i].name == "S" + std::to_string(i + 1));
+        CHECK(object.imports[i] == "E" + std::to_string(i + 1));
+    }
+}
+
+// One symbol more is reported on the line of the GLOBAL
+void TestTooManySymbols() {
+    for (uint32_t count=MAX_STATEMENT_TOKENS; count <= MAX_STATEMENT_TOKENS + 1; count++) {
+        x4::AssemblyResult result;
+        ObjectFile object;
+        CHECK(AssembleModule(SymbolSource(count), result, object) != 0);
+        CHECK(result.errorCount == 1);
+        CHECK(!result.diagnostics.empty() && result.diagnostics[0].line == 1);
+        CHECK(!result.diagnostics.empty() && result.diagnostics[0].message == "Too many symbols, at most " + std::to_string(MAX_STATEMENT_TOKENS - 1) + " on one line");
+    }
+
+    // The same names over two lines are fine
+    x4::AssemblyResult result;
+    ObjectFile object;
+    CHECK(AssembleModule("section .text\nGLOBAL S1, S2, S3, S4, S5\nGLOBAL S6, S7, S8, S9\nS1:\nS2:\nS3:\nS4:\nS5:\nS6:\nS7:\nS8:\nS9:\n  RET\n", result, object) == 0);
+    CHECK(object.exports.size() == 9);
+}
+
+
+int main() {
+    TestFullLine();
+    TestTooManySymbols();
+    return TestResult("object_test");
+}
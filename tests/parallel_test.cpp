@@ -0,0 +1,122 @@
+// Parallel assembly against serial assembly
+//
+// Build next to the assembler sources:
+//   g++ -std=c++17 -O2 -pthread -I../src -I../bench parallel_test.cpp ../src/assembler.cpp ../src/Types.cpp -o parallel_test
+//
+// Generated corpora large enough for many chunks are assembled serially and on several thread
+// counts, with relaxed and with long branches. The images and the diagnostics must be identical.
+
+#include <string>
+#include <vector>
+
+#include "types.h"
+#include "scanner.h"
+#include "assembler.h"
+
+#include "generator.h"
+#include "check.h"
+
+// Lines of the generated corpora, several chunks of PARALLEL_CHUNK_LINES each
+#define PARALLEL_TEST_LINES  (PARALLEL_CHUNK_LINES * 7 + 1234)
+
+bool SameDiagnostics(const std::vector<x4::Diagnostic>& a, const std::vector<x4::Diagnostic>& b) {
+    if (a.size() != b.size())
+        return false;
+    for (size_t i=0; i < a.size(); i++)
+        if (a[i].line != b[i].line || a[i].type != b[i].type || a[i].message != b[i].message)
+            return false;
+    return true;
+}
+
+// Assemble a source serially and on several thread counts and compare every result with the serial one
+// A failed assembly writes no image, only its diagnostics are compared
+void CheckParallel(const std::string& source, bool longBranches, bool assembles) {
+    ScanResult scan;
+    ScanSource(source, scan);
+
+    x4::Assembler serial;
+    serial.SetLongBranches(longBranches);
+    x4::AssemblyResult expected;
+    int expectedStatus = serial.Assemble(scan, expected);
+    CHECK((expectedStatus == 0) == assembles);
+    std::vector<uint8_t> expectedBytes = FlatBytes(expected.image);
+
+    const unsigned int threadCounts[] = {2, 3, 8};
+    for (unsigned int t=0; t < 3; t++) {
+        x4::Assembler parallel;
+        parallel.SetLongBranches(longBranches);
+        parallel.SetThreadCount(threadCounts[t]);
+
+        // A second assembly on the same context reuses its chunks
+        for (int run=0; run < 2; run++) {
+            x4::AssemblyResult result;
+            CHECK(parallel.Assemble(scan, result) == expectedStatus);
+            if (expectedStatus == 0)
+                CHECK(FlatBytes(result.image) == expectedBytes);
+            CHECK(SameDiagnostics(result.diagnostics, expected.diagnostics));
+        }
+    }
+}
+
+
+// Generated corpora with labels referenced across every chunk boundary
+void TestGeneratedCorpora() {
+    GeneratorSettings settings = DefaultGeneratorSettings();
+    settings.lines = PARALLEL_TEST_LINES;
+
+    const uint64_t seeds[] = {1, 0x5EED};
+    for (unsigned int s=0; s < 2; s++) {
+        settings.seed = seeds[s];
+        std::string source = GenerateSource(settings);
+        CheckParallel(source, false, true);
+        CheckParallel(source, true, true);
+    }
+
+    // Mostly branches, where relaxation moves every label
+    settings.seed = 7;
+    settings.forwardRatio = 0.9;
+    ParseGeneratorMix("branch:60,mov:20,nop:20", settings);
+    std::string branches = GenerateSource(settings);
+    CheckParallel(branches, false, true);
+    CheckParallel(branches, true, true);
+}
+
+// A generated corpus with a line added every so many lines
+std::string InsertLines(const std::string& generated, uint32_t every, const std::string& inserted) {
+    std::string source;
+    uint32_t line = 0;
+    size_t start = 0;
+    while (start < generated.size()) {
+        size_t end = generated.find('\n', start) + 1;
+        source.append(generated, start, end - start);
+        start = end;
+        if (++line % every == 0)
+            source += inserted;
+    }
+    return source;
+}
+
+// Errors in several chunks are reported in line order, as the serial assembly reports them
+void TestDiagnostics() {
+    GeneratorSettings settings = DefaultGeneratorSettings();
+    settings.lines = PARALLEL_TEST_LINES;
+    settings.seed = 3;
+    std::string generated = GenerateSource(settings);
+
+    // Unknown labels are reported once every label is known, the assembly goes on past them
+    std::string unknown = InsertLines(generated, 9000, "    JMP NOWHERE\n    MOV AX, $NOWHERE\n");
+    CheckParallel(unknown, false, false);
+    CheckParallel(unknown, true, false);
+
+    // A duplicate label stops the assembly
+    std::string duplicate = InsertLines(generated, 20000, "LABEL0:\n");
+    CheckParallel(duplicate, false, false);
+    CheckParallel(duplicate, true, false);
+}
+
+
+int main() {
+    TestGeneratedCorpora();
+    TestDiagnostics();
+    return TestResult("parallel_test");
+}
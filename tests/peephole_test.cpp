@@ -0,0 +1,111 @@
+// Rewrite rules of the peephole optimizer
+//
+// Build next to the assembler sources:
+//   g++ -std=c++17 -O2 -pthread -I../src peephole_test.cpp ../src/assembler.cpp ../src/Types.cpp -o peephole_test
+//
+// Every rule is run on a program it applies to and on one where a label, an ORG or a loop of jumps
+// must keep it from applying. A removed instruction leaves its line behind, with the label if it had one.
+
+#include <string>
+
+#include "types.h"
+#include "scanner.h"
+#include "peephole.h"
+
+#include "check.h"
+
+// Optimize a program and return its lines, one per line of the source
+std::string Optimize(const std::string& source, PeepholeReport& report) {
+    ScanResult scan;
+    ScanSource(source, scan);
+    ScanResult output;
+    PeepholeOptimizer optimizer;
+    optimizer.Optimize(scan, output);
+    report = optimizer.Report();
+
+    std::string text;
+    for (unsigned int i=0; i < output.lines.size(); i++)
+        text += std::string(output.lines[i]) + "\n";
+    return text;
+}
+
+uint32_t Rewrites(const PeepholeReport& report) {
+    uint32_t rewrites = 0;
+    for (uint32_t rule=0; rule < PEEPHOLE_RULES; rule++)
+        rewrites += report.rewrites[rule];
+    return rewrites;
+}
+
+// A program the rules must leave as it is
+void CheckKept(const std::string& source) {
+    PeepholeReport report;
+    CHECK(Optimize(source, report) == source);
+    CHECK(Rewrites(report) == 0);
+}
+
+
+void TestSelfMove() {
+    PeepholeReport report;
+    CHECK(Optimize("section .text\n  MOV AL, AL\n  MOV AL, BL\nSAME: MOV BL, BL\n  RET\n", report) ==
+          "section .text\n  \n  MOV AL, BL\nSAME: \n  RET\n");
+    CHECK(report.rewrites[PEEPHOLE_SELF_MOVE] == 2);
+    CHECK(report.cycles[PEEPHOLE_SELF_MOVE] == 2 * (uint64_t)opcodeTable[FindOpcode("MOV")].cycles);
+}
+
+// A POP a label stands before is reached without the PUSH
+void TestPushPop() {
+    PeepholeReport report;
+    CHECK(Optimize("section .text\n  PUSH AL\n  POP AL\n  PUSH AL\n  POP BL\n  RET\n", report) ==
+          "section .text\n  \n  \n  PUSH AL\n  POP BL\n  RET\n");
+    CHECK(report.rewrites[PEEPHOLE_PUSH_POP] == 1);
+    CHECK(report.bytes[PEEPHOLE_PUSH_POP] == 4);
+
+    CheckKept("section .text\n  PUSH AL\nBACK: POP AL\n  JNE BACK\n  RET\n");
+}
+
+// A compare a label stands before is reached with other flags
+void TestRepeatedCompare() {
+    PeepholeReport report;
+    CHECK(Optimize("section .text\n  CMP AL, BL\n  JE EQUAL\n  JG GREATER\n  CMP AL, BL\n  JL GREATER\nEQUAL: RET\nGREATER: RET\n", report) ==
+          "section .text\n  CMP AL, BL\n  JE EQUAL\n  JG GREATER\n  \n  JL GREATER\nEQUAL: RET\nGREATER: RET\n");
+    CHECK(report.rewrites[PEEPHOLE_REPEATED_CMP] == 1);
+
+    CheckKept("section .text\n  CMP AL, BL\n  JE DONE\nAGAIN: CMP AL, BL\n  JNE AGAIN\nDONE: RET\n");
+    CheckKept("section .text\n  CMP AL, BL\n  INC AL\n  CMP AL, BL\n  RET\n");
+}
+
+// Code placed by ORG is not what follows a jump, even when the label is the next one in the source
+void TestJumpToNext() {
+    PeepholeReport report;
+    CHECK(Optimize("section .text\n  JMP NEXT\nNEXT: JE LAST\nLAST: RET\n", report) ==
+          "section .text\n  \nNEXT: \nLAST: RET\n");
+    CHECK(report.rewrites[PEEPHOLE_JUMP_TO_NEXT] == 2);
+
+    CheckKept("section .text\n  JMP NEXT\nORG 0x100\nNEXT: RET\n");
+    CheckKept("section .text\n  JMP NEXT\nNEXT: ORG 0x100\n  RET\n");
+}
+
+void TestJumpChain() {
+    PeepholeReport report;
+    CHECK(Optimize("section .text\n  JE FIRST\n  CALL FIRST\n  RET\nFIRST: JMP SECOND\n  RET\nSECOND: JMP THIRD\n  RET\nTHIRD: RET\n", report) ==
+          "section .text\n  JE THIRD\n  CALL THIRD\n  RET\nFIRST: JMP THIRD\n  RET\nSECOND: JMP THIRD\n  RET\nTHIRD: RET\n");
+    CHECK(report.rewrites[PEEPHOLE_JUMP_CHAIN] == 3);
+}
+
+// Jumps going round in a loop have nowhere to be sent, the optimizer stops with them as they are
+void TestJumpLoops() {
+    CheckKept("section .text\n  JE FIRST\n  RET\nFIRST: JMP SECOND\n  RET\nSECOND: JMP FIRST\n");
+    CheckKept("section .text\n  CALL SELF\n  RET\nSELF: JMP SELF\n");
+    CheckKept("section .text\n  JE A\n  RET\nA: JMP B\n  RET\nB: JMP C\n  RET\nC: JMP B\n");
+}
+
+
+int main() {
+    TestSelfMove();
+    TestPushPop();
+    TestRepeatedCompare();
+    TestJumpToNext();
+    TestJumpChain();
+    TestJumpLoops();
+    return TestResult("peephole_test");
+}
@@ -0,0 +1,112 @@
+// Macro parameter and argument lists of the preprocessor
+//
+// Build next to the assembler sources:
+//   g++ -std=c++17 -O2 -pthread -I../src preprocessor_test.cpp ../src/assembler.cpp ../src/Types.cpp -o preprocessor_test
+//
+// A statement keeps MAX_STATEMENT_TOKENS tokens, so a MACRO line holds the name and six parameters
+// and an invocation seven arguments. Longer lists are errors on their own line, never cut short.
+
+#include <string>
+
+#include "types.h"
+#include "preprocessor.h"
+
+#include "check.h"
+
+// Names P1 to Pcount, or the numbers 1 to count, separated by commas
+std::string List(const char* prefix, uint32_t count) {
+    std::string list;
+    for (uint32_t i=1; i <= count; i++)
+        list += ((i > 1) ? ", " : " ") + std::string(prefix) + std::to_string(i);
+    return list;
+}
+
+// The preprocessed text of a source, or its first error and the zero based line of it
+struct Preprocessed {
+    int status;
+    std::string text;
+    std::string error;
+    uint32_t errorLine;
+};
+
+Preprocessed Preprocess(const std::string& source) {
+    PreprocessOptions options;
+    Preprocessor preprocessor(options, nullptr);
+    preprocessor.OpenText("test.asm", source);
+
+    Preprocessed result = {preprocessor.Run(), std::string(), std::string(), 0};
+    if (!preprocessor.Errors().empty()) {
+        result.error = preprocessor.Errors()[0].message;
+        result.errorLine = preprocessor.Errors()[0].origin.line;
+    }
+    const ScanResult& lines = preprocessor.Lines();
+    for (unsigned int i=0; i < lines.lines.size(); i++)
+        result.text += std::string(lines.lines[i]) + "\n";
+    return result;
+}
+
+// A macro with count parameters, the body moves every one of them into AL
+std::string Definition(uint32_t count) {
+    std::string body;
+    for (uint32_t i=1; i <= count; i++)
+        body += "  MOV AL, P" + std::to_string(i) + "\n";
+    return "MACRO LOAD" + List("P", count) + "\n" + body + "ENDM\n";
+}
+
+
+// The longest lists expand with every argument in its place
+void TestLongestLists() {
+    uint32_t count = MAX_STATEMENT_TOKENS - 2;
+    Preprocessed result = Preprocess("section .text\n" + Definition(count) + "  LOAD" + List("", count) + "\n");
+    CHECK(result.status == 0);
+
+    std::string expected = "section .text\n";
+    for (uint32_t i=1; i <= count; i++)
+        expected += "  MOV AL, " + std::to_string(i) + "\n";
+    CHECK(result.text == expected);
+}
+
+// A definition with more parameters than a statement holds is reported on its MACRO line
+void TestTooManyParameters() {
+    for (uint32_t count=MAX_STATEMENT_TOKENS - 1; count <= MAX_STATEMENT_TOKENS + 1; count++) {
+        Preprocessed result = Preprocess("section .text\n" + Definition(count) + "  LOAD" + List("", count) + "\n");
+        CHECK(result.status != 0);
+        CHECK(result.error == "Too many macro parameters, at most " + std::to_string(MAX_STATEMENT_TOKENS - 2));
+        CHECK(result.errorLine == 1);
+    }
+}
+
+// An invocation with more arguments than a statement holds is reported on its line
+void TestTooManyArguments() {
+    std::string definition = Definition(MAX_STATEMENT_TOKENS - 2);
+    Preprocessed result = Preprocess("section .text\n" + definition + "  LOAD" + List("", MAX_STATEMENT_TOKENS) + "\n");
+    CHECK(result.status != 0);
+    CHECK(result.error == "Too many macro arguments, at most " + std::to_string(MAX_STATEMENT_TOKENS - 1));
+    CHECK(result.errorLine == MAX_STATEMENT_TOKENS + 1);
+
+    // One argument too many that the statement still holds is a count mismatch
+    result = Preprocess("section .text\n" + definition + "  LOAD" + List("", MAX_STATEMENT_TOKENS - 1) + "\n");
+    CHECK(result.status != 0);
+    CHECK(result.error == "Macro LOAD takes " + std::to_string(MAX_STATEMENT_TOKENS - 2) + " argument(s)");
+}
+
+// DEFINE names its symbols on one line as GLOBAL does
+void TestTooManyDefines() {
+    Preprocessed result = Preprocess("DEFINE" + List("D", MAX_STATEMENT_TOKENS - 1) + "\nIFDEF D7\nsection .text\nENDIF\n");
+    CHECK(result.status == 0);
+    CHECK(result.text == "section .text\n");
+
+    result = Preprocess("DEFINE" + List("D", MAX_STATEMENT_TOKENS) + "\nsection .text\n");
+    CHECK(result.status != 0);
+    CHECK(result.error == "Too many symbols, at most " + std::to_string(MAX_STATEMENT_TOKENS - 1) + " on one line");
+    CHECK(result.errorLine == 0);
+}
+
+
+int main() {
+    TestLongestLists();
+    TestTooManyParameters();
+    TestTooManyArguments();
+    TestTooManyDefines();
+    return TestResult("preprocessor_test");
+}
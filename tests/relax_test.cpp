@@ -0,0 +1,217 @@
+// Branch relaxation at the limits of the short and near forms
+//
+// Build next to the assembler sources:
+//   g++ -std=c++17 -O2 -pthread -I../src relax_test.cpp ../src/assembler.cpp ../src/Types.cpp -o relax_test
+//
+// A short branch is its opcode, 0xE0 to 0xE5, and an 8-bit displacement, a near branch its opcode,
+// 0xE8 to 0xED, and a 16-bit displacement, both from the end of the branch. Branches are placed
+// exactly at the reach of each form and one byte past it, and where only the branches before them
+// decide which form they take.
+
+#include <string>
+#include <vector>
+
+#include "types.h"
+#include "assembler.h"
+
+#include "check.h"
+
+struct BranchMnemonic {
+    const char* name;
+    uint8_t longOpcode;
+};
+
+const BranchMnemonic branchMnemonics[] = {
+    {"JMP",  JMP_OPCODE},
+    {"JE",   JE_OPCODE},
+    {"JNE",  JNE_OPCODE},
+    {"JG",   JG_OPCODE},
+    {"JL",   JL_OPCODE},
+    {"CALL", CALL_OPCODE},
+};
+
+#define PAD_BYTE  'x'
+
+// Lines of DB strings assembling to size bytes of PAD_BYTE
+std::string Pad(uint32_t size) {
+    std::string lines;
+    while (size > 0) {
+        uint32_t length = (size < 64) ? size : 64;
+        lines += "  DB '" + std::string(length, PAD_BYTE) + "'\n";
+        size -= length;
+    }
+    return lines;
+}
+
+void AppendPad(std::vector<uint8_t>& bytes, uint32_t size) {
+    bytes.insert(bytes.end(), size, PAD_BYTE);
+}
+
+// An opcode and a field of size bytes, low byte first
+void AppendField(std::vector<uint8_t>& bytes, uint8_t opcode, uint32_t field, uint32_t size) {
+    bytes.push_back(opcode);
+    for (uint32_t i=0; i < size; i++)
+        bytes.push_back((uint8_t)(field >> (i * 8)));
+}
+
+void AppendShort(std::vector<uint8_t>& bytes, uint32_t mnemonic, int32_t displacement) {
+    AppendField(bytes, 0xE0 + mnemonic, (uint32_t)displacement, 1);
+}
+
+void AppendNear(std::vector<uint8_t>& bytes, uint32_t mnemonic, int32_t displacement) {
+    AppendField(bytes, 0xE8 + mnemonic, (uint32_t)displacement, 2);
+}
+
+void AppendLong(std::vector<uint8_t>& bytes, uint32_t mnemonic, uint32_t address) {
+    AppendField(bytes, branchMnemonics[mnemonic].longOpcode, address, 4);
+}
+
+// MOV of a label address into the register with this code
+void AppendMove(std::vector<uint8_t>& bytes, uint8_t reg, uint32_t address) {
+    bytes.push_back(MOVA_OPCODE);
+    AppendField(bytes, reg, address, 4);
+}
+
+// Assemble a text section with relaxed branches, empty if it does not assemble
+std::vector<uint8_t> Relaxed(const std::string& text) {
+    x4::Assembler assembler;
+    x4::AssemblyResult result;
+    if (!CHECK(assembler.Assemble("section .text\n" + text, result) == 0))
+        return {};
+    return FlatBytes(result.image);
+}
+
+
+// A forward branch over padding to its label and a backward branch over padding from its label
+std::string Forward(uint32_t mnemonic, uint32_t padding) {
+    return std::string("  ") + branchMnemonics[mnemonic].name + " TARGET\n" + Pad(padding) + "TARGET:\n  NOP\n";
+}
+
+std::string Backward(uint32_t mnemonic, uint32_t padding) {
+    return "TARGET:\n" + Pad(padding) + "  " + branchMnemonics[mnemonic].name + " TARGET\n";
+}
+
+// Displacements of -128 and 127 are short, one byte further is near
+void TestShortLimits() {
+    for (uint32_t m=0; m < 6; m++) {
+        std::vector<uint8_t> expected;
+        AppendShort(expected, m, 127);
+        AppendPad(expected, 127);
+        expected.push_back(NOP_OPCODE);
+        CHECK(Relaxed(Forward(m, 127)) == expected);
+
+        expected.clear();
+        AppendNear(expected, m, 128);
+        AppendPad(expected, 128);
+        expected.push_back(NOP_OPCODE);
+        CHECK(Relaxed(Forward(m, 128)) == expected);
+
+        expected.clear();
+        AppendPad(expected, 126);
+        AppendShort(expected, m, -128);
+        CHECK(Relaxed(Backward(m, 126)) == expected);
+
+        expected.clear();
+        AppendPad(expected, 127);
+        AppendNear(expected, m, -130);
+        CHECK(Relaxed(Backward(m, 127)) == expected);
+    }
+}
+
+// Displacements of -32768 and 32767 are near, one byte further is long
+void TestNearLimits() {
+    for (uint32_t m=0; m < 6; m++) {
+        std::vector<uint8_t> expected;
+        AppendNear(expected, m, 32767);
+        AppendPad(expected, 32767);
+        expected.push_back(NOP_OPCODE);
+        CHECK(Relaxed(Forward(m, 32767)) == expected);
+
+        expected.clear();
+        AppendLong(expected, m, 5 + 32768);
+        AppendPad(expected, 32768);
+        expected.push_back(NOP_OPCODE);
+        CHECK(Relaxed(Forward(m, 32768)) == expected);
+
+        expected.clear();
+        AppendPad(expected, 32765);
+        AppendNear(expected, m, -32768);
+        CHECK(Relaxed(Backward(m, 32765)) == expected);
+
+        expected.clear();
+        AppendPad(expected, 32766);
+        AppendLong(expected, m, 0);
+        CHECK(Relaxed(Backward(m, 32766)) == expected);
+    }
+}
+
+// A forward branch over other branches reaches its label short only once they are short too.
+// Its label is 157 bytes away in the long layout and 127 in the relaxed one.
+void TestShrinkingBranches() {
+    std::string text = "  JMP TARGET\n";
+    for (int i=0; i < 10; i++)
+        text += "  JE NEXT" + std::to_string(i) + "\nNEXT" + std::to_string(i) + ":\n";
+    text += Pad(107) + "TARGET:\n  NOP\n";
+
+    std::vector<uint8_t> expected;
+    AppendShort(expected, 0, 127);
+    for (int i=0; i < 10; i++)
+        AppendShort(expected, 1, 0);
+    AppendPad(expected, 107);
+    expected.push_back(NOP_OPCODE);
+    CHECK(Relaxed(text) == expected);
+}
+
+// A branch that must grow pushes the label of a branch before it out of short reach
+void TestGrowingBranches() {
+    for (uint32_t padding=124; padding <= 125; padding++) {
+        std::string text = "  JMP TARGET\n  CALL FAR\n" + Pad(padding) + "TARGET:\n" + Pad(200) + "FAR:\n  NOP\n";
+
+        std::vector<uint8_t> expected;
+        if (padding == 124)
+            AppendShort(expected, 0, 127);
+        else
+            AppendNear(expected, 0, 128);
+        AppendNear(expected, 5, padding + 200);
+        AppendPad(expected, padding + 200);
+        expected.push_back(NOP_OPCODE);
+        CHECK(Relaxed(text) == expected);
+    }
+}
+
+// Label addresses moved by relaxation are the ones MOV $label writes
+void TestLabelAddresses() {
+    std::string text = "  JMP TARGET\n  MOV AX, $TARGET\n" + Pad(10) + "TARGET:\n  NOP\n  MOV BX, $TARGET\n";
+
+    std::vector<uint8_t> expected;
+    AppendShort(expected, 0, 16);
+    AppendMove(expected, 0x00, 18);
+    AppendPad(expected, 10);
+    expected.push_back(NOP_OPCODE);
+    AppendMove(expected, 0x02, 18);
+    CHECK(Relaxed(text) == expected);
+}
+
+// Segments placed by ORG keep their bases, branches relax within them and across them
+void TestSegments() {
+    std::string text = "  JMP START\nORG 0x100\nSTART:\n  JMP END\n  JMP START\nEND:\n  NOP\n";
+
+    std::vector<uint8_t> expected;
+    AppendNear(expected, 0, 0x100 - 3);
+    expected.resize(0x100, 0);
+    AppendShort(expected, 0, 2);
+    AppendShort(expected, 0, -4);
+    expected.push_back(NOP_OPCODE);
+    CHECK(Relaxed(text) == expected);
+}
+
+
+int main() {
+    TestShortLimits();
+    TestNearLimits();
+    TestShrinkingBranches();
+    TestGrowingBranches();
+    TestLabelAddresses();
+    TestSegments();
+    return TestResult("relax_test");
+}
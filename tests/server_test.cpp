@@ -0,0 +1,122 @@
+// What a client sends to the assembler server and when it runs a command line itself
+//
+// Build next to the assembler sources:
+//   g++ -std=c++17 -O2 -pthread -I../src server_test.cpp ../src/assembler.cpp ../src/Types.cpp -o server_test
+//
+// A server runs on a socket in the temporary directory with a handler that refuses an empty command
+// line, as the assembler refuses a usage error, and answers any other one.
+
+#include <atomic>
+#include <cstdio>
+#include <filesystem>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "types.h"
+#include "server.h"
+
+#include "check.h"
+
+std::atomic<int> requestsRun(0);
+
+int HandleRequest(const ServerRequest& request, std::ostream& out, std::ostream& /*err*/) {
+    requestsRun++;
+    if (request.arguments.empty())
+        return SERVER_REFUSED;
+    out << "ran " << request.arguments[0];
+    return 3;
+}
+
+ServerRequest Request(const std::vector<std::string>& arguments) {
+    ServerRequest request;
+    request.directory = CurrentDirectory();
+    request.arguments = arguments;
+    request.hasSource = false;
+    return request;
+}
+
+
+// Only command lines that end with their request go to the server
+void TestServerRuns() {
+    CHECK(ServerRuns({"input.asm", "output.bin"}));
+    CHECK(ServerRuns({"--jobs=4", "--batch", "a.asm", "b.asm"}));
+    CHECK(!ServerRuns({"--watch", "input.asm"}));
+    CHECK(!ServerRuns({"input.asm", "--watch"}));
+    CHECK(!ServerRuns({"--lsp"}));
+    CHECK(!ServerRuns({"--server=/tmp/x4.sock"}));
+    CHECK(!ServerRuns({"--connect=/tmp/x4.sock", "input.asm"}));
+}
+
+void TestForwarding(const std::string& path) {
+    ServerResponse response;
+
+    // Run by the server, its status and output come back
+    int before = requestsRun;
+    CHECK(ForwardRequest(path, Request({"input.asm"}), response) == 0);
+    CHECK(response.status == 3);
+    CHECK(response.out == "ran input.asm");
+    CHECK(requestsRun == before + 1);
+
+    // A watch is never sent
+    before = requestsRun;
+    CHECK(ForwardRequest(path, Request({"--watch", "input.asm"}), response) == SERVER_REFUSED);
+    CHECK(requestsRun == before);
+
+    // Refused by the server, the client runs it
+    before = requestsRun;
+    CHECK(ForwardRequest(path, Request({}), response) == SERVER_REFUSED);
+    CHECK(requestsRun == before + 1);
+
+    // No server, the client runs it or reports that the server could not be reached
+    CHECK(ForwardRequest(path + ".missing", Request({"input.asm"}), response) == -1);
+}
+
+// Only the owner may use the socket, a connection from another user is closed unanswered
+void TestOtherUsers(const std::string& path) {
+    struct stat status;
+    CHECK(stat(path.c_str(), &status) == 0 && (status.st_mode & 0777) == 0600);
+
+    // Switching users takes root, the socket is opened to everyone so only the server refuses
+    if (geteuid() != 0)
+        return;
+    CHECK(chmod(path.c_str(), 0666) == 0);
+    int before = requestsRun;
+    pid_t child = fork();
+    if (child == 0) {
+        ServerResponse response;
+        if (setuid(65534) != 0)
+            _exit(2);
+        _exit((ForwardRequest(path, Request({"input.asm"}), response) == -1) ? 0 : 1);
+    }
+    int childStatus = -1;
+    CHECK(child > 0 && waitpid(child, &childStatus, 0) == child);
+    CHECK(WIFEXITED(childStatus) && WEXITSTATUS(childStatus) == 0);
+    CHECK(requestsRun == before);
+    CHECK(chmod(path.c_str(), 0600) == 0);
+}
+
+
+int main() {
+    TestServerRuns();
+
+    if (!AssemblerServer::Supported()) {
+        std::cout << "server_test: no server on this platform" << std::endl;
+        return TestResult("server_test");
+    }
+
+    std::string path = (std::filesystem::temp_directory_path() / ("x4-server-test-" + std::to_string(getpid()) + ".sock")).string();
+
+    // The server runs until the process exits
+    AssemblerServer* server = new AssemblerServer(path, HandleRequest);
+    if (CHECK(server->Listen() == 0)) {
+        std::thread([server]() {server->Run(2);}).detach();
+        TestForwarding(path);
+        TestOtherUsers(path);
+    }
+    std::remove(path.c_str());
+    return TestResult("server_test");
+}